@@ -0,0 +1,551 @@
+/*
+
+bench.c
+
+Throughput benchmark for c_json_stream. Runs representative workloads through
+each output mode and format (compact and human readable JSON, CBOR and
+MessagePack), and reports the output size, MB/s, calls/s and ns per call.
+Results are printed as a table, or with --json as one JSON object per line
+(written with this library) for comparing runs between releases.
+
+  bench [--json] [--quick] [workload ...]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "c_json_stream.h"
+
+#ifndef true
+#define true 1
+#endif
+
+#ifndef false
+#define false 0
+#endif
+
+/* Each measurement repeats its workload until at least this long has passed,
+   and reports the fastest repetition. */
+#define BENCH_MIN_SECONDS 0.25
+#define BENCH_MIN_REPS 3
+
+typedef enum {
+  BENCH_FILE,   /* json_init_stream to a FILE.                        */
+  BENCH_BUFFER, /* json_init_stream_buffer, the whole document in memory. */
+  BENCH_SINK    /* A sink that discards output: the generator alone.     */
+} bench_mode;
+
+static const char *bench_mode_names[] = { "file", "buffer", "sink" };
+
+/* A workload writes one document and returns the number of library calls it
+   made, or -1 on error. scale is 1 normally and smaller with --quick. */
+typedef long (*bench_fn)(json_stream_struct *js, long scale);
+
+typedef struct {
+  const char *name;
+  const char *description;
+  bench_fn run;
+  int json_only; /* Raw JSON or templates, which the binary encodings reject. */
+} bench_workload;
+
+typedef struct {
+  const char *name;
+  int human_readable;
+  json_encoding encoding;
+} bench_format;
+
+static const bench_format bench_formats[] = {
+  { "compact", false, JSON_ENCODING_JSON },
+  { "pretty", true, JSON_ENCODING_JSON },
+  { "cbor", false, JSON_ENCODING_CBOR },
+  { "msgpack", false, JSON_ENCODING_MSGPACK }
+};
+
+typedef struct {
+  double seconds;
+  size_t bytes;
+  long calls;
+} bench_result;
+
+
+
+static double bench_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+
+
+/* Counts what reaches the sink, and for the FILE mode wraps the file sink so
+   the bytes written can be counted the same way. */
+typedef struct {
+  json_sink inner;
+  size_t bytes;
+} bench_counter;
+
+static int bench_counter_write(void *user, const char *data, size_t len) {
+  bench_counter *counter = (bench_counter *)user;
+  counter->bytes += len;
+  return counter->inner.write ? counter->inner.write(counter->inner.user, data, len) : 0;
+}
+
+static int bench_counter_flush(void *user) {
+  bench_counter *counter = (bench_counter *)user;
+  return counter->inner.flush ? counter->inner.flush(counter->inner.user) : 0;
+}
+
+
+
+/* Workloads. */
+
+/* Flat numeric arrays, one call per element. */
+static long bench_flat_int64(json_stream_struct *js, long scale) {
+  long ii, count = 200000 / scale;
+
+  if(json_start_array(js)) return -1;
+  for(ii = 0; ii < count; ++ii) {
+    if(json_write_int64(js, ii * 7919 - 1000000)) return -1;
+  }
+  if(json_end_file(js)) return -1;
+  return count + 2;
+}
+
+static long bench_flat_double(json_stream_struct *js, long scale) {
+  long ii, count = 200000 / scale;
+
+  if(json_start_array(js)) return -1;
+  for(ii = 0; ii < count; ++ii) {
+    if(json_write_double(js, (double)ii * 0.731 - 5000.25)) return -1;
+  }
+  if(json_end_file(js)) return -1;
+  return count + 2;
+}
+
+/* The same numbers through the bulk writer, one call per 1000 elements. */
+static long bench_bulk_int64(json_stream_struct *js, long scale) {
+  int64_t values[1000];
+  long ii, jj, count = 200 / scale;
+
+  if(json_start_array(js)) return -1;
+  for(ii = 0; ii < count; ++ii) {
+    for(jj = 0; jj < 1000; ++jj) values[jj] = (ii * 1000 + jj) * 7919 - 1000000;
+    if(json_write_int64_array(js, values, 1000)) return -1;
+  }
+  if(json_end_file(js)) return -1;
+  return count + 2;
+}
+
+/* Objects nested close to the depth limit, repeatedly. */
+static long bench_nested(json_stream_struct *js, long scale) {
+  long ii, depth, count = 2000 / scale, calls = 2;
+  int max_depth = MAX_JSON_NESTED_DEPTH - 2;
+
+  if(json_start_array(js)) return -1;
+  for(ii = 0; ii < count; ++ii) {
+    if(json_start_object(js)) return -1;
+    for(depth = 1; depth < max_depth; ++depth) {
+      if(json_write_pair_int64_n(js, "depth", 5, depth)) return -1;
+      if(json_start_object_named_n(js, "child", 5)) return -1;
+    }
+    for(depth = 0; depth < max_depth; ++depth) {
+      if(json_end_context(js)) return -1;
+    }
+    calls += 1 + 2 * (max_depth - 1) + max_depth;
+  }
+  if(json_end_file(js)) return -1;
+  return calls;
+}
+
+/* Long strings where about one character in twenty needs escaping. */
+static long bench_long_strings(json_stream_struct *js, long scale) {
+  static char text[4096];
+  long ii, count = 5000 / scale;
+
+  if(!text[0]) {
+    for(ii = 0; ii < (long)sizeof(text); ++ii) {
+      text[ii] = ii % 20 == 19 ? (ii % 40 == 39 ? '"' : '\n') : (char)('a' + ii % 26);
+    }
+  }
+  if(json_start_array(js)) return -1;
+  for(ii = 0; ii < count; ++ii) {
+    if(json_write_value_n(js, JSON_STRING, text, sizeof(text))) return -1;
+  }
+  if(json_end_file(js)) return -1;
+  return count + 2;
+}
+
+/* 4 KB strings of mostly non-ASCII text, one character in twenty escaped, 
+   written under the given UTF-8 policy. */
+static long bench_utf8_strings(json_stream_struct *js, long scale, json_utf8_policy policy) {
+  static const char unit[] = "d\xc3\xa9j\xc3\xa0 \xd0\xb2\xd0\xb8\xd0\xb4\xe6\x97\xa5\xe6\x9c\xac\xf0\x9f\x98\x80\"";
+  static char text[4096];
+  long ii, count = 5000 / scale;
+
+  if(!text[0]) {
+    for(ii = 0; ii < (long)sizeof(text); ++ii) text[ii] = unit[ii % (sizeof(unit) - 1)];
+    /* End on a whole character. */
+    for(ii = sizeof(text) - 1; ((unsigned char)text[ii] & 0xC0) == 0x80; --ii) text[ii] = ' ';
+    text[ii] = ' ';
+  }
+  json_set_utf8_policy(js, policy);
+  if(json_start_array(js)) return -1;
+  for(ii = 0; ii < count; ++ii) {
+    if(json_write_value_n(js, JSON_STRING, text, sizeof(text))) return -1;
+  }
+  if(json_end_file(js)) return -1;
+  return count + 2;
+}
+
+static long bench_utf8_unchecked(json_stream_struct *js, long scale) {
+  return bench_utf8_strings(js, scale, JSON_UTF8_UNCHECKED);
+}
+
+static long bench_utf8_reject(json_stream_struct *js, long scale) {
+  return bench_utf8_strings(js, scale, JSON_UTF8_REJECT);
+}
+
+static long bench_utf8_replace(json_stream_struct *js, long scale) {
+  return bench_utf8_strings(js, scale, JSON_UTF8_REPLACE);
+}
+
+/* Many small records through json_write_pair, numbers passed as strings. */
+static long bench_small_records(json_stream_struct *js, long scale) {
+  char id[24], latency[24];
+  long ii, count = 50000 / scale;
+
+  if(json_start_array(js)) return -1;
+  for(ii = 0; ii < count; ++ii) {
+    sprintf(id, "%ld", 1000000 + ii);
+    sprintf(latency, "%ld", ii % 977);
+    if(json_start_object(js)) return -1;
+    if(json_write_pair(js, "id", JSON_NUMBER, id)) return -1;
+    if(json_write_pair(js, "level", JSON_STRING, "info")) return -1;
+    if(json_write_pair(js, "msg", JSON_STRING, "request served")) return -1;
+    if(json_write_pair(js, "latency", JSON_NUMBER, latency)) return -1;
+    if(json_write_pair(js, "cached", (ii & 1) ? JSON_TRUE : JSON_FALSE, NULL)) return -1;
+    if(json_end_context(js)) return -1;
+  }
+  if(json_end_file(js)) return -1;
+  return count * 7 + 2;
+}
+
+/* The same records with pre-encoded keys and native numbers. */
+static long bench_small_records_k(json_stream_struct *js, long scale) {
+  static const json_key id_key = JSON_KEY("id");
+  static const json_key level_key = JSON_KEY("level");
+  static const json_key msg_key = JSON_KEY("msg");
+  static const json_key latency_key = JSON_KEY("latency");
+  static const json_key cached_key = JSON_KEY("cached");
+  long ii, count = 50000 / scale;
+
+  if(json_start_array(js)) return -1;
+  for(ii = 0; ii < count; ++ii) {
+    if(json_start_object(js)) return -1;
+    if(json_write_pair_int64_k(js, &id_key, 1000000 + ii)) return -1;
+    if(json_write_pair_k(js, &level_key, JSON_STRING, "info", 4)) return -1;
+    if(json_write_pair_k(js, &msg_key, JSON_STRING, "request served", 14)) return -1;
+    if(json_write_pair_int64_k(js, &latency_key, ii % 977)) return -1;
+    if(json_write_pair_k(js, &cached_key, (ii & 1) ? JSON_TRUE : JSON_FALSE, NULL, 0)) return -1;
+    if(json_end_context(js)) return -1;
+  }
+  if(json_end_file(js)) return -1;
+  return count * 7 + 2;
+}
+
+/* The same records from a template recorded once, one call per record. */
+static long bench_template_records(json_stream_struct *js, long scale) {
+  json_template tpl;
+  json_hole_value values[5];
+  long ii, count = 50000 / scale;
+  int status;
+
+  json_template_begin(&tpl, js->human_readable, NULL);
+  status = json_start_object(&tpl.rec);
+  status = status?status:json_template_pair_hole_n(&tpl, "id", 2, JSON_FIELD_INT);
+  status = status?status:json_template_pair_hole_n(&tpl, "level", 5, JSON_FIELD_STRING);
+  status = status?status:json_template_pair_hole_n(&tpl, "msg", 3, JSON_FIELD_STRING);
+  status = status?status:json_template_pair_hole_n(&tpl, "latency", 7, JSON_FIELD_INT);
+  status = status?status:json_template_pair_hole_n(&tpl, "cached", 6, JSON_FIELD_BOOL);
+  status = status?status:json_end_context(&tpl.rec);
+  status = status?status:json_template_end(&tpl);
+
+  values[1].as.str = "info";
+  values[1].len = 4;
+  values[2].as.str = "request served";
+  values[2].len = 14;
+  status = status?status:json_start_array(js);
+  for(ii = 0; ii < count && !status; ++ii) {
+    values[0].as.i = 1000000 + ii;
+    values[3].as.i = ii % 977;
+    values[4].as.b = (int)(ii & 1);
+    status = json_write_template(js, &tpl, values);
+  }
+  status = status?status:json_end_file(js);
+  json_template_free(&tpl);
+  return status ? -1 : count + 2;
+}
+
+/* The same records from C structs through a descriptor, 1000 per call. */
+struct bench_record {
+  int64_t id;
+  const char *level;
+  const char *msg;
+  int32_t latency;
+  int cached;
+};
+
+static long bench_struct_records(json_stream_struct *js, long scale) {
+  static const json_field fields[] = {
+    JSON_FIELD(struct bench_record, id, JSON_FIELD_INT),
+    JSON_FIELD(struct bench_record, level, JSON_FIELD_STRING),
+    JSON_FIELD(struct bench_record, msg, JSON_FIELD_STRING),
+    JSON_FIELD(struct bench_record, latency, JSON_FIELD_INT),
+    JSON_FIELD(struct bench_record, cached, JSON_FIELD_BOOL)
+  };
+  static struct bench_record records[1000];
+  json_struct_desc desc;
+  long ii, jj, count = 50 / scale;
+  int status;
+
+  if(json_struct_desc_make(js, &desc, fields, sizeof(fields) / sizeof(fields[0]))) return -1;
+  status = json_start_array(js);
+  for(ii = 0; ii < count && !status; ++ii) {
+    for(jj = 0; jj < 1000; ++jj) {
+      records[jj].id = 1000000 + ii * 1000 + jj;
+      records[jj].level = "info";
+      records[jj].msg = "request served";
+      records[jj].latency = (int32_t)((ii * 1000 + jj) % 977);
+      records[jj].cached = (int)(jj & 1);
+    }
+    status = json_write_struct_array(js, &desc, records, 1000, sizeof(records[0]));
+  }
+  status = status?status:json_end_file(js);
+  json_struct_desc_free(js, &desc);
+  return status ? -1 : count + 2;
+}
+
+/* A cached 2 KB subdocument spliced into each record, trusted or validated. */
+static long bench_raw_records(json_stream_struct *js, long scale, int validate) {
+  static const json_key id_key = JSON_KEY("id");
+  static const json_key profile_key = JSON_KEY("profile");
+  static char profile[2048];
+  static size_t profile_len;
+  long ii, count = 20000 / scale;
+
+  if(!profile_len) {
+    profile_len = (size_t)sprintf(profile, "{\"name\": \"Possum\", \"bio\": \"");
+    while(profile_len < sizeof(profile) - 200) {
+      profile_len += (size_t)sprintf(profile + profile_len, "Nocturnal marsupial, caf\xc3\xa9 regular. ");
+    }
+    profile_len += (size_t)sprintf(profile + profile_len, "\", \"scores\": [1, 2.5, -3e2, 0], "
+                                   "\"flags\": {\"admin\": false, \"beta\": true}, \"manager\": null}");
+  }
+  if(json_start_array(js)) return -1;
+  for(ii = 0; ii < count; ++ii) {
+    if(json_start_object(js)) return -1;
+    if(json_write_pair_int64_k(js, &id_key, 1000000 + ii)) return -1;
+    if(json_write_raw_pair_k(js, &profile_key, profile, profile_len, validate)) return -1;
+    if(json_end_context(js)) return -1;
+  }
+  if(json_end_file(js)) return -1;
+  return count * 4 + 2;
+}
+
+static long bench_raw_trusted(json_stream_struct *js, long scale) {
+  return bench_raw_records(js, scale, 0);
+}
+
+static long bench_raw_validated(json_stream_struct *js, long scale) {
+  return bench_raw_records(js, scale, 1);
+}
+
+static const bench_workload bench_workloads[] = {
+  { "flat_int64", "json_write_int64 per element", bench_flat_int64, 0 },
+  { "flat_double", "json_write_double per element", bench_flat_double, 0 },
+  { "bulk_int64", "json_write_int64_array, 1000 elements per call", bench_bulk_int64, 0 },
+  { "nested", "objects nested to the depth limit", bench_nested, 0 },
+  { "long_strings", "4 KB strings, 5% escaped", bench_long_strings, 0 },
+  { "utf8_unchecked", "4 KB non-ASCII strings, 5% escaped", bench_utf8_unchecked, 0 },
+  { "utf8_reject", "the same, checked before writing", bench_utf8_reject, 0 },
+  { "utf8_replace", "the same, repaired while escaping", bench_utf8_replace, 0 },
+  { "small_records", "5-pair records via json_write_pair", bench_small_records, 0 },
+  { "small_records_k", "5-pair records via pre-encoded keys", bench_small_records_k, 0 },
+  { "template_records", "5-pair records via json_write_template", bench_template_records, 1 },
+  { "struct_records", "5-field records via json_write_struct_array", bench_struct_records, 0 },
+  { "raw_trusted", "records splicing a 2 KB cached subdocument", bench_raw_trusted, 1 },
+  { "raw_validated", "the same, validating each splice", bench_raw_validated, 1 }
+};
+
+
+
+/* Run one workload once in the given mode, timing everything from
+   initialization to release of the stream. */
+static int bench_run_once(const bench_workload *workload, bench_mode mode, const bench_format *format,
+                          long scale, FILE *file, bench_result *result) {
+  json_stream_struct json_stream;
+  json_stream_struct *js;
+  bench_counter counter;
+  json_sink sink;
+  double start;
+  long calls;
+
+  js = &json_stream;
+  counter.bytes = 0;
+  memset(&counter.inner, 0, sizeof(counter.inner));
+  if(mode == BENCH_FILE) {
+    rewind(file);
+    counter.inner = json_file_sink(file);
+  }
+  sink.write = bench_counter_write;
+  sink.writev = NULL;
+  sink.flush = bench_counter_flush;
+  sink.user = &counter;
+
+  start = bench_now();
+  if(mode == BENCH_BUFFER) {
+    json_init_stream_buffer(js, format->human_readable, NULL);
+  } else {
+    json_init_stream_sink(js, format->human_readable, &sink);
+  }
+  json_set_encoding(js, format->encoding);
+  calls = workload->run(js, scale);
+  result->seconds = bench_now() - start;
+
+  if(calls < 0) {
+    fprintf(stderr, "%s: %s\n", workload->name, js->error_string);
+    json_free_stream(js);
+    return -1;
+  }
+  result->bytes = mode == BENCH_BUFFER ? js->stream_buffer_len : counter.bytes;
+  result->calls = calls;
+  json_free_stream(js);
+  return 0;
+}
+
+
+
+/* Repeat a workload and keep the fastest run. */
+static int bench_measure(const bench_workload *workload, bench_mode mode, const bench_format *format,
+                         long scale, FILE *file, bench_result *best) {
+  bench_result result;
+  double total;
+  int reps;
+
+  total = 0;
+  for(reps = 0; reps < BENCH_MIN_REPS || (scale == 1 && total < BENCH_MIN_SECONDS); ++reps) {
+    if(bench_run_once(workload, mode, format, scale, file, &result)) return -1;
+    total += result.seconds;
+    if(reps == 0 || result.seconds < best->seconds) *best = result;
+  }
+  return 0;
+}
+
+
+
+static void bench_report_json(json_stream_struct *out, const bench_workload *workload, bench_mode mode,
+                              const bench_format *format, const bench_result *result) {
+  json_start_object(out);
+  json_write_pair_n(out, "workload", 8, JSON_STRING, workload->name, strlen(workload->name));
+  json_write_pair_n(out, "mode", 4, JSON_STRING, bench_mode_names[mode], strlen(bench_mode_names[mode]));
+  json_write_pair_n(out, "format", 6, JSON_STRING, format->name, strlen(format->name));
+  json_write_pair_n(out, "human_readable", 14, format->human_readable ? JSON_TRUE : JSON_FALSE, NULL, 0);
+  json_write_pair_uint64_n(out, "bytes", 5, result->bytes);
+  json_write_pair_int64_n(out, "calls", 5, result->calls);
+  json_write_pair_double_n(out, "seconds", 7, result->seconds);
+  json_write_pair_double_n(out, "mb_per_s", 8, (double)result->bytes / 1e6 / result->seconds);
+  json_write_pair_double_n(out, "calls_per_s", 11, (double)result->calls / result->seconds);
+  json_write_pair_double_n(out, "ns_per_call", 11, result->seconds * 1e9 / (double)result->calls);
+  json_end_context(out);
+}
+
+
+
+static void bench_report_text(const bench_workload *workload, bench_mode mode, const bench_format *format,
+                              const bench_result *result) {
+  printf("%-16s %-7s %-8s %10.1f %10.1f %12.0f %10.1f\n", workload->name, bench_mode_names[mode],
+         format->name, (double)result->bytes / 1e3, (double)result->bytes / 1e6 / result->seconds,
+         (double)result->calls / result->seconds, result->seconds * 1e9 / (double)result->calls);
+}
+
+
+
+int main(int argc, char **argv) {
+  json_stream_struct report_stream;
+  json_stream_struct *report;
+  bench_result result;
+  FILE *file;
+  size_t ww, ff, workload_count;
+  long scale;
+  int ii, json_output, selected, status;
+  bench_mode mode;
+
+  json_output = false;
+  scale = 1;
+  selected = 0;
+  for(ii = 1; ii < argc; ++ii) {
+    if(strcmp(argv[ii], "--json") == 0) {
+      json_output = true;
+    } else if(strcmp(argv[ii], "--quick") == 0) {
+      scale = 50;
+    } else if(argv[ii][0] == '-') {
+      fprintf(stderr, "usage: %s [--json] [--quick] [workload ...]\n\nworkloads:\n", argv[0]);
+      for(ww = 0; ww < sizeof(bench_workloads) / sizeof(bench_workloads[0]); ++ww) {
+        fprintf(stderr, "  %-16s %s\n", bench_workloads[ww].name, bench_workloads[ww].description);
+      }
+      return 2;
+    } else {
+      selected++;
+    }
+  }
+
+  /* The FILE mode writes to a temporary file, rewound before each run. */
+  file = tmpfile();
+  if(!file) {
+    fprintf(stderr, "Could not create a temporary file.\n");
+    return 1;
+  }
+
+  report = &report_stream;
+  if(json_output) {
+    json_init_stream(report, false, stdout);
+    json_set_record_mode(report, true, 1);
+  } else {
+    printf("%-16s %-7s %-8s %10s %10s %12s %10s\n", "workload", "mode", "format", "KB", "MB/s", "calls/s", "ns/call");
+  }
+
+  status = 0;
+  workload_count = sizeof(bench_workloads) / sizeof(bench_workloads[0]);
+  for(ww = 0; ww < workload_count; ++ww) {
+    if(selected) {
+      for(ii = 1; ii < argc; ++ii) {
+        if(strcmp(argv[ii], bench_workloads[ww].name) == 0) break;
+      }
+      if(ii == argc) continue;
+    }
+    for(mode = BENCH_FILE; mode <= BENCH_SINK; ++mode) {
+      for(ff = 0; ff < sizeof(bench_formats) / sizeof(bench_formats[0]); ++ff) {
+        if(bench_workloads[ww].json_only && bench_formats[ff].encoding != JSON_ENCODING_JSON) continue;
+        if(bench_measure(&bench_workloads[ww], mode, &bench_formats[ff], scale, file, &result)) {
+          status = 1;
+          continue;
+        }
+        if(json_output) {
+          bench_report_json(report, &bench_workloads[ww], mode, &bench_formats[ff], &result);
+        } else {
+          bench_report_text(&bench_workloads[ww], mode, &bench_formats[ff], &result);
+        }
+      }
+    }
+  }
+
+  if(json_output) {
+    json_end_file(report);
+    json_free_stream(report);
+  }
+  fclose(file);
+  return status;
+}
@@ -10,434 +10,4825 @@ Interface. This is intended to serve the same purpose; a tool exists solely
 to easily write JSON-formatted data. 
 
 This library enforces the structural constraints of JSON (objects, arrays, members, 
-pairs, elements), but does not enforce JSON string or number formatting rules. 
+pairs, elements), and escapes names and string values. Numbers written with the
+native number writers are always well formed; numbers passed as JSON_NUMBER strings
+are written as given. 
+
+The same calls can also produce CBOR or MessagePack instead of JSON text; see 
+json_set_encoding.
 
 */
 
+/* mremap is a Linux extension. */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <float.h>
 #include "c_json_stream.h"
 
+#ifdef JSON_HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/* Whether a stream prints newlines and indentation. Constant in compact-only 
+   builds, so that every formatting branch is compiled out. */
+#ifdef JSON_COMPACT_ONLY
+#define JS_HUMAN_READABLE(js) 0
+#else
+#define JS_HUMAN_READABLE(js) ((js)->human_readable != 0)
+#endif
+
+/* Whether a stream writes CBOR or MessagePack rather than JSON text. */
+#define JS_BINARY(js) ((js)->encoding != JSON_ENCODING_JSON)
+
+/* A MessagePack stream keeps its output in the stream buffer while any object
+   or array is open, so that sizes can be filled in when they close. */
+#define JS_PACK_HOLDING(js) ((js)->encoding == JSON_ENCODING_MSGPACK && (js)->stack_depth > 0)
+
+/* Size of an object or array whose members are not counted up front. */
+#define JS_PACK_INDEFINITE ((size_t)-1)
+
+/* The type of context open at level, counting the outermost as 1. */
+#define JS_FRAME(js, level) \
+  ((((js)->frame_bits[((level) - 1) / 32] >> (((level) - 1) % 32)) & 1u) ? JSON_ARRAY : JSON_OBJECT)
+
+/* Instrumentation hooks. A single test of js->stats when counting is off, and
+   nothing at all in builds with JSON_NO_STATS. */
+#ifdef JSON_HAVE_STATS
+#define JS_STAT_CALL(js, call) do { if((js)->stats) (js)->stats->calls[call]++; } while(0)
+#define JS_STAT_DEPTH(js, depth) \
+  do { if((js)->stats && (depth) > (js)->stats->max_depth) (js)->stats->max_depth = (depth); } while(0)
+#else
+#define JS_STAT_CALL(js, call) do { } while(0)
+#define JS_STAT_DEPTH(js, depth) do { } while(0)
+#endif
+
+#ifdef JSON_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef JSON_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef JSON_HAVE_POSIX
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <time.h>
+#endif
+
+
+
+/* Built-in sink writing to a stdio FILE. */
+static int js_file_sink_write(void *user, const char *data, size_t len) {
+  return fwrite(data, 1, len, (FILE *)user) == len ? 0 : -1;
+}
+
+static int js_file_sink_flush(void *user) {
+  return fflush((FILE *)user) == 0 ? 0 : -1;
+}
+
+json_sink json_file_sink(FILE *out_file) {
+  json_sink sink;
+  sink.write = js_file_sink_write;
+  sink.writev = NULL; /* stdio has no gathered write; each fragment is fwritten. */
+  sink.flush = js_file_sink_flush;
+  sink.user = out_file;
+  return sink;
+}
+
+
+
+#ifdef JSON_HAVE_POSIX
+/* Built-in sink writing to a raw file descriptor, bypassing stdio. */
+static int js_fd_sink_write(void *user, const char *data, size_t len) {
+  int fd = (int)(intptr_t)user;
+  ssize_t written;
+
+  while(len > 0) {
+    written = write(fd, data, len);
+    if(written < 0) {
+      if(errno == EINTR) continue;
+      return -1;
+    }
+    data += written;
+    len -= (size_t)written;
+  }
+  return 0;
+}
+
+static int js_fd_sink_writev(void *user, const json_iovec *iov, int iovcnt) {
+  int fd = (int)(intptr_t)user;
+  struct iovec vec[JSON_MAX_IOV];
+  ssize_t written;
+  int ii, first;
+
+  for(ii = 0; ii < iovcnt; ++ii) {
+    vec[ii].iov_base = (void *)iov[ii].data;
+    vec[ii].iov_len = iov[ii].len;
+  }
+
+  /* writev may stop short; resume from wherever it left off. */
+  first = 0;
+  while(first < iovcnt) {
+    written = writev(fd, vec + first, iovcnt - first);
+    if(written < 0) {
+      if(errno == EINTR) continue;
+      return -1;
+    }
+    while(first < iovcnt && (size_t)written >= vec[first].iov_len) {
+      written -= (ssize_t)vec[first].iov_len;
+      ++first;
+    }
+    if(first < iovcnt) {
+      vec[first].iov_base = (char *)vec[first].iov_base + written;
+      vec[first].iov_len -= (size_t)written;
+    }
+  }
+  return 0;
+}
+
+json_sink json_fd_sink(int fd) {
+  json_sink sink;
+  sink.write = js_fd_sink_write;
+  sink.writev = js_fd_sink_writev;
+  sink.flush = NULL;
+  sink.user = (void *)(intptr_t)fd;
+  return sink;
+}
+
+
+
+/* Built-in sink copying into a shared mapping of the output file. */
+int json_mmap_open(json_mmap_file *mf, int fd, size_t chunk, int policy) {
+  long page = sysconf(_SC_PAGESIZE);
+
+  if(page <= 0) page = 4096;
+  if(chunk == 0) chunk = JSON_MMAP_CHUNK;
+  chunk = (chunk + (size_t)page - 1) / (size_t)page * (size_t)page;
+
+  mf->fd = fd;
+  mf->policy = policy;
+  mf->map = NULL;
+  mf->map_len = 0;
+  mf->file_len = 0;
+  mf->len = 0;
+  mf->chunk = chunk;
+  mf->retired = 0;
+
+  /* Nothing is mapped until the first write; start from an empty file. */
+  return ftruncate(fd, 0) == 0 ? 0 : -1;
+}
+
+
+
+/* Make the file and mapping cover at least need bytes. */
+static int js_mmap_grow(json_mmap_file *mf, size_t need) {
+  size_t old_len, new_len;
+  void *map;
+
+  old_len = mf->map_len;
+  new_len = mf->map_len;
+  while(new_len < need) new_len += mf->chunk;
+
+  /* A flush trims the file back to len; the mapping outlives it. */
+  if(ftruncate(mf->fd, (off_t)new_len) != 0) return -1;
+  mf->file_len = new_len;
+  if(new_len == mf->map_len) return 0;
+
+  if(!mf->map) {
+    map = mmap(NULL, new_len, PROT_READ | PROT_WRITE, MAP_SHARED, mf->fd, 0);
+  } else {
+#ifdef __linux__
+    map = mremap(mf->map, mf->map_len, new_len, MREMAP_MAYMOVE);
+#else
+    munmap(mf->map, mf->map_len);
+    mf->map = NULL;
+    mf->map_len = 0;
+    map = mmap(NULL, new_len, PROT_READ | PROT_WRITE, MAP_SHARED, mf->fd, 0);
+#endif
+  }
+  if(map == MAP_FAILED) return -1;
+  mf->map = (char *)map;
+  mf->map_len = new_len;
+
+  if(mf->policy & JSON_MMAP_SEQUENTIAL) madvise(mf->map, mf->map_len, MADV_SEQUENTIAL);
+#ifdef MADV_POPULATE_WRITE
+  /* Fault the new chunks in with one call rather than a page at a time. Older
+     kernels reject the advice, and the pages fault in as they are written. */
+  madvise(mf->map + old_len, new_len - old_len, MADV_POPULATE_WRITE);
+#endif
+  return 0;
+}
+
+
+
+/* Apply the per-chunk policies to each whole chunk written since the last one. */
+static void js_mmap_retire(json_mmap_file *mf) {
+  size_t end;
+
+  if(!(mf->policy & (JSON_MMAP_DONTNEED | JSON_MMAP_ASYNC))) return;
+  if(mf->len - mf->retired < mf->chunk) return;
+
+  /* Only whole pages; chunk is a multiple of the page size. */
+  end = mf->len / mf->chunk * mf->chunk;
+  if(mf->policy & JSON_MMAP_ASYNC) msync(mf->map + mf->retired, end - mf->retired, MS_ASYNC);
+  if(mf->policy & JSON_MMAP_DONTNEED) madvise(mf->map + mf->retired, end - mf->retired, MADV_DONTNEED);
+  mf->retired = end;
+}
+
+
+
+static int js_mmap_sink_write(void *user, const char *data, size_t len) {
+  json_mmap_file *mf = (json_mmap_file *)user;
+
+  if(len == 0) return 0;
+  if(mf->len + len > mf->file_len && js_mmap_grow(mf, mf->len + len) != 0) return -1;
+  memcpy(mf->map + mf->len, data, len);
+  mf->len += len;
+  js_mmap_retire(mf);
+  return 0;
+}
+
+static int js_mmap_sink_writev(void *user, const json_iovec *iov, int iovcnt) {
+  json_mmap_file *mf = (json_mmap_file *)user;
+  size_t total;
+  int ii;
+
+  /* Grow once for the whole batch. */
+  total = 0;
+  for(ii = 0; ii < iovcnt; ++ii) total += iov[ii].len;
+  if(mf->len + total > mf->file_len && js_mmap_grow(mf, mf->len + total) != 0) return -1;
+
+  for(ii = 0; ii < iovcnt; ++ii) {
+    memcpy(mf->map + mf->len, iov[ii].data, iov[ii].len);
+    mf->len += iov[ii].len;
+  }
+  js_mmap_retire(mf);
+  return 0;
+}
+
+/* Trim the file to what has been written. */
+static int js_mmap_sink_flush(void *user) {
+  json_mmap_file *mf = (json_mmap_file *)user;
+
+  if(mf->file_len != mf->len) {
+    if(ftruncate(mf->fd, (off_t)mf->len) != 0) return -1;
+    mf->file_len = mf->len;
+  }
+  if((mf->policy & JSON_MMAP_SYNC) && mf->len > 0) {
+    if(msync(mf->map, mf->len, MS_SYNC) != 0) return -1;
+  }
+  return 0;
+}
+
+json_sink json_mmap_sink(json_mmap_file *mf) {
+  json_sink sink;
+  sink.write = js_mmap_sink_write;
+  sink.writev = js_mmap_sink_writev;
+  sink.flush = js_mmap_sink_flush;
+  sink.user = mf;
+  return sink;
+}
+
+
+
+int json_mmap_close(json_mmap_file *mf) {
+  int status;
+
+  status = js_mmap_sink_flush(mf);
+  if(mf->map) munmap(mf->map, mf->map_len);
+  mf->map = NULL;
+  mf->map_len = 0;
+  return status;
+}
+#endif
+
+
+
+#ifdef JSON_HAVE_THREADS
+/* Built-in sink handing full buffers to a thread that writes them to a file
+   descriptor, so that the generator does not wait on the disk. */
+static void *js_async_thread(void *user) {
+  json_async_file *af = (json_async_file *)user;
+  int index, status;
+
+  pthread_mutex_lock(&af->lock);
+  for(;;) {
+    while(af->queued == 0 && !af->stop) pthread_cond_wait(&af->work_ready, &af->lock);
+    if(af->queued == 0) break;
+    index = af->next_write;
+    pthread_mutex_unlock(&af->lock);
+
+    /* After a failure, buffers are still drained so the generator never blocks. */
+    status = 0;
+    if(!af->error) {
+      status = js_fd_sink_write((void *)(intptr_t)af->fd, af->buffers[index], af->buffer_lens[index]);
+    }
+
+    pthread_mutex_lock(&af->lock);
+    if(status && !af->error) af->error = errno ? errno : EIO;
+    af->next_write = (index + 1) % af->buffer_count;
+    af->queued--;
+    pthread_cond_broadcast(&af->work_done);
+  }
+  pthread_mutex_unlock(&af->lock);
+  return NULL;
+}
+
+
+
+int json_async_open(json_async_file *af, int fd, size_t buffer_size, int buffer_count, int durable) {
+  int ii;
+
+  if(buffer_size == 0) buffer_size = JSON_ASYNC_BUFFER_LEN;
+  if(buffer_count <= 0) buffer_count = JSON_ASYNC_BUFFER_COUNT;
+  if(buffer_count < 2) buffer_count = 2;
+
+  af->fd = fd;
+  af->durable = durable;
+  af->buffer_size = buffer_size;
+  af->buffer_count = buffer_count;
+  af->next_write = 0;
+  af->queued = 0;
+  af->stop = 0;
+  af->error = 0;
+  af->buffers = (char **)calloc((size_t)buffer_count, sizeof(char *));
+  af->buffer_lens = (size_t *)calloc((size_t)buffer_count, sizeof(size_t));
+  if(!af->buffers || !af->buffer_lens) goto fail;
+  for(ii = 0; ii < buffer_count; ++ii) {
+    af->buffers[ii] = (char *)malloc(buffer_size);
+    if(!af->buffers[ii]) goto fail;
+  }
+
+  if(pthread_mutex_init(&af->lock, NULL) != 0) goto fail;
+  if(pthread_cond_init(&af->work_ready, NULL) != 0) goto fail_lock;
+  if(pthread_cond_init(&af->work_done, NULL) != 0) goto fail_ready;
+  if(pthread_create(&af->thread, NULL, js_async_thread, af) != 0) goto fail_done;
+  return 0;
+
+fail_done:
+  pthread_cond_destroy(&af->work_done);
+fail_ready:
+  pthread_cond_destroy(&af->work_ready);
+fail_lock:
+  pthread_mutex_destroy(&af->lock);
+fail:
+  if(af->buffers) {
+    for(ii = 0; ii < buffer_count; ++ii) free(af->buffers[ii]);
+  }
+  free(af->buffers);
+  free(af->buffer_lens);
+  af->buffers = NULL;
+  af->buffer_lens = NULL;
+  return -1;
+}
+
+
+
+/* Queue the buffer being filled, then wait until there is a free one to fill. 
+   Called with the lock held. */
+static void js_async_submit(json_async_file *af) {
+  af->queued++;
+  pthread_cond_signal(&af->work_ready);
+  while(af->queued == af->buffer_count) pthread_cond_wait(&af->work_done, &af->lock);
+  af->buffer_lens[(af->next_write + af->queued) % af->buffer_count] = 0;
+}
+
+
+
+static int js_async_sink_write(void *user, const char *data, size_t len) {
+  json_async_file *af = (json_async_file *)user;
+  size_t room, part;
+  int fill, status;
+
+  pthread_mutex_lock(&af->lock);
+  while(len > 0 && !af->error) {
+    /* Only this thread touches the buffer being filled, but the lock is held
+       throughout so that next_write and queued are read consistently. */
+    fill = (af->next_write + af->queued) % af->buffer_count;
+    room = af->buffer_size - af->buffer_lens[fill];
+    part = len < room ? len : room;
+    memcpy(af->buffers[fill] + af->buffer_lens[fill], data, part);
+    af->buffer_lens[fill] += part;
+    data += part;
+    len -= part;
+    if(af->buffer_lens[fill] == af->buffer_size) js_async_submit(af);
+  }
+  status = af->error ? -1 : 0;
+  pthread_mutex_unlock(&af->lock);
+  return status;
+}
+
+/* Hand over the partly filled buffer and wait for the thread to catch up. */
+static int js_async_sink_flush(void *user) {
+  json_async_file *af = (json_async_file *)user;
+  int fill, status;
+
+  pthread_mutex_lock(&af->lock);
+  fill = (af->next_write + af->queued) % af->buffer_count;
+  if(af->buffer_lens[fill] > 0) js_async_submit(af);
+  while(af->queued > 0) pthread_cond_wait(&af->work_done, &af->lock);
+  status = af->error ? -1 : 0;
+  pthread_mutex_unlock(&af->lock);
+
+#ifdef __linux__
+  if(!status && af->durable && fdatasync(af->fd) != 0) status = -1;
+#else
+  if(!status && af->durable && fsync(af->fd) != 0) status = -1;
+#endif
+  return status;
+}
+
+json_sink json_async_sink(json_async_file *af) {
+  json_sink sink;
+  sink.write = js_async_sink_write;
+  sink.writev = NULL; /* Fragments are copied into the ring one at a time. */
+  sink.flush = js_async_sink_flush;
+  sink.user = af;
+  return sink;
+}
+
+
+
+int json_async_close(json_async_file *af) {
+  int status, ii;
+
+  if(!af->buffers) return -1;
+  status = js_async_sink_flush(af);
+
+  pthread_mutex_lock(&af->lock);
+  af->stop = 1;
+  pthread_cond_signal(&af->work_ready);
+  pthread_mutex_unlock(&af->lock);
+  pthread_join(af->thread, NULL);
+
+  pthread_cond_destroy(&af->work_done);
+  pthread_cond_destroy(&af->work_ready);
+  pthread_mutex_destroy(&af->lock);
+  for(ii = 0; ii < af->buffer_count; ++ii) free(af->buffers[ii]);
+  free(af->buffers);
+  free(af->buffer_lens);
+  af->buffers = NULL;
+  af->buffer_lens = NULL;
+  return status;
+}
+#endif
+
+
+
+#ifdef JSON_HAVE_COMPRESSION
+/* Built-in sink compressing output on its way to another sink. */
+
+/* Longest input handed to the compressor at once; zlib counts in 32 bits. */
+#define JS_COMPRESS_MAX_RUN ((size_t)1 << 30)
+
+typedef enum {
+  JS_COMPRESS_CONTINUE,
+  JS_COMPRESS_FLUSH,
+  JS_COMPRESS_FINISH
+} js_compress_mode;
+
+/* Pass len bytes of compressed output on to the next sink. */
+static int js_compress_emit(json_compressor *jc, size_t len) {
+  if(len == 0) return 0;
+  jc->bytes_out += len;
+  return jc->next.write(jc->next.user, jc->out, len);
+}
+
+/* Run len characters through the compressor, emitting whatever it produces. */
+static int js_compress_run(json_compressor *jc, const char *data, size_t len, js_compress_mode mode) {
+#ifdef JSON_HAVE_ZLIB
+  if(jc->format != JSON_COMPRESS_ZSTD) {
+    z_stream *zs = (z_stream *)jc->state;
+    int flush = mode == JS_COMPRESS_CONTINUE ? Z_NO_FLUSH : mode == JS_COMPRESS_FLUSH ? Z_SYNC_FLUSH : Z_FINISH;
+
+    zs->next_in = (Bytef *)data;
+    zs->avail_in = (uInt)len;
+    /* Input is consumed, and any flush complete, once output space is left over. */
+    do {
+      zs->next_out = (Bytef *)jc->out;
+      zs->avail_out = JSON_COMPRESS_BUFFER_LEN;
+      if(deflate(zs, flush) == Z_STREAM_ERROR) return -1;
+      if(js_compress_emit(jc, JSON_COMPRESS_BUFFER_LEN - zs->avail_out)) return -1;
+    } while(zs->avail_out == 0);
+    return 0;
+  }
+#endif
+#ifdef JSON_HAVE_ZSTD
+  {
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    ZSTD_EndDirective end = mode == JS_COMPRESS_CONTINUE ? ZSTD_e_continue : 
+                            mode == JS_COMPRESS_FLUSH ? ZSTD_e_flush : ZSTD_e_end;
+    size_t remaining;
+
+    in.src = data;
+    in.size = len;
+    in.pos = 0;
+    do {
+      out.dst = jc->out;
+      out.size = JSON_COMPRESS_BUFFER_LEN;
+      out.pos = 0;
+      remaining = ZSTD_compressStream2((ZSTD_CCtx *)jc->state, &out, &in, end);
+      if(ZSTD_isError(remaining)) return -1;
+      if(js_compress_emit(jc, out.pos)) return -1;
+    } while(end == ZSTD_e_continue ? in.pos < in.size : remaining != 0);
+    return 0;
+  }
+#else
+  return -1;
+#endif
+}
+
+
+
+int json_compress_open(json_compressor *jc, const json_sink *next, json_compress_format format, 
+                       int level, size_t flush_every) {
+  jc->format = format;
+  jc->next = *next;
+  jc->state = NULL;
+  jc->flush_every = flush_every;
+  jc->since_flush = 0;
+  jc->bytes_in = 0;
+  jc->bytes_out = 0;
+  jc->out = (char *)malloc(JSON_COMPRESS_BUFFER_LEN);
+  if(!jc->out) return -1;
+
+  switch(format) {
+#ifdef JSON_HAVE_ZLIB
+  case JSON_COMPRESS_GZIP:
+  case JSON_COMPRESS_ZLIB:
+    /* calloc leaves zalloc, zfree and opaque as Z_NULL, selecting malloc. */
+    jc->state = calloc(1, sizeof(z_stream));
+    if(!jc->state) break;
+    /* Adding 16 to the window bits selects the gzip wrapper. */
+    if(deflateInit2((z_stream *)jc->state, level ? level : Z_DEFAULT_COMPRESSION, Z_DEFLATED, 
+                    format == JSON_COMPRESS_GZIP ? MAX_WBITS + 16 : MAX_WBITS, 
+                    8, Z_DEFAULT_STRATEGY) == Z_OK) return 0;
+    free(jc->state);
+    jc->state = NULL;
+    break;
+#endif
+#ifdef JSON_HAVE_ZSTD
+  case JSON_COMPRESS_ZSTD:
+    jc->state = ZSTD_createCCtx();
+    if(!jc->state) break;
+    if(!ZSTD_isError(ZSTD_CCtx_setParameter((ZSTD_CCtx *)jc->state, ZSTD_c_compressionLevel, 
+                                            level ? level : ZSTD_CLEVEL_DEFAULT))) return 0;
+    ZSTD_freeCCtx((ZSTD_CCtx *)jc->state);
+    jc->state = NULL;
+    break;
+#endif
+  default:
+    break;
+  }
+
+  free(jc->out);
+  jc->out = NULL;
+  return -1;
+}
+
+
+
+static int js_compress_sink_write(void *user, const char *data, size_t len) {
+  json_compressor *jc = (json_compressor *)user;
+  js_compress_mode mode;
+  size_t part;
+
+  while(len > 0) {
+    /* Stop at the next flush point, if it falls within this fragment. */
+    part = len < JS_COMPRESS_MAX_RUN ? len : JS_COMPRESS_MAX_RUN;
+    if(jc->flush_every && part > jc->flush_every - jc->since_flush) {
+      part = jc->flush_every - jc->since_flush;
+    }
+    jc->since_flush += part;
+    mode = JS_COMPRESS_CONTINUE;
+    if(jc->flush_every && jc->since_flush == jc->flush_every) {
+      mode = JS_COMPRESS_FLUSH;
+      jc->since_flush = 0;
+    }
+
+    if(js_compress_run(jc, data, part, mode)) return -1;
+    jc->bytes_in += part;
+    data += part;
+    len -= part;
+  }
+  return 0;
+}
+
+/* Add a flush point, so that everything written so far can be decoded. */
+static int js_compress_sink_flush(void *user) {
+  json_compressor *jc = (json_compressor *)user;
+
+  if(js_compress_run(jc, NULL, 0, JS_COMPRESS_FLUSH)) return -1;
+  jc->since_flush = 0;
+  if(jc->next.flush) return jc->next.flush(jc->next.user);
+  return 0;
+}
+
+json_sink json_compress_sink(json_compressor *jc) {
+  json_sink sink;
+  sink.write = js_compress_sink_write;
+  sink.writev = NULL; /* Fragments are compressed one at a time. */
+  sink.flush = js_compress_sink_flush;
+  sink.user = jc;
+  return sink;
+}
+
+
+
+int json_compress_close(json_compressor *jc) {
+  int status;
+
+  if(!jc->state) return -1;
+  status = js_compress_run(jc, NULL, 0, JS_COMPRESS_FINISH);
+  if(!status && jc->next.flush) status = jc->next.flush(jc->next.user);
+
+#ifdef JSON_HAVE_ZLIB
+  if(jc->format != JSON_COMPRESS_ZSTD) {
+    deflateEnd((z_stream *)jc->state);
+    free(jc->state);
+  }
+#endif
+#ifdef JSON_HAVE_ZSTD
+  if(jc->format == JSON_COMPRESS_ZSTD) ZSTD_freeCCtx((ZSTD_CCtx *)jc->state);
+#endif
+  jc->state = NULL;
+  free(jc->out);
+  jc->out = NULL;
+  return status;
+}
+#endif
+
 
 
 /* Function to initialize a stream tracking object. */
 void json_init_stream(json_stream_struct *js, int human_readable, FILE *out_file) {
   js->human_readable = human_readable;
-  strcpy(js->indent_token, "  ");
+  js->indent_run = NULL;
+  js->indent_run_levels = 0;
+  js->indent_token_len = 0;
   js->file_started = 0;
   js->prior_element = JSON_NULL; /* Indicates no prior element in object, array, or file. */
   js->stack_depth = 0; /* Stack depth counting starts at 1. */
+  js->max_depth = MAX_JSON_NESTED_DEPTH;
+  js->fragment_depth = 0;
+  js->record_mode = 0;
+  js->records_per_flush = 0;
+  js->records_pending = 0;
   js->out = out_file;
-  strcpy(js->error_string, "");
+  if(out_file) {
+    js->sink = json_file_sink(out_file);
+  } else {
+    memset(&js->sink, 0, sizeof(js->sink));
+  }
+  js->flush_threshold = JSON_FLUSH_THRESHOLD;
+  js->pending_iov = NULL;
+  js->pending_iovcnt = 0;
+  js->pending_gathered = 0;
+  js->stream_buffer = NULL;
+  js->stream_buffer_len = 0;
+  js->stream_buffer_cap = 0;
+  js->pull_offset = 0;
+  js->retain_buffer = 0;
+  js->realloc_fn = realloc;
+  js->escape_strings = 1;
+  js->utf8_policy = JSON_UTF8_UNCHECKED;
+  js->error_code = JSON_OK;
+  js->error_string = "";
+  js->encoding = JSON_ENCODING_JSON;
+  js->pack_frames = NULL;
+  js->pack_frames_cap = 0;
   js->string_sanitize_fn = NULL;
+#ifdef JSON_HAVE_STATS
+  js->stats = NULL;
+  js->stats_flags = 0;
+  js->stats_mark = 0;
+#endif
 };
 
 
 
-/* Either write a string to a file or append it to the stream buffer. */
-int write_str(json_stream_struct *js, const char *str) {
-  if(js->out) {
-    fprintf(js->out, str);
-    return 0;
+/* Initialize a stream that accumulates the whole document in stream_buffer. */
+void json_init_stream_buffer(json_stream_struct *js, int human_readable, json_realloc_fn realloc_fn) {
+  json_init_stream(js, human_readable, NULL);
+  js->retain_buffer = 1;
+  if(realloc_fn) js->realloc_fn = realloc_fn;
+}
+
+
+
+/* Initialize a stream that writes to a caller-supplied sink. */
+void json_init_stream_sink(json_stream_struct *js, int human_readable, const json_sink *sink) {
+  json_init_stream(js, human_readable, NULL);
+  js->sink = *sink;
+}
+
+
+
+#ifdef JSON_HAVE_STATS
+/* Add buffer-mode output not yet counted to stats->bytes. Sink-mode output is
+   counted as it is handed to the sink. */
+void js_stats_count_buffer(json_stream_struct *js) {
+  if(js->sink.write) return;
+  if(js->stream_buffer_len < js->stats_mark) js->stats_mark = 0; /* Emptied by the caller. */
+  js->stats->bytes += js->stream_buffer_len - js->stats_mark;
+  js->stats_mark = js->stream_buffer_len;
+}
+
+
+
+/* Start and finish timing a call into the sink. */
+uint64_t js_stats_sink_start(json_stream_struct *js) {
+#ifdef JSON_HAVE_POSIX
+  struct timespec ts;
+
+  if(js->stats_flags & JSON_STATS_TIME_SINK) {
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
   }
-  if(strlen(js->stream_buffer) + strlen(str) >= JSON_STRING_BUFFER_LEN) {
-    strcpy(js->error_string, "Stream buffer too small for the current write operation.");
-    return -1;
+#else
+  (void)js;
+#endif
+  return 0;
+}
+
+void js_stats_sink_end(json_stream_struct *js, uint64_t start) {
+  uint64_t end;
+
+  end = js_stats_sink_start(js);
+  if(end > start) js->stats->sink_ns += end - start;
+}
+#endif
+
+
+
+int json_flush_internal(json_stream_struct *js);
+
+/* Release what the stream allocated, flushing pending sink output first. The 
+   stream buffer is emptied but not released if keep_buffer is set. */
+void js_release_stream(json_stream_struct *js, int keep_buffer) {
+  json_flush_internal(js);
+#ifdef JSON_HAVE_STATS
+  if(js->stats) js_stats_count_buffer(js);
+#endif
+  if(keep_buffer && js->stream_buffer) {
+    js->stream_buffer[0] = '\0';
+  } else {
+    if(js->stream_buffer) {
+      js->realloc_fn(js->stream_buffer, 0);
+    }
+    js->stream_buffer = NULL;
+    js->stream_buffer_cap = 0;
+  }
+  js->stream_buffer_len = 0;
+  js->pull_offset = 0;
+  if(js->indent_run) {
+    js->realloc_fn(js->indent_run, 0);
+  }
+  js->indent_run = NULL;
+  js->indent_run_levels = 0;
+  if(js->pending_iov) {
+    js->realloc_fn(js->pending_iov, 0);
+  }
+  js->pending_iov = NULL;
+  js->pending_iovcnt = 0;
+  if(js->pack_frames) {
+    js->realloc_fn(js->pack_frames, 0);
+  }
+  js->pack_frames = NULL;
+  js->pack_frames_cap = 0;
+}
+
+
+
+/* Release the stream buffer, if one was allocated. Pending sink output is flushed first. */
+void json_free_stream(json_stream_struct *js) {
+  js_release_stream(js, 0);
+}
+
+
+
+/* Stream pools. Slabs of streams are linked through their headers, and free 
+   streams are kept on a stack of pointers with room for every stream. */
+typedef struct js_pool_slab {
+  struct js_pool_slab *next;
+  json_stream_struct streams[1];
+} js_pool_slab;
+
+void json_pool_init(json_stream_pool *pool, size_t slab_streams, size_t keep_buffer_cap, 
+                    json_realloc_fn realloc_fn) {
+  pool->realloc_fn = realloc_fn ? realloc_fn : realloc;
+  pool->slab_streams = slab_streams ? slab_streams : 64;
+  pool->keep_buffer_cap = keep_buffer_cap ? keep_buffer_cap : 65536;
+  pool->slabs = NULL;
+  pool->free_list = NULL;
+  pool->free_count = 0;
+  pool->free_cap = 0;
+}
+
+
+
+/* Add a slab of streams to the free stack. */
+int js_pool_grow(json_stream_pool *pool) {
+  json_stream_struct **free_list;
+  js_pool_slab *slab;
+  size_t ii;
+
+  free_list = (json_stream_struct **)pool->realloc_fn(pool->free_list, 
+                  (pool->free_cap + pool->slab_streams) * sizeof(*free_list));
+  if(!free_list) return -1;
+  pool->free_list = free_list;
+  pool->free_cap += pool->slab_streams;
+
+  slab = (js_pool_slab *)pool->realloc_fn(NULL, offsetof(js_pool_slab, streams) + 
+                                               pool->slab_streams * sizeof(json_stream_struct));
+  if(!slab) return -1;
+  slab->next = (js_pool_slab *)pool->slabs;
+  pool->slabs = slab;
+
+  /* Pushed in reverse, so that streams are handed out in address order. */
+  for(ii = pool->slab_streams; ii > 0; --ii) {
+    slab->streams[ii - 1].stream_buffer = NULL;
+    slab->streams[ii - 1].stream_buffer_cap = 0;
+    pool->free_list[pool->free_count++] = &slab->streams[ii - 1];
   }
-  strcat(js->stream_buffer, str);
   return 0;
 }
 
 
 
-/* Utility function to print human-readable indentation. */
-int js_newline(json_stream_struct *js) {
-  /* If this is the start of a new file, do not preceed with a newline. */
-  if(js->file_started != 0 && js->human_readable != 0) {
-    return(write_str(js, "\n"));
+json_stream_struct *json_pool_acquire(json_stream_pool *pool, int human_readable, const json_sink *sink) {
+  json_stream_struct *js;
+  char *buffer;
+  size_t cap;
+
+  if(pool->free_count == 0 && js_pool_grow(pool)) return NULL;
+  js = pool->free_list[--pool->free_count];
+
+  /* Initialization forgets the kept buffer, so carry it across. */
+  buffer = js->stream_buffer;
+  cap = js->stream_buffer_cap;
+  if(sink) {
+    json_init_stream_sink(js, human_readable, sink);
+  } else {
+    json_init_stream_buffer(js, human_readable, NULL);
+  }
+  js->realloc_fn = pool->realloc_fn;
+  js->stream_buffer = buffer;
+  js->stream_buffer_cap = cap;
+  return js;
+}
+
+
+
+void json_pool_release(json_stream_pool *pool, json_stream_struct *js) {
+  js_release_stream(js, js->stream_buffer_cap <= pool->keep_buffer_cap);
+  pool->free_list[pool->free_count++] = js;
+}
+
+
+
+void json_pool_free(json_stream_pool *pool) {
+  js_pool_slab *slab, *next;
+  size_t ii;
+
+  for(ii = 0; ii < pool->free_count; ++ii) {
+    if(pool->free_list[ii]->stream_buffer) pool->realloc_fn(pool->free_list[ii]->stream_buffer, 0);
+  }
+  for(slab = (js_pool_slab *)pool->slabs; slab; slab = next) {
+    next = slab->next;
+    pool->realloc_fn(slab, 0);
+  }
+  if(pool->free_list) pool->realloc_fn(pool->free_list, 0);
+  json_pool_init(pool, pool->slab_streams, pool->keep_buffer_cap, pool->realloc_fn);
+}
+
+
+
+/* Descriptions and kinds of the error codes, in json_error order. The kind of
+   JSON_OK is unused. */
+static const struct {
+  const char *message;
+  json_error_kind kind;
+} js_errors[JSON_ERROR_CODES] = {
+  { "", JSON_ERROR_KIND_STRUCTURE },
+  { "Attempted to open an object when file is already complete.", JSON_ERROR_KIND_STRUCTURE },
+  { "Attempted to open an object when not starting a file or in array context.", JSON_ERROR_KIND_STRUCTURE },
+  { "Attempted to open an array when file is already complete.", JSON_ERROR_KIND_STRUCTURE },
+  { "Attempted to open an array when not starting a file or in array context.", JSON_ERROR_KIND_STRUCTURE },
+  { "Attempted to start a named object when no context is open.", JSON_ERROR_KIND_STRUCTURE },
+  { "Attempted to open a named object outside an object context.", JSON_ERROR_KIND_STRUCTURE },
+  { "Attempted to start a named array when no context is open.", JSON_ERROR_KIND_STRUCTURE },
+  { "Attempted to open a named array outside an object context.", JSON_ERROR_KIND_STRUCTURE },
+  { "Attempted to close a context when none is open.", JSON_ERROR_KIND_STRUCTURE },
+  { "Attempted to close a context the fragment did not open.", JSON_ERROR_KIND_STRUCTURE },
+  { "Attempted to print a single value when no context is open.", JSON_ERROR_KIND_STRUCTURE },
+  { "Attempted to print a single value outside an array context.", JSON_ERROR_KIND_STRUCTURE },
+  { "Attempted to print a pair when no context is open.", JSON_ERROR_KIND_STRUCTURE },
+  { "Attempted to print a name: value pair outside an object context.", JSON_ERROR_KIND_STRUCTURE },
+  { "Attempted to nest objects and arrays deeper than the depth limit.", JSON_ERROR_KIND_STRUCTURE },
+  { "Attempted to start a fragment outside an array context.", JSON_ERROR_KIND_STRUCTURE },
+  { "Attempted to splice a fragment outside an array context.", JSON_ERROR_KIND_STRUCTURE },
+  { "Attempted to splice a fragment at a different depth than it was started.", JSON_ERROR_KIND_STRUCTURE },
+  { "Attempted to splice a fragment with open contexts.", JSON_ERROR_KIND_STRUCTURE },
+  { "Attempted to print a single value of an invalid type.", JSON_ERROR_KIND_VALUE },
+  { "Attempted to print a name: value pair value of an invalid value type.", JSON_ERROR_KIND_VALUE },
+  { "Attempted to print a number that is not finite.", JSON_ERROR_KIND_VALUE },
+  { "Attempted to encode number text that is not a JSON number.", JSON_ERROR_KIND_VALUE },
+  { "Attempted to splice raw JSON that is not a single valid value.", JSON_ERROR_KIND_VALUE },
+  { "Attempted to write a string that is not valid UTF-8.", JSON_ERROR_KIND_VALUE },
+  { "Attempted to add a template hole of an invalid type.", JSON_ERROR_KIND_VALUE },
+  { "Attempted to finish or write a template that is not one complete object or array.", JSON_ERROR_KIND_STRUCTURE },
+  { "Attempted a call or an encoding the stream's output encoding does not support.", JSON_ERROR_KIND_VALUE },
+  { "Attempted to change the output encoding after writing started.", JSON_ERROR_KIND_STRUCTURE },
+  { "Attempted to describe a struct field of an invalid type or size.", JSON_ERROR_KIND_VALUE },
+  { "Attempted to set a depth limit outside 1 to MAX_JSON_NESTED_DEPTH.", JSON_ERROR_KIND_VALUE },
+  { "Instrumentation was not built into this library.", JSON_ERROR_KIND_VALUE },
+  { "Stream buffer too small for the current write operation.", JSON_ERROR_KIND_MEMORY },
+  { "Could not allocate the indentation run.", JSON_ERROR_KIND_MEMORY },
+  { "Could not allocate a key.", JSON_ERROR_KIND_MEMORY },
+  { "Could not allocate a struct descriptor.", JSON_ERROR_KIND_MEMORY },
+  { "Could not allocate template holes.", JSON_ERROR_KIND_MEMORY },
+  { "Failed to write to the output sink.", JSON_ERROR_KIND_OUTPUT }
+};
+
+
+
+/* Record an error, counting it by kind. */
+void js_set_error(json_stream_struct *js, json_error code) {
+  js->error_code = code;
+  js->error_string = js_errors[code].message;
+#ifdef JSON_HAVE_STATS
+  if(js->stats) js->stats->errors[js_errors[code].kind]++;
+#endif
+}
+
+
+
+const char *json_error_message(json_error code) {
+  return (unsigned)code < JSON_ERROR_CODES ? js_errors[code].message : "Unknown error.";
+}
+
+
+
+/* Make room for at least len more characters (plus the NUL) in the stream buffer. 
+   Capacity is doubled so that appends are amortized constant time. */
+int js_grow_buffer(json_stream_struct *js, size_t len) {
+  size_t needed, new_cap;
+  char *new_buffer;
+
+  needed = js->stream_buffer_len + len + 1;
+  if(needed <= js->stream_buffer_cap) return 0;
+
+  new_cap = js->stream_buffer_cap ? js->stream_buffer_cap : JSON_STRING_BUFFER_LEN;
+  while(new_cap < needed) new_cap *= 2;
+
+  new_buffer = js->realloc_fn(js->stream_buffer, new_cap);
+  if(!new_buffer) {
+    js_set_error(js, JSON_ERROR_NO_MEMORY);
+    return -1;
+  }
+  js->stream_buffer = new_buffer;
+  js->stream_buffer_cap = new_cap;
+  return 0;
+}
+
+
+
+/* Set the number of buffered characters at which sink output is written out. */
+void json_set_flush_threshold(json_stream_struct *js, size_t threshold) {
+  js->flush_threshold = threshold;
+}
+
+
+
+/* Lower (or restore) the nesting limit. */
+int json_set_max_depth(json_stream_struct *js, int depth) {
+  if(depth < 1 || depth > MAX_JSON_NESTED_DEPTH) {
+    js_set_error(js, JSON_ERROR_DEPTH_LIMIT);
+    return -1;
+  }
+  js->max_depth = depth;
+  return 0;
+}
+
+
+
+void json_set_utf8_policy(json_stream_struct *js, json_utf8_policy policy) {
+  js->utf8_policy = policy;
+}
+
+
+
+/* Select JSON, CBOR or MessagePack output. Binary output has no layout. */
+int json_set_encoding(json_stream_struct *js, json_encoding encoding) {
+  if((unsigned)encoding > JSON_ENCODING_MSGPACK) {
+    js_set_error(js, JSON_ERROR_ENCODING);
+    return -1;
+  }
+  if(js->file_started != 0 || js->stack_depth > 0) {
+    js_set_error(js, JSON_ERROR_ENCODING_STARTED);
+    return -1;
+  }
+  js->encoding = encoding;
+  if(encoding != JSON_ENCODING_JSON) js->human_readable = 0;
+  return 0;
+}
+
+
+
+/* Switch between writing a single document and a stream of records. */
+void json_set_record_mode(json_stream_struct *js, int enabled, size_t records_per_flush) {
+  js->record_mode = enabled;
+  js->records_per_flush = records_per_flush;
+  js->records_pending = 0;
+}
+
+
+
+/* Start or stop counting this stream's activity into stats. */
+int json_set_stats(json_stream_struct *js, json_stats *stats, int flags) {
+#ifdef JSON_HAVE_STATS
+  js->stats = stats;
+  js->stats_flags = flags;
+  js->stats_mark = js->stream_buffer_len; /* Output already buffered is not counted. */
+  if(stats) JS_STAT_DEPTH(js, js->stack_depth);
+  return 0;
+#else
+  (void)stats;
+  (void)flags;
+  js_set_error(js, JSON_ERROR_UNSUPPORTED);
+  return -1;
+#endif
+}
+
+
+
+/* Copy out the counters, and optionally zero them. */
+void json_stats_snapshot(json_stream_struct *js, json_stats *snapshot, int reset) {
+#ifdef JSON_HAVE_STATS
+  if(js->stats) {
+    js_stats_count_buffer(js);
+    *snapshot = *js->stats;
+    if(reset) memset(js->stats, 0, sizeof(*js->stats));
+    return;
+  }
+#else
+  (void)js;
+  (void)reset;
+#endif
+  memset(snapshot, 0, sizeof(*snapshot));
+}
+
+
+
+/* Names for the counters, for export. */
+const char *json_call_name(json_call_kind call) {
+  static const char *names[JSON_CALL_KINDS] = {
+    "start_object", "start_array", "end_context", "write_value", "write_pair", "write_number",
+    "write_pair_number", "write_array", "write_struct_array", "write_raw",
+    "write_template", "splice_fragment", "flush", "end_file"
+  };
+  return (unsigned)call < JSON_CALL_KINDS ? names[call] : "unknown";
+}
+
+const char *json_error_kind_name(json_error_kind kind) {
+  static const char *names[JSON_ERROR_KINDS] = { "structure", "value", "memory", "output" };
+  return (unsigned)kind < JSON_ERROR_KINDS ? names[kind] : "unknown";
+}
+
+
+
+/* Close the run of buffered characters not yet covered by a pending iovec. 
+   Its data pointer stays NULL until dispatch, since the buffer may still move. */
+void js_close_gathered_run(json_stream_struct *js) {
+  size_t run;
+
+  run = js->stream_buffer_len - js->pending_gathered;
+  if(run > 0) {
+    js->pending_iov[js->pending_iovcnt].data = NULL;
+    js->pending_iov[js->pending_iovcnt].len = run;
+    js->pending_iovcnt++;
+    js->pending_gathered = js->stream_buffer_len;
+  }
+}
+
+
+
+/* Hand the buffered output and any gathered caller fragments to the sink as one batch. */
+int js_write_buffered(json_stream_struct *js) {
+  int ii, iovcnt, status;
+  size_t offset;
+  json_iovec single, *iov;
+#ifdef JSON_HAVE_STATS
+  uint64_t start = 0;
+#endif
+
+  if(js->pending_iovcnt == 0) {
+    /* Nothing gathered: the buffer alone, which needs no pending_iov. */
+    single.data = js->stream_buffer;
+    single.len = js->stream_buffer_len;
+    iov = &single;
+    iovcnt = single.len > 0 ? 1 : 0;
+  } else {
+    js_close_gathered_run(js);
+
+    offset = 0;
+    for(ii = 0; ii < js->pending_iovcnt; ++ii) {
+      if(!js->pending_iov[ii].data) {
+        js->pending_iov[ii].data = js->stream_buffer + offset;
+        offset += js->pending_iov[ii].len;
+      }
+    }
+    iov = js->pending_iov;
+    iovcnt = js->pending_iovcnt;
+  }
+
+#ifdef JSON_HAVE_STATS
+  if(js->stats) {
+    for(ii = 0; ii < iovcnt; ++ii) js->stats->bytes += iov[ii].len;
+    if(iovcnt > 0) js->stats->sink_writes += (iovcnt > 1 && !js->sink.writev) ? iovcnt : 1;
+    start = js_stats_sink_start(js);
+  }
+#endif
+
+  status = 0;
+  if(iovcnt == 1) {
+    status = js->sink.write(js->sink.user, iov[0].data, iov[0].len);
+  } else if(iovcnt > 1 && js->sink.writev) {
+    status = js->sink.writev(js->sink.user, iov, iovcnt);
+  } else {
+    for(ii = 0; ii < iovcnt && !status; ++ii) {
+      status = js->sink.write(js->sink.user, iov[ii].data, iov[ii].len);
+    }
+  }
+
+#ifdef JSON_HAVE_STATS
+  if(js->stats) js_stats_sink_end(js, start);
+#endif
+
+  js->pending_iovcnt = 0;
+  js->pending_gathered = 0;
+  js->stream_buffer_len = 0;
+  if(status) {
+    js_set_error(js, JSON_ERROR_SINK);
+    return -1;
+  }
+  return 0;
+}
+
+
+
+/* Write any buffered output to the sink and flush the sink. */
+int json_flush_internal(json_stream_struct *js) {
+  int status;
+#ifdef JSON_HAVE_STATS
+  uint64_t start = 0;
+#endif
+
+  /* A MessagePack document cannot be written out until its sizes are known. */
+  if(!js->sink.write || JS_PACK_HOLDING(js)) return 0;
+  status = js_write_buffered(js);
+  if(status) return status;
+  if(!js->sink.flush) return 0;
+
+#ifdef JSON_HAVE_STATS
+  if(js->stats) {
+    js->stats->sink_flushes++;
+    start = js_stats_sink_start(js);
+  }
+#endif
+  status = js->sink.flush(js->sink.user);
+#ifdef JSON_HAVE_STATS
+  if(js->stats) js_stats_sink_end(js, start);
+#endif
+
+  if(status != 0) {
+    js_set_error(js, JSON_ERROR_SINK);
+    return -1;
+  }
+  return 0;
+}
+
+int json_flush(json_stream_struct *js) {
+  JS_STAT_CALL(js, JSON_CALL_FLUSH);
+  return json_flush_internal(js);
+}
+
+
+
+/* Drop the pulled characters from the front of the stream buffer. */
+void js_pull_compact(json_stream_struct *js) {
+  int ii;
+
+#ifdef JSON_HAVE_STATS
+  if(js->stats) js_stats_count_buffer(js);
+#endif
+  js->stream_buffer_len -= js->pull_offset;
+  memmove(js->stream_buffer, js->stream_buffer + js->pull_offset, js->stream_buffer_len + 1);
+  if(JS_PACK_HOLDING(js)) {
+    for(ii = 0; ii < js->stack_depth; ++ii) js->pack_frames[ii].header -= js->pull_offset;
+  }
+  js->pull_offset = 0;
+#ifdef JSON_HAVE_STATS
+  js->stats_mark = js->stream_buffer_len;
+#endif
+}
+
+
+
+/* Incremental output from a buffer-mode stream. pull_offset marks the first
+   character not yet taken; nothing is pending when writing to a sink. An open
+   MessagePack document is not pending until it closes. */
+size_t json_pull_pending(const json_stream_struct *js) {
+  if(js->sink.write || !js->stream_buffer) return 0;
+  if(JS_PACK_HOLDING(js)) return js->pack_frames[0].header - js->pull_offset;
+  return js->stream_buffer_len - js->pull_offset;
+}
+
+
+
+const char *json_pull_data(const json_stream_struct *js, size_t *len) {
+  *len = json_pull_pending(js);
+  return *len ? js->stream_buffer + js->pull_offset : NULL;
+}
+
+
+
+void json_pull_consume(json_stream_struct *js, size_t len) {
+  size_t pending;
+
+  pending = json_pull_pending(js);
+  if(len > pending) len = pending;
+  js->pull_offset += len;
+  if(len > 0 && js->pull_offset == js->stream_buffer_len) js_pull_compact(js);
+}
+
+
+
+size_t json_pull(json_stream_struct *js, char *out, size_t avail) {
+  size_t len;
+
+  len = json_pull_pending(js);
+  if(len > avail) len = avail;
+  if(len > 0) memcpy(out, js->stream_buffer + js->pull_offset, len);
+  json_pull_consume(js, len);
+  return len;
+}
+
+
+
+/* Called at the start of each API call. Unless the whole document is being
+   retained, discard whatever the previous call left in the stream buffer. 
+   When writing to a sink, buffered output is kept until js_end_call sends it.
+   An open MessagePack document is kept until it closes. */
+int js_reset_buffer(json_stream_struct *js) {
+  int status;
+  if(js->sink.write) {
+    /* Caller fragments left behind by a failed call may no longer be valid. */
+    if(js->pending_iovcnt > 0) {
+      js->pending_iovcnt = 0;
+      js->pending_gathered = 0;
+    }
+    return 0;
+  }
+  if(!js->retain_buffer && !JS_PACK_HOLDING(js)) {
+#ifdef JSON_HAVE_STATS
+    if(js->stats) {
+      js_stats_count_buffer(js);
+      js->stats_mark = 0;
+    }
+#endif
+    js->stream_buffer_len = 0;
+    js->pull_offset = 0;
+  } else if(js->pull_offset > 0 && js->pull_offset >= js->stream_buffer_len - js->pull_offset) {
+    /* More has been pulled than remains, so moving the remainder down costs 
+       no more than the pulls did. */
+    js_pull_compact(js);
+  }
+  status = js_grow_buffer(js, 0);
+  if(status) return status;
+  js->stream_buffer[js->stream_buffer_len] = '\0';
+  return 0;
+}
+
+
+
+/* Called on the way out of each API call that wrote output. Caller fragments 
+   gathered by reference must reach the sink before the call returns; otherwise
+   buffered output is only sent once it reaches the flush threshold. */
+int js_end_call(json_stream_struct *js, int status) {
+  int flush_status;
+
+  if(js->records_per_flush && js->records_pending >= js->records_per_flush) {
+    js->records_pending = 0;
+    flush_status = json_flush_internal(js);
+    return status ? status : flush_status;
+  }
+
+  if(!js->sink.write || JS_PACK_HOLDING(js)) return status;
+  if(js->pending_iovcnt > 0 || 
+     (js->stream_buffer_len > 0 && js->stream_buffer_len >= js->flush_threshold)) {
+    flush_status = js_write_buffered(js);
+    if(!status) status = flush_status;
+  }
+  return status;
+}
+
+
+
+/* Allocate the gathered batch on a sink stream's first gathered write. A stream
+   that cannot have one copies instead. */
+int js_alloc_iov(json_stream_struct *js) {
+  js->pending_iov = (json_iovec *)js->realloc_fn(NULL, JSON_MAX_IOV * sizeof(json_iovec));
+  return js->pending_iov ? 0 : -1;
+}
+
+
+
+/* Append len characters to the stream buffer. When writing to a sink, fragments
+   too large to be worth copying are gathered by reference instead, unless an 
+   open MessagePack document has to stay in the buffer. */
+int write_bytes(json_stream_struct *js, const char *str, size_t len) {
+  char *out;
+  size_t ii;
+  int status;
+
+  /* Fast path: punctuation, keys and short values that fit. A byte loop beats
+     a call to memcpy at these lengths. */
+  if(len <= 16 && js->stream_buffer_len + len < js->stream_buffer_cap && 
+     (!js->sink.write || (len < js->flush_threshold && len < JSON_GATHER_MIN_LEN))) {
+    out = js->stream_buffer + js->stream_buffer_len;
+    for(ii = 0; ii < len; ++ii) out[ii] = str[ii];
+    out[len] = '\0';
+    js->stream_buffer_len += len;
+    return 0;
+  }
+
+  if(js->sink.write && (len >= js->flush_threshold || len >= JSON_GATHER_MIN_LEN) && 
+     !JS_PACK_HOLDING(js) && js->pending_iovcnt + 2 <= JSON_MAX_IOV && (js->pending_iov || js_alloc_iov(js) == 0)) {
+    js_close_gathered_run(js);
+    js->pending_iov[js->pending_iovcnt].data = str;
+    js->pending_iov[js->pending_iovcnt].len = len;
+    js->pending_iovcnt++;
+    return 0;
+  }
+  status = js_grow_buffer(js, len);
+  if(status) return status;
+  memcpy(js->stream_buffer + js->stream_buffer_len, str, len);
+  js->stream_buffer_len += len;
+  js->stream_buffer[js->stream_buffer_len] = '\0';
+  return 0;
+}
+
+
+
+/* Room for formatting in place: at least len characters past the write cursor. */
+char *js_reserve(json_stream_struct *js, size_t len) {
+  if(js_grow_buffer(js, len)) return NULL;
+  return js->stream_buffer + js->stream_buffer_len;
+}
+
+
+
+/* Record that len reserved characters were filled in. */
+void js_commit(json_stream_struct *js, size_t len) {
+  js->stream_buffer_len += len;
+  js->stream_buffer[js->stream_buffer_len] = '\0';
+}
+
+
+
+/* The default indentation, two spaces per level. */
+static const char js_default_indent[] = "  ";
+
+
+
+/* Make the indentation run cover at least depth levels. The run is a newline 
+   followed by depth copies of the indent token, so that the line break and
+   indentation before any element are written as a single slice. The old run
+   is freed, so it must only grow before a call has gathered a reference to 
+   it: do_indent grows it on the first indentation of a call, and a writer 
+   that indents more than one level deeper within one call grows it to the 
+   deepest level up front. */
+int js_grow_indent(json_stream_struct *js, int depth) {
+  const char *token;
+  size_t token_len, levels, ii;
+  char *run;
+
+  levels = js->indent_run_levels ? js->indent_run_levels : 16;
+  while(levels < (size_t)depth) levels *= 2;
+
+  token = js->indent_run ? js->indent_run + 1 : js_default_indent;
+  token_len = js->indent_run ? js->indent_token_len : sizeof(js_default_indent) - 1;
+
+  run = js->realloc_fn(js->indent_run, 1 + levels * token_len);
+  if(!run) {
+    js_set_error(js, JSON_ERROR_NO_MEMORY_INDENT);
+    return -1;
+  }
+  run[0] = '\n';
+  if(!js->indent_run) memcpy(run + 1, token, token_len);
+  for(ii = 1; ii < levels; ++ii) memcpy(run + 1 + ii * token_len, run + 1, token_len);
+
+  js->indent_run = run;
+  js->indent_run_levels = levels;
+  js->indent_token_len = token_len;
+  return 0;
+}
+
+
+
+/* Set the token repeated once per level of human-readable indentation. */
+int json_set_indent(json_stream_struct *js, const char *token) {
+  size_t token_len, levels;
+  char *run;
+
+  token_len = strlen(token);
+  levels = js->indent_run_levels ? js->indent_run_levels : 16;
+  run = js->realloc_fn(js->indent_run, 1 + levels * token_len);
+  if(!run) {
+    js_set_error(js, JSON_ERROR_NO_MEMORY_INDENT);
+    return -1;
+  }
+  memcpy(run + 1, token, token_len);
+  js->indent_run = run;
+  js->indent_run_levels = 1;
+  js->indent_token_len = token_len;
+  return js_grow_indent(js, (int)levels);
+}
+
+
+
+/* Utility function to print a human-readable newline and indentation. */
+int do_indent(json_stream_struct *js) {
+  int status;
+  /* If this is the start of a new file, do not preceed with a newline. */
+  if(JS_HUMAN_READABLE(js) && js->file_started != 0) {
+    if(!js->indent_run || (size_t)js->stack_depth > js->indent_run_levels) {
+      status = js_grow_indent(js, js->stack_depth);
+      if(status) return status;
+    }
+    return write_bytes(js, js->indent_run, 1 + (size_t)js->stack_depth * js->indent_token_len);
+  }
+  return 0;
+}
+
+
+
+/* Utility function to print a comma when needed and record that an element has 
+   been printed inside the current context. */
+int new_element(json_stream_struct *js) {
+  int status;
+  /* Element names from the JSON structure are abused here because they make
+     readable labels. */
+
+  /* The binary encodings have no separators, but MessagePack counts elements. */
+  if(JS_BINARY(js)) {
+    if(js->encoding == JSON_ENCODING_MSGPACK && js->stack_depth > 0) js->pack_frames[js->stack_depth - 1].count++;
+    js->prior_element = JSON_ELEMENT;
+    return 0;
+  }
+
+  /* JSON_ELEMENT indicates that this is not the first element of an object or array. */
+  if(js->prior_element == JSON_ELEMENT) {
+    status = write_bytes(js, ",", 1);
+    if(status) return status;
+  } else { /* JSON_NULL indicates that there was not a prior element. */
+    js->prior_element = JSON_ELEMENT;
+  }
+  return 0;
+}
+
+
+
+/* Utility function. Permit a callback for string sanitization to be defined. 
+   NULL by default. (TODO: Are there C/C++ issues here?) */
+/*void (*string_sanitize_fn)(char *str) = NULL;*/
+
+void sanitize_string(json_stream_struct *js, char *str) {
+  if(js->string_sanitize_fn) {
+    (*(js->string_sanitize_fn))(str);
+  }
+}
+
+
+
+/* String escaping (RFC 8259 section 7). Quotation marks, reverse solidi and control
+   characters must be escaped; everything else is copied through unchanged. The 
+   scan for the next byte needing an escape is the hot loop, so it is vectorized
+   where the compiler and CPU allow, with the implementation picked at runtime. */
+
+/* Returns the offset of the first byte in str[0, len) that needs escaping, or len. 
+   The raw scans used to validate raw JSON also stop at non-ASCII bytes, so 
+   that multibyte sequences can be checked. The UTF-8 scans return the length
+   of the longest well-formed prefix instead. */
+typedef size_t (*js_escape_scan_fn)(const char *str, size_t len);
+
+#define JS_NEEDS_ESCAPE(c) ((unsigned char)(c) < 0x20 || (c) == '"' || (c) == '\\')
+#define JS_ENDS_RAW_RUN(c) (JS_NEEDS_ESCAPE(c) || (unsigned char)(c) >= 0x80)
+
+static size_t js_escape_scan_scalar(const char *str, size_t len) {
+  size_t ii;
+  for(ii = 0; ii < len; ++ii) {
+    if(JS_NEEDS_ESCAPE(str[ii])) return ii;
+  }
+  return len;
+}
+
+static size_t js_raw_scan_scalar(const char *str, size_t len) {
+  size_t ii;
+  for(ii = 0; ii < len; ++ii) {
+    if(JS_ENDS_RAW_RUN(str[ii])) return ii;
+  }
+  return len;
+}
+
+/* Returns the length of the well-formed UTF-8 sequence (RFC 3629) at the start
+   of str[0, len), or 0 if it is truncated, overlong, a surrogate or past U+10FFFF. */
+size_t js_utf8_sequence(const char *str, size_t len) {
+  const unsigned char *s = (const unsigned char *)str;
+
+  if(s[0] < 0x80) return 1;
+  if(s[0] < 0xC2) return 0;
+  if(s[0] < 0xE0) {
+    return len >= 2 && (s[1] & 0xC0) == 0x80 ? 2 : 0;
+  }
+  if(s[0] < 0xF0) {
+    if(len < 3 || (s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80) return 0;
+    if(s[0] == 0xE0 && s[1] < 0xA0) return 0;
+    if(s[0] == 0xED && s[1] >= 0xA0) return 0;
+    return 3;
+  }
+  if(s[0] < 0xF5) {
+    if(len < 4 || (s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80 || (s[3] & 0xC0) != 0x80) return 0;
+    if(s[0] == 0xF0 && s[1] < 0x90) return 0;
+    if(s[0] == 0xF4 && s[1] >= 0x90) return 0;
+    return 4;
+  }
+  return 0;
+}
+
+static size_t js_utf8_scan_scalar(const char *str, size_t len) {
+  size_t ii, seq_len;
+
+  ii = 0;
+  while(ii < len) {
+    if((unsigned char)str[ii] < 0x80) {
+      ii++;
+      continue;
+    }
+    seq_len = js_utf8_sequence(str + ii, len - ii);
+    if(!seq_len) return ii;
+    ii += seq_len;
+  }
+  return len;
+}
+
+#ifdef JSON_HAVE_X86_SIMD
+static size_t js_escape_scan_sse2(const char *str, size_t len) {
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control_max = _mm_set1_epi8(0x1F);
+  __m128i chunk, hits;
+  size_t ii;
+  int mask;
+
+  for(ii = 0; ii + 16 <= len; ii += 16) {
+    chunk = _mm_loadu_si128((const __m128i *)(str + ii));
+    /* Unsigned chunk <= 0x1F is the same as min(chunk, 0x1F) == chunk. */
+    hits = _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(_mm_min_epu8(chunk, control_max), chunk));
+    mask = _mm_movemask_epi8(hits);
+    if(mask) return ii + (size_t)__builtin_ctz((unsigned)mask);
+  }
+  return ii + js_escape_scan_scalar(str + ii, len - ii);
+}
+
+__attribute__((target("avx2")))
+static size_t js_escape_scan_avx2(const char *str, size_t len) {
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  const __m256i control_max = _mm256_set1_epi8(0x1F);
+  __m256i chunk, hits;
+  size_t ii;
+  unsigned mask;
+
+  for(ii = 0; ii + 32 <= len; ii += 32) {
+    chunk = _mm256_loadu_si256((const __m256i *)(str + ii));
+    hits = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote), _mm256_cmpeq_epi8(chunk, backslash));
+    hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(_mm256_min_epu8(chunk, control_max), chunk));
+    mask = (unsigned)_mm256_movemask_epi8(hits);
+    if(mask) return ii + (size_t)__builtin_ctz(mask);
+  }
+  return ii + js_escape_scan_sse2(str + ii, len - ii);
+}
+
+/* The raw scans add the high bit of each byte, which movemask reads directly. */
+static size_t js_raw_scan_sse2(const char *str, size_t len) {
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control_max = _mm_set1_epi8(0x1F);
+  __m128i chunk, hits;
+  size_t ii;
+  int mask;
+
+  for(ii = 0; ii + 16 <= len; ii += 16) {
+    chunk = _mm_loadu_si128((const __m128i *)(str + ii));
+    hits = _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(_mm_min_epu8(chunk, control_max), chunk));
+    mask = _mm_movemask_epi8(_mm_or_si128(hits, chunk));
+    if(mask) return ii + (size_t)__builtin_ctz((unsigned)mask);
+  }
+  return ii + js_raw_scan_scalar(str + ii, len - ii);
+}
+
+__attribute__((target("avx2")))
+static size_t js_raw_scan_avx2(const char *str, size_t len) {
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  const __m256i control_max = _mm256_set1_epi8(0x1F);
+  __m256i chunk, hits;
+  size_t ii;
+  unsigned mask;
+
+  for(ii = 0; ii + 32 <= len; ii += 32) {
+    chunk = _mm256_loadu_si256((const __m256i *)(str + ii));
+    hits = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote), _mm256_cmpeq_epi8(chunk, backslash));
+    hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(_mm256_min_epu8(chunk, control_max), chunk));
+    mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(hits, chunk));
+    if(mask) return ii + (size_t)__builtin_ctz(mask);
+  }
+  return ii + js_raw_scan_sse2(str + ii, len - ii);
+}
+
+/* Without AVX2, blocks of ASCII are skipped and sequences checked one at a time. */
+static size_t js_utf8_scan_sse2(const char *str, size_t len) {
+  size_t ii, seq_len;
+
+  ii = 0;
+  while(ii < len) {
+    if(ii + 16 <= len && !_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(str + ii)))) {
+      ii += 16;
+      continue;
+    }
+    if((unsigned char)str[ii] < 0x80) {
+      ii++;
+      continue;
+    }
+    seq_len = js_utf8_sequence(str + ii, len - ii);
+    if(!seq_len) return ii;
+    ii += seq_len;
+  }
+  return len;
+}
+
+/* UTF-8 validation by table lookup (Keiser and Lemire, "Validating UTF-8 In 
+   Less Than One Instruction Per Byte", 2021). The high and low nibbles of each
+   byte's predecessor and the high nibble of the byte index three tables whose
+   entries AND to nonzero only for an invalid pair; third and fourth bytes are
+   then matched against the leads two and three bytes back. A block with an 
+   error, and the tail, are rescanned from the start of the sequence in 
+   progress to find exactly where the valid prefix ends. */
+#define JS_UTF8_TOO_SHORT   0x01 /* Lead or ASCII, then a lead or ASCII.    */
+#define JS_UTF8_TOO_LONG    0x02 /* ASCII, then a continuation.             */
+#define JS_UTF8_OVERLONG_3  0x04 /* E0 80-9F.                               */
+#define JS_UTF8_TOO_LARGE   0x08 /* F4 90-BF, F5 and above.                 */
+#define JS_UTF8_SURROGATE   0x10 /* ED A0-BF.                               */
+#define JS_UTF8_OVERLONG_2  0x20 /* C0 or C1, then a continuation.          */
+#define JS_UTF8_OVERLONG_4  0x40 /* F0 80-8F; also F5 and above, then 80-8F. */
+#define JS_UTF8_TWO_CONTS   0x80 /* Two continuations, unless a lead wants them. */
+#define JS_UTF8_CARRY (JS_UTF8_TOO_SHORT | JS_UTF8_TOO_LONG | JS_UTF8_TWO_CONTS)
+
+__attribute__((target("avx2")))
+static size_t js_utf8_scan_avx2(const char *str, size_t len) {
+  const __m256i byte_1_high = _mm256_setr_epi8(
+    JS_UTF8_TOO_LONG, JS_UTF8_TOO_LONG, JS_UTF8_TOO_LONG, JS_UTF8_TOO_LONG,
+    JS_UTF8_TOO_LONG, JS_UTF8_TOO_LONG, JS_UTF8_TOO_LONG, JS_UTF8_TOO_LONG,
+    (char)JS_UTF8_TWO_CONTS, (char)JS_UTF8_TWO_CONTS, (char)JS_UTF8_TWO_CONTS, (char)JS_UTF8_TWO_CONTS,
+    JS_UTF8_TOO_SHORT | JS_UTF8_OVERLONG_2, JS_UTF8_TOO_SHORT,
+    JS_UTF8_TOO_SHORT | JS_UTF8_OVERLONG_3 | JS_UTF8_SURROGATE,
+    JS_UTF8_TOO_SHORT | JS_UTF8_TOO_LARGE | JS_UTF8_OVERLONG_4,
+    JS_UTF8_TOO_LONG, JS_UTF8_TOO_LONG, JS_UTF8_TOO_LONG, JS_UTF8_TOO_LONG,
+    JS_UTF8_TOO_LONG, JS_UTF8_TOO_LONG, JS_UTF8_TOO_LONG, JS_UTF8_TOO_LONG,
+    (char)JS_UTF8_TWO_CONTS, (char)JS_UTF8_TWO_CONTS, (char)JS_UTF8_TWO_CONTS, (char)JS_UTF8_TWO_CONTS,
+    JS_UTF8_TOO_SHORT | JS_UTF8_OVERLONG_2, JS_UTF8_TOO_SHORT,
+    JS_UTF8_TOO_SHORT | JS_UTF8_OVERLONG_3 | JS_UTF8_SURROGATE,
+    JS_UTF8_TOO_SHORT | JS_UTF8_TOO_LARGE | JS_UTF8_OVERLONG_4);
+  const __m256i byte_1_low = _mm256_setr_epi8(
+    (char)(JS_UTF8_CARRY | JS_UTF8_OVERLONG_2 | JS_UTF8_OVERLONG_3 | JS_UTF8_OVERLONG_4),
+    (char)(JS_UTF8_CARRY | JS_UTF8_OVERLONG_2), (char)JS_UTF8_CARRY, (char)JS_UTF8_CARRY,
+    (char)(JS_UTF8_CARRY | JS_UTF8_TOO_LARGE), (char)(JS_UTF8_CARRY | JS_UTF8_TOO_LARGE | JS_UTF8_OVERLONG_4),
+    (char)(JS_UTF8_CARRY | JS_UTF8_TOO_LARGE | JS_UTF8_OVERLONG_4), (char)(JS_UTF8_CARRY | JS_UTF8_TOO_LARGE | JS_UTF8_OVERLONG_4),
+    (char)(JS_UTF8_CARRY | JS_UTF8_TOO_LARGE | JS_UTF8_OVERLONG_4), (char)(JS_UTF8_CARRY | JS_UTF8_TOO_LARGE | JS_UTF8_OVERLONG_4),
+    (char)(JS_UTF8_CARRY | JS_UTF8_TOO_LARGE | JS_UTF8_OVERLONG_4), (char)(JS_UTF8_CARRY | JS_UTF8_TOO_LARGE | JS_UTF8_OVERLONG_4),
+    (char)(JS_UTF8_CARRY | JS_UTF8_TOO_LARGE | JS_UTF8_OVERLONG_4),
+    (char)(JS_UTF8_CARRY | JS_UTF8_TOO_LARGE | JS_UTF8_OVERLONG_4 | JS_UTF8_SURROGATE),
+    (char)(JS_UTF8_CARRY | JS_UTF8_TOO_LARGE | JS_UTF8_OVERLONG_4), (char)(JS_UTF8_CARRY | JS_UTF8_TOO_LARGE | JS_UTF8_OVERLONG_4),
+    (char)(JS_UTF8_CARRY | JS_UTF8_OVERLONG_2 | JS_UTF8_OVERLONG_3 | JS_UTF8_OVERLONG_4),
+    (char)(JS_UTF8_CARRY | JS_UTF8_OVERLONG_2), (char)JS_UTF8_CARRY, (char)JS_UTF8_CARRY,
+    (char)(JS_UTF8_CARRY | JS_UTF8_TOO_LARGE), (char)(JS_UTF8_CARRY | JS_UTF8_TOO_LARGE | JS_UTF8_OVERLONG_4),
+    (char)(JS_UTF8_CARRY | JS_UTF8_TOO_LARGE | JS_UTF8_OVERLONG_4), (char)(JS_UTF8_CARRY | JS_UTF8_TOO_LARGE | JS_UTF8_OVERLONG_4),
+    (char)(JS_UTF8_CARRY | JS_UTF8_TOO_LARGE | JS_UTF8_OVERLONG_4), (char)(JS_UTF8_CARRY | JS_UTF8_TOO_LARGE | JS_UTF8_OVERLONG_4),
+    (char)(JS_UTF8_CARRY | JS_UTF8_TOO_LARGE | JS_UTF8_OVERLONG_4), (char)(JS_UTF8_CARRY | JS_UTF8_TOO_LARGE | JS_UTF8_OVERLONG_4),
+    (char)(JS_UTF8_CARRY | JS_UTF8_TOO_LARGE | JS_UTF8_OVERLONG_4),
+    (char)(JS_UTF8_CARRY | JS_UTF8_TOO_LARGE | JS_UTF8_OVERLONG_4 | JS_UTF8_SURROGATE),
+    (char)(JS_UTF8_CARRY | JS_UTF8_TOO_LARGE | JS_UTF8_OVERLONG_4), (char)(JS_UTF8_CARRY | JS_UTF8_TOO_LARGE | JS_UTF8_OVERLONG_4));
+  const __m256i byte_2_high = _mm256_setr_epi8(
+    JS_UTF8_TOO_SHORT, JS_UTF8_TOO_SHORT, JS_UTF8_TOO_SHORT, JS_UTF8_TOO_SHORT,
+    JS_UTF8_TOO_SHORT, JS_UTF8_TOO_SHORT, JS_UTF8_TOO_SHORT, JS_UTF8_TOO_SHORT,
+    (char)(JS_UTF8_TOO_LONG | JS_UTF8_OVERLONG_2 | JS_UTF8_TWO_CONTS | JS_UTF8_OVERLONG_3 | JS_UTF8_OVERLONG_4),
+    (char)(JS_UTF8_TOO_LONG | JS_UTF8_OVERLONG_2 | JS_UTF8_TWO_CONTS | JS_UTF8_OVERLONG_3 | JS_UTF8_TOO_LARGE),
+    (char)(JS_UTF8_TOO_LONG | JS_UTF8_OVERLONG_2 | JS_UTF8_TWO_CONTS | JS_UTF8_SURROGATE | JS_UTF8_TOO_LARGE),
+    (char)(JS_UTF8_TOO_LONG | JS_UTF8_OVERLONG_2 | JS_UTF8_TWO_CONTS | JS_UTF8_SURROGATE | JS_UTF8_TOO_LARGE),
+    JS_UTF8_TOO_SHORT, JS_UTF8_TOO_SHORT, JS_UTF8_TOO_SHORT, JS_UTF8_TOO_SHORT,
+    JS_UTF8_TOO_SHORT, JS_UTF8_TOO_SHORT, JS_UTF8_TOO_SHORT, JS_UTF8_TOO_SHORT,
+    JS_UTF8_TOO_SHORT, JS_UTF8_TOO_SHORT, JS_UTF8_TOO_SHORT, JS_UTF8_TOO_SHORT,
+    (char)(JS_UTF8_TOO_LONG | JS_UTF8_OVERLONG_2 | JS_UTF8_TWO_CONTS | JS_UTF8_OVERLONG_3 | JS_UTF8_OVERLONG_4),
+    (char)(JS_UTF8_TOO_LONG | JS_UTF8_OVERLONG_2 | JS_UTF8_TWO_CONTS | JS_UTF8_OVERLONG_3 | JS_UTF8_TOO_LARGE),
+    (char)(JS_UTF8_TOO_LONG | JS_UTF8_OVERLONG_2 | JS_UTF8_TWO_CONTS | JS_UTF8_SURROGATE | JS_UTF8_TOO_LARGE),
+    (char)(JS_UTF8_TOO_LONG | JS_UTF8_OVERLONG_2 | JS_UTF8_TWO_CONTS | JS_UTF8_SURROGATE | JS_UTF8_TOO_LARGE),
+    JS_UTF8_TOO_SHORT, JS_UTF8_TOO_SHORT, JS_UTF8_TOO_SHORT, JS_UTF8_TOO_SHORT);
+  /* Leads in the last three bytes that need more bytes than the block has. */
+  const __m256i incomplete_max = _mm256_setr_epi8(
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, (char)0xEF, (char)0xDF, (char)0xBF);
+  const __m256i nibble_mask = _mm256_set1_epi8(0x0F);
+  __m256i input, prev_input, prev_incomplete, prev1, prev2, prev3, special, must23, error;
+  size_t ii, start;
+
+  prev_input = _mm256_setzero_si256();
+  prev_incomplete = _mm256_setzero_si256();
+  for(ii = 0; ii + 32 <= len; ii += 32) {
+    input = _mm256_loadu_si256((const __m256i *)(str + ii));
+    if(!_mm256_movemask_epi8(input)) {
+      if(!_mm256_testz_si256(prev_incomplete, prev_incomplete)) break;
+      prev_input = input;
+      continue;
+    }
+
+    /* The block shifted right by one, two and three bytes, filled from the previous block. */
+    prev1 = _mm256_permute2x128_si256(prev_input, input, 0x21);
+    prev3 = _mm256_alignr_epi8(input, prev1, 13);
+    prev2 = _mm256_alignr_epi8(input, prev1, 14);
+    prev1 = _mm256_alignr_epi8(input, prev1, 15);
+
+    special = _mm256_and_si256(
+      _mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble_mask)),
+      _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, nibble_mask)));
+    special = _mm256_and_si256(special, 
+      _mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble_mask)));
+    must23 = _mm256_or_si256(_mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80))),
+                             _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80))));
+    error = _mm256_xor_si256(_mm256_and_si256(must23, _mm256_set1_epi8((char)0x80)), special);
+    if(!_mm256_testz_si256(error, error)) break;
+
+    prev_incomplete = _mm256_subs_epu8(input, incomplete_max);
+    prev_input = input;
+  }
+
+  /* Back up to the lead of a sequence that may run on from the checked blocks. */
+  start = ii;
+  while(start > 0 && ii - start < 3 && ((unsigned char)str[start - 1] & 0xC0) == 0x80) start--;
+  if(start > 0 && (unsigned char)str[start - 1] >= 0xC0) start--;
+  return start + js_utf8_scan_sse2(str + start, len - start);
+}
+#endif
+
+#ifdef JSON_HAVE_X86_SIMD
+static js_escape_scan_fn js_escape_scan = js_escape_scan_sse2;
+static js_escape_scan_fn js_raw_scan = js_raw_scan_sse2;
+static js_escape_scan_fn js_utf8_scan = js_utf8_scan_sse2;
+
+/* Pick the widest scans the CPU supports when the library is loaded, before 
+   any thread can be writing, so that the pointers are never written while 
+   they may be read. */
+__attribute__((constructor)) static void js_scan_select(void) {
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    js_escape_scan = js_escape_scan_avx2;
+    js_raw_scan = js_raw_scan_avx2;
+    js_utf8_scan = js_utf8_scan_avx2;
+  }
+}
+#else
+static js_escape_scan_fn js_escape_scan = js_escape_scan_scalar;
+static js_escape_scan_fn js_raw_scan = js_raw_scan_scalar;
+static js_escape_scan_fn js_utf8_scan = js_utf8_scan_scalar;
+#endif
+
+
+
+/* Write the escape sequence for c, which must need escaping. Returns its length. */
+static size_t js_escape_char(char *out, unsigned char c) {
+  static const char hex_digits[] = "0123456789abcdef";
+
+  out[0] = '\\';
+  switch(c) {
+  case '"':  out[1] = '"';  return 2;
+  case '\\': out[1] = '\\'; return 2;
+  case '\b': out[1] = 'b';  return 2;
+  case '\f': out[1] = 'f';  return 2;
+  case '\n': out[1] = 'n';  return 2;
+  case '\r': out[1] = 'r';  return 2;
+  case '\t': out[1] = 't';  return 2;
+  default:
+    out[1] = 'u';
+    out[2] = '0';
+    out[3] = '0';
+    out[4] = hex_digits[c >> 4];
+    out[5] = hex_digits[c & 0xF];
+    return 6;
+  }
+}
+
+
+
+/* Escape len characters of string content into out, which must have room for 
+   6 * len characters. Returns the number written. */
+static size_t js_escape_copy(char *out, const char *str, size_t len) {
+  size_t run, written;
+
+  written = 0;
+  while(len > 0) {
+    run = js_escape_scan(str, len);
+    memcpy(out + written, str, run);
+    written += run;
+    str += run;
+    len -= run;
+    if(len == 0) break;
+    written += js_escape_char(out + written, (unsigned char)*str);
+    str++;
+    len--;
+  }
+  return written;
+}
+
+
+
+/* UTF-8 repair. An ill-formed sequence is replaced as a unit: its maximal 
+   subpart in the sense of Unicode section 3.9 ("U+FFFD Substitution of Maximal
+   Subparts"), so that a truncated sequence costs one replacement and the byte
+   after it is read afresh. */
+
+/* Returns the length, 1 to 3, of the ill-formed sequence starting at str. */
+static size_t js_utf8_invalid_len(const char *str, size_t len) {
+  const unsigned char *s = (const unsigned char *)str;
+  unsigned char low, high;
+  size_t need, ii;
+
+  if(s[0] < 0xC2 || s[0] > 0xF4) return 1;
+  need = s[0] < 0xE0 ? 2 : s[0] < 0xF0 ? 3 : 4;
+  low = s[0] == 0xE0 ? 0xA0 : s[0] == 0xF0 ? 0x90 : 0x80;
+  high = s[0] == 0xED ? 0x9F : s[0] == 0xF4 ? 0x8F : 0xBF;
+  for(ii = 1; ii < need && ii < len && s[ii] >= low && s[ii] <= high; ++ii) {
+    low = 0x80;
+    high = 0xBF;
+  }
+  return ii;
+}
+
+
+
+/* Write the replacement for the bad_len characters of an ill-formed sequence 
+   to out, which must have room for 6 * bad_len characters. Returns its length. */
+static size_t js_utf8_replacement(char *out, const char *str, size_t bad_len, json_utf8_policy policy) {
+  size_t ii, len;
+
+  if(policy == JSON_UTF8_REPLACE) {
+    memcpy(out, "\xEF\xBF\xBD", 3);
+    return 3;
+  }
+  len = 0;
+  for(ii = 0; ii < bad_len; ++ii) {
+    len += js_escape_char(out + len, (unsigned char)str[ii]);
+  }
+  return len;
+}
+
+
+
+/* In JSON_UTF8_REJECT mode, check a string before anything of the call is written. */
+int js_check_utf8(json_stream_struct *js, const char *str, size_t len) {
+  if(js->utf8_policy != JSON_UTF8_REJECT) return 0;
+  if((len < 16 ? js_utf8_scan_scalar(str, len) : js_utf8_scan(str, len)) == len) return 0;
+  js_set_error(js, JSON_ERROR_INVALID_UTF8);
+  return -1;
+}
+
+
+
+/* As js_check_utf8, for a name that is either name_len characters long or 
+   pre-encoded as key. */
+int js_check_name_utf8(json_stream_struct *js, const char *name, size_t name_len, const json_key *key) {
+  return key ? 0 : js_check_utf8(js, name, name_len);
+}
+
+
+
+/* js_escape_copy, repairing ill-formed UTF-8 under JSON_UTF8_REPLACE or 
+   JSON_UTF8_ESCAPE. Escaping is skipped when escape is zero. */
+static size_t js_escape_copy_utf8(char *out, const char *str, size_t len, int escape, json_utf8_policy policy) {
+  size_t run, written;
+
+  written = 0;
+  while(len > 0) {
+    run = len < 16 ? js_utf8_scan_scalar(str, len) : js_utf8_scan(str, len);
+    if(escape) {
+      written += js_escape_copy(out + written, str, run);
+    } else {
+      memcpy(out + written, str, run);
+      written += run;
+    }
+    str += run;
+    len -= run;
+    if(len == 0) break;
+    run = js_utf8_invalid_len(str, len);
+    written += js_utf8_replacement(out + written, str, run, policy);
+    str += run;
+    len -= run;
+  }
+  return written;
+}
+
+
+
+/* Write len characters of string content, escaping them unless disabled. 
+   Runs that need no escaping are written in one piece. Escapes are formatted
+   straight into the buffer, as write_bytes may keep a reference to what it is
+   given until the end of the call. */
+int js_write_escaped(json_stream_struct *js, const char *str, size_t len) {
+  char *out;
+  size_t run;
+  int status;
+
+  if(!js->escape_strings) return write_bytes(js, str, len);
+
+  while(len > 0) {
+    /* Strings shorter than a vector are not worth the dispatch. */
+    run = len < 16 ? js_escape_scan_scalar(str, len) : js_escape_scan(str, len);
+    if(run > 0) {
+      status = write_bytes(js, str, run);
+      if(status) return status;
+      str += run;
+      len -= run;
+      if(len == 0) break;
+    }
+
+    out = js_reserve(js, 6);
+    if(!out) return -1;
+    js_commit(js, js_escape_char(out, (unsigned char)*str));
+    str++;
+    len--;
+  }
+  return 0;
+}
+
+
+
+/* Write string content under JSON_UTF8_REPLACE or JSON_UTF8_ESCAPE. Up to the 
+   first non-ASCII character, one scan finds both escapes and the end of the 
+   ASCII. From there the longest well-formed run is found with the UTF-8 scan
+   and escaped as usual, and an ill-formed sequence is replaced. Escapes and
+   replacements are formatted straight into the buffer, like those of 
+   js_write_escaped. */
+int js_write_string_utf8(json_stream_struct *js, const char *str, size_t len) {
+  char *out;
+  size_t run;
+  int status;
+
+  while(len > 0) {
+    run = len < 16 ? js_raw_scan_scalar(str, len) : js_raw_scan(str, len);
+    if(run > 0) {
+      status = write_bytes(js, str, run);
+      if(status) return status;
+      str += run;
+      len -= run;
+      if(len == 0) break;
+    }
+
+    if((unsigned char)*str < 0x80) {
+      if(js->escape_strings) {
+        out = js_reserve(js, 6);
+        if(!out) return -1;
+        js_commit(js, js_escape_char(out, (unsigned char)*str));
+        status = 0;
+      } else {
+        status = write_bytes(js, str, 1);
+      }
+      run = 1;
+    } else {
+      run = len < 16 ? js_utf8_scan_scalar(str, len) : js_utf8_scan(str, len);
+      if(run > 0) {
+        status = js_write_escaped(js, str, run);
+      } else {
+        run = js_utf8_invalid_len(str, len);
+        out = js_reserve(js, 18); /* Three \u00XX escapes at most. */
+        if(!out) return -1;
+        js_commit(js, js_utf8_replacement(out, str, run, js->utf8_policy));
+        status = 0;
+      }
+    }
+    if(status) return status;
+    str += run;
+    len -= run;
+  }
+  return 0;
+}
+
+
+
+/* Write len characters of string content, escaping them unless disabled, and
+   repairing ill-formed UTF-8 if the stream's policy says to. Under the other
+   policies the content is written as it is, having been checked up front 
+   under JSON_UTF8_REJECT. */
+int write_string(json_stream_struct *js, const char *str, size_t len) {
+  if(js->utf8_policy >= JSON_UTF8_REPLACE) return js_write_string_utf8(js, str, len);
+  return js_write_escaped(js, str, len);
+}
+
+
+
+/* Binary encodings. A CBOR (RFC 8949) item starts with a byte holding its major 
+   type and a small argument, followed by up to 8 bytes of a larger one. 
+   MessagePack has a type byte per kind and size instead. Both are big-endian,
+   and every item is written in its shortest form. */
+
+/* Longest header of a binary item: a type byte and a 64-bit argument. */
+#define JS_PACK_MAX_HEAD 9
+
+/* true, false and null, per binary encoding. */
+static const char js_pack_literals[2][3] = {
+  { (char)0xF5, (char)0xF4, (char)0xF6 }, /* CBOR simple values 21, 20 and 22. */
+  { (char)0xC3, (char)0xC2, (char)0xC0 }  /* MessagePack.                       */
+};
+
+/* Store the low len bytes of value, most significant first. */
+static size_t js_store_be(char *out, uint64_t value, size_t len) {
+  size_t ii;
+
+  for(ii = len; ii > 0; --ii) {
+    out[ii - 1] = (char)(value & 0xFF);
+    value >>= 8;
+  }
+  return len;
+}
+
+/* A CBOR head: major type major with argument value. Returns its length. */
+static size_t js_cbor_head(char *out, unsigned major, uint64_t value) {
+  major <<= 5;
+  if(value < 24) {
+    out[0] = (char)(major | value);
+    return 1;
+  }
+  if(value <= 0xFF) {
+    out[0] = (char)(major | 24);
+    return 1 + js_store_be(out + 1, value, 1);
+  }
+  if(value <= 0xFFFF) {
+    out[0] = (char)(major | 25);
+    return 1 + js_store_be(out + 1, value, 2);
+  }
+  if(value <= 0xFFFFFFFF) {
+    out[0] = (char)(major | 26);
+    return 1 + js_store_be(out + 1, value, 4);
+  }
+  out[0] = (char)(major | 27);
+  return 1 + js_store_be(out + 1, value, 8);
+}
+
+/* The header of a len byte string. MessagePack strings are limited to 32-bit 
+   lengths, which js_pack_string checks. */
+static size_t js_pack_string_head(char *out, json_encoding encoding, size_t len) {
+  if(encoding == JSON_ENCODING_CBOR) return js_cbor_head(out, 3, len);
+  if(len < 32) {
+    out[0] = (char)(0xA0 | len);
+    return 1;
+  }
+  if(len <= 0xFF) {
+    out[0] = (char)0xD9;
+    return 1 + js_store_be(out + 1, len, 1);
+  }
+  if(len <= 0xFFFF) {
+    out[0] = (char)0xDA;
+    return 1 + js_store_be(out + 1, len, 2);
+  }
+  out[0] = (char)0xDB;
+  return 1 + js_store_be(out + 1, len, 4);
+}
+
+/* The header of an object or array of count members or elements, or of 
+   indefinite length in CBOR. */
+static size_t js_pack_container_head(char *out, json_encoding encoding, JSON_TYPE type, size_t count) {
+  int array = type == JSON_ARRAY;
+
+  if(encoding == JSON_ENCODING_CBOR) {
+    if(count == JS_PACK_INDEFINITE) {
+      out[0] = (char)(array ? 0x9F : 0xBF);
+      return 1;
+    }
+    return js_cbor_head(out, array ? 4 : 5, count);
+  }
+  if(count < 16) {
+    out[0] = (char)((array ? 0x90 : 0x80) | count);
+    return 1;
+  }
+  if(count <= 0xFFFF) {
+    out[0] = (char)(array ? 0xDC : 0xDE);
+    return 1 + js_store_be(out + 1, count, 2);
+  }
+  out[0] = (char)(array ? 0xDD : 0xDF);
+  return 1 + js_store_be(out + 1, count, 4);
+}
+
+static size_t js_pack_uint64_bytes(char *out, json_encoding encoding, uint64_t value) {
+  if(encoding == JSON_ENCODING_CBOR) return js_cbor_head(out, 0, value);
+  if(value < 0x80) {
+    out[0] = (char)value;
+    return 1;
+  }
+  if(value <= 0xFF) {
+    out[0] = (char)0xCC;
+    return 1 + js_store_be(out + 1, value, 1);
+  }
+  if(value <= 0xFFFF) {
+    out[0] = (char)0xCD;
+    return 1 + js_store_be(out + 1, value, 2);
+  }
+  if(value <= 0xFFFFFFFF) {
+    out[0] = (char)0xCE;
+    return 1 + js_store_be(out + 1, value, 4);
+  }
+  out[0] = (char)0xCF;
+  return 1 + js_store_be(out + 1, value, 8);
+}
+
+static size_t js_pack_int64_bytes(char *out, json_encoding encoding, int64_t value) {
+  if(value >= 0) return js_pack_uint64_bytes(out, encoding, (uint64_t)value);
+  if(encoding == JSON_ENCODING_CBOR) return js_cbor_head(out, 1, (uint64_t)(-(value + 1)));
+  if(value >= -32) {
+    out[0] = (char)value; /* Negative fixint, 0xE0 to 0xFF. */
+    return 1;
+  }
+  if(value >= INT8_MIN) {
+    out[0] = (char)0xD0;
+    return 1 + js_store_be(out + 1, (uint64_t)value, 1);
+  }
+  if(value >= INT16_MIN) {
+    out[0] = (char)0xD1;
+    return 1 + js_store_be(out + 1, (uint64_t)value, 2);
+  }
+  if(value >= INT32_MIN) {
+    out[0] = (char)0xD2;
+    return 1 + js_store_be(out + 1, (uint64_t)value, 4);
+  }
+  out[0] = (char)0xD3;
+  return 1 + js_store_be(out + 1, (uint64_t)value, 8);
+}
+
+/* The IEEE 754 half precision bits of value, or -1 if it has none. */
+static int32_t js_half_bits(float value) {
+  uint32_t bits, sign, significand;
+  int exponent;
+
+  memcpy(&bits, &value, sizeof(bits));
+  sign = (bits >> 16) & 0x8000;
+  exponent = (int)((bits >> 23) & 0xFF) - 127;
+  significand = bits & 0x7FFFFF;
+
+  if(exponent == -127) return significand == 0 ? (int32_t)sign : -1; /* Zero, or too small. */
+  if(exponent >= -14 && exponent <= 15) {
+    if(significand & 0x1FFF) return -1;
+    return (int32_t)(sign | (uint32_t)(exponent + 15) << 10 | significand >> 13);
+  }
+  if(exponent >= -24 && exponent < -14) {
+    /* A half precision subnormal, a multiple of 2^-24. */
+    significand |= 0x800000;
+    if(significand & ((1u << (-exponent - 1)) - 1)) return -1;
+    return (int32_t)(sign | significand >> (-exponent - 1));
+  }
+  return -1;
+}
+
+/* A double in the narrowest float that holds it exactly: half, single or 
+   double precision in CBOR (its preferred serialization), single or double in
+   MessagePack. */
+static size_t js_pack_double_bytes(char *out, json_encoding encoding, double value) {
+  uint64_t bits64;
+  uint32_t bits32;
+  int32_t half;
+  float single;
+
+  if(value >= -FLT_MAX && value <= FLT_MAX && (double)(single = (float)value) == value) {
+    if(encoding == JSON_ENCODING_CBOR) {
+      half = js_half_bits(single);
+      if(half >= 0) {
+        out[0] = (char)0xF9;
+        return 1 + js_store_be(out + 1, (uint64_t)half, 2);
+      }
+    }
+    memcpy(&bits32, &single, sizeof(bits32));
+    out[0] = (char)(encoding == JSON_ENCODING_CBOR ? 0xFA : 0xCA);
+    return 1 + js_store_be(out + 1, bits32, 4);
+  }
+  memcpy(&bits64, &value, sizeof(bits64));
+  out[0] = (char)(encoding == JSON_ENCODING_CBOR ? 0xFB : 0xCB);
+  return 1 + js_store_be(out + 1, bits64, 8);
+}
+
+
+
+/* Encode numbers and literals into the stream buffer. */
+int js_pack_int64(json_stream_struct *js, int64_t value) {
+  char *out = js_reserve(js, JS_PACK_MAX_HEAD);
+  if(!out) return -1;
+  js_commit(js, js_pack_int64_bytes(out, js->encoding, value));
+  return 0;
+}
+
+int js_pack_uint64(json_stream_struct *js, uint64_t value) {
+  char *out = js_reserve(js, JS_PACK_MAX_HEAD);
+  if(!out) return -1;
+  js_commit(js, js_pack_uint64_bytes(out, js->encoding, value));
+  return 0;
+}
+
+int js_pack_double(json_stream_struct *js, double value) {
+  char *out = js_reserve(js, JS_PACK_MAX_HEAD);
+  if(!out) return -1;
+  js_commit(js, js_pack_double_bytes(out, js->encoding, value));
+  return 0;
+}
+
+int js_pack_literal(json_stream_struct *js, JSON_TYPE type) {
+  return write_bytes(js, &js_pack_literals[js->encoding - 1][type - JSON_TRUE], 1);
+}
+
+
+
+/* Encode a string with its header into out, which must have room for 
+   JS_PACK_MAX_HEAD + len bytes, or JS_PACK_MAX_HEAD + 3 * len under the 
+   repairing policies. Repaired content is written past the longest header and
+   then moved down to the one its length needs. Returns the number written. */
+size_t js_pack_encode_string(json_stream_struct *js, char *out, const char *str, size_t len) {
+  size_t head, content;
+
+  if(js->utf8_policy >= JSON_UTF8_REPLACE && 
+     (len < 16 ? js_utf8_scan_scalar(str, len) : js_utf8_scan(str, len)) != len) {
+    /* There is nothing to escape, so both policies replace. */
+    content = js_escape_copy_utf8(out + JS_PACK_MAX_HEAD, str, len, 0, JSON_UTF8_REPLACE);
+    head = js_pack_string_head(out, js->encoding, content);
+    memmove(out + head, out + JS_PACK_MAX_HEAD, content);
+    return head + content;
+  }
+  head = js_pack_string_head(out, js->encoding, len);
+  memcpy(out + head, str, len);
+  return head + len;
+}
+
+
+
+/* Write a name or string value. Strings short enough to be copied anyway are 
+   encoded with their header in one reservation; longer ones may be gathered
+   by write_bytes. */
+int js_pack_string(json_stream_struct *js, const char *str, size_t len) {
+  char *out;
+
+  if(js->encoding == JSON_ENCODING_MSGPACK && (uint64_t)len > 0xFFFFFFFFu) {
+    js_set_error(js, JSON_ERROR_ENCODING);
+    return -1;
+  }
+  if(len < JSON_GATHER_MIN_LEN || js->utf8_policy >= JSON_UTF8_REPLACE) {
+    out = js_reserve(js, JS_PACK_MAX_HEAD + (js->utf8_policy >= JSON_UTF8_REPLACE ? 3 * len : len));
+    if(!out) return -1;
+    js_commit(js, js_pack_encode_string(js, out, str, len));
+    return 0;
+  }
+  out = js_reserve(js, JS_PACK_MAX_HEAD);
+  if(!out) return -1;
+  js_commit(js, js_pack_string_head(out, js->encoding, len));
+  return write_bytes(js, str, len);
+}
+
+
+
+static size_t js_raw_number(const char *raw, size_t pos, size_t len);
+
+/* JSON_NUMBER text is parsed in the binary encodings, so it must be a JSON 
+   number. Checked before anything of the call is written. */
+int js_check_number_text(json_stream_struct *js, const char *text, size_t len) {
+  if(len > 0 && js_raw_number(text, 0, len) == len) return 0;
+  js_set_error(js, JSON_ERROR_NUMBER_TEXT);
+  return -1;
+}
+
+
+
+/* Encode checked JSON_NUMBER text: integers within 64 bits as integers, 
+   anything else as a double. strtod follows the C locale's decimal point. */
+int js_pack_number_text(json_stream_struct *js, const char *text, size_t len) {
+  char local[64], *copy;
+  uint64_t magnitude, digit;
+  size_t ii;
+  double value;
+  int negative;
+
+  negative = text[0] == '-';
+  magnitude = 0;
+  for(ii = (size_t)negative; ii < len && text[ii] >= '0' && text[ii] <= '9'; ++ii) {
+    digit = (uint64_t)(text[ii] - '0');
+    if(magnitude > (UINT64_MAX - digit) / 10) break;
+    magnitude = magnitude * 10 + digit;
+  }
+  if(ii == len) {
+    if(!negative) return js_pack_uint64(js, magnitude);
+    if(magnitude <= (uint64_t)INT64_MAX) return js_pack_int64(js, -(int64_t)magnitude);
+    if(magnitude == (uint64_t)INT64_MAX + 1) return js_pack_int64(js, INT64_MIN);
+  }
+
+  copy = len < sizeof(local) ? local : (char *)js->realloc_fn(NULL, len + 1);
+  if(!copy) {
+    js_set_error(js, JSON_ERROR_NO_MEMORY);
+    return -1;
+  }
+  memcpy(copy, text, len);
+  copy[len] = '\0';
+  value = strtod(copy, NULL);
+  if(copy != local) js->realloc_fn(copy, 0);
+  return js_pack_double(js, value);
+}
+
+
+
+/* Make room for a frame per level up to levels. */
+int js_grow_pack_frames(json_stream_struct *js, int levels) {
+  json_pack_frame *frames;
+  int cap;
+
+  if(levels <= js->pack_frames_cap) return 0;
+  cap = js->pack_frames_cap ? js->pack_frames_cap : 16;
+  while(cap < levels) cap *= 2;
+  if(cap > MAX_JSON_NESTED_DEPTH) cap = MAX_JSON_NESTED_DEPTH;
+
+  frames = (json_pack_frame *)js->realloc_fn(js->pack_frames, (size_t)cap * sizeof(json_pack_frame));
+  if(!frames) {
+    js_set_error(js, JSON_ERROR_NO_MEMORY);
+    return -1;
+  }
+  js->pack_frames = frames;
+  js->pack_frames_cap = cap;
+  return 0;
+}
+
+
+
+/* Write the header of an object or array about to be pushed. count is its 
+   number of members or elements, if known up front, or JS_PACK_INDEFINITE. 
+   MessagePack needs the size either way, so an indefinite one starts with a 
+   one byte header for js_pack_close to fill in. */
+int js_pack_open(json_stream_struct *js, JSON_TYPE type, size_t count) {
+  json_pack_frame *frame;
+  char *out;
+
+  if(js->encoding == JSON_ENCODING_MSGPACK && count != JS_PACK_INDEFINITE && (uint64_t)count > 0xFFFFFFFFu) {
+    js_set_error(js, JSON_ERROR_ENCODING);
+    return -1;
+  }
+  if(js_grow_pack_frames(js, js->stack_depth + 1)) return -1;
+  out = js_reserve(js, JS_PACK_MAX_HEAD);
+  if(!out) return -1;
+
+  frame = &js->pack_frames[js->stack_depth];
+  frame->header = js->stream_buffer_len;
+  frame->count = 0;
+  frame->definite = count != JS_PACK_INDEFINITE;
+  if(js->encoding == JSON_ENCODING_MSGPACK && !frame->definite) count = 0;
+  js_commit(js, js_pack_container_head(out, js->encoding, type, count));
+  return 0;
+}
+
+
+
+/* Finish the object or array that was open at level stack_depth + 1. CBOR ends
+   an indefinite length with a break. MessagePack rewrites the placeholder 
+   header, moving the contents up if the size needs a longer one. */
+int js_pack_close(json_stream_struct *js, JSON_TYPE type) {
+  json_pack_frame *frame = &js->pack_frames[js->stack_depth];
+  char head[JS_PACK_MAX_HEAD];
+  size_t head_len;
+
+  if(frame->definite) return 0;
+  if(js->encoding == JSON_ENCODING_CBOR) return write_bytes(js, "\xFF", 1);
+
+  if((uint64_t)frame->count > 0xFFFFFFFFu) {
+    js_set_error(js, JSON_ERROR_ENCODING);
+    return -1;
+  }
+  head_len = js_pack_container_head(head, js->encoding, type, frame->count);
+  if(head_len > 1) {
+    if(js_grow_buffer(js, head_len - 1)) return -1;
+    memmove(js->stream_buffer + frame->header + head_len, js->stream_buffer + frame->header + 1,
+            js->stream_buffer_len - frame->header); /* The contents and the NUL. */
+    js->stream_buffer_len += head_len - 1;
+  }
+  memcpy(js->stream_buffer + frame->header, head, head_len);
+  return 0;
+}
+
+
+
+/* Write the opening brace or bracket of an object or array about to be pushed,
+   or its binary header. */
+int js_write_open(json_stream_struct *js, JSON_TYPE type, size_t count) {
+  if(JS_BINARY(js)) return js_pack_open(js, type, count);
+  return write_bytes(js, type == JSON_ARRAY ? "[" : "{", 1);
+}
+
+
+
+/* Check that levels more contexts may be opened within the depth limit. */
+int js_check_depth(json_stream_struct *js, int levels) {
+  if(js->stack_depth + levels > js->max_depth) {
+    js_set_error(js, JSON_ERROR_TOO_DEEP);
+    return -1;
+  }
+  return 0;
+}
+
+
+
+/* Record a newly opened object or array. The depth has already been checked. */
+void js_push_frame(json_stream_struct *js, JSON_TYPE type) {
+  uint32_t bit;
+
+  bit = (uint32_t)1 << (js->stack_depth % 32);
+  if(type == JSON_ARRAY) {
+    js->frame_bits[js->stack_depth / 32] |= bit;
+  } else {
+    js->frame_bits[js->stack_depth / 32] &= ~bit;
+  }
+  js->stack_depth++;
+  JS_STAT_DEPTH(js, js->stack_depth);
+}
+
+
+
+/* Shared checks for the single value writers. */
+int js_check_value_context(json_stream_struct *js) {
+  if(js->stack_depth <= 0) {
+    js_set_error(js, JSON_ERROR_VALUE_NO_CONTEXT);
+    return -1;
+  }
+
+  if(JS_FRAME(js, js->stack_depth) != JSON_ARRAY) {
+    js_set_error(js, JSON_ERROR_VALUE_CONTEXT);
+    return -1;
+  }
+  return 0;
+}
+
+
+
+/* Shared checks for the name: value pair writers. */
+int js_check_pair_context(json_stream_struct *js) {
+  if(js->stack_depth <= 0) {
+    js_set_error(js, JSON_ERROR_PAIR_NO_CONTEXT);
+    return -1;
+  }
+
+  if(JS_FRAME(js, js->stack_depth) != JSON_OBJECT) {
+    js_set_error(js, JSON_ERROR_PAIR_CONTEXT);
+    return -1;
+  }
+  return 0;
+}
+
+
+
+/* Shared start of a value or pair once the context has been checked. */
+int js_begin_element(json_stream_struct *js) {
+  int status;
+
+  status = js_reset_buffer(js);
+  if(status) return status;
+
+  status = new_element(js); /* Print a comma if this follows a previous element. */
+  if(status) return status;
+  return do_indent(js); 
+}
+
+
+
+/* Print the quoted name and separator of a name: value pair. */
+int js_write_key(json_stream_struct *js, const char *name, size_t name_len) {
+  int status;
+  status = write_bytes(js, "\"", 1);
+  status = status?status:write_string(js, name, name_len);
+  status = status?status:write_bytes(js, "\": ", 3);
+  return status;
+}
+
+
+
+/* The value of the four hex digits at str, or -1 if they are not hex digits. */
+static int32_t js_hex4(const char *str) {
+  int32_t value = 0;
+  int ii;
+  char c;
+
+  for(ii = 0; ii < 4; ++ii) {
+    c = str[ii];
+    if(c >= '0' && c <= '9') value = value * 16 + (c - '0');
+    else if((c | 0x20) >= 'a' && (c | 0x20) <= 'f') value = value * 16 + ((c | 0x20) - 'a' + 10);
+    else return -1;
+  }
+  return value;
+}
+
+
+
+/* Decode the escapes in len characters of JSON string text into out. \u 
+   escapes become UTF-8, with surrogate pairs joined and a lone surrogate 
+   replaced by U+FFFD; a malformed escape is copied as it is. The result is 
+   never longer than the text. Returns its length. */
+static size_t js_json_unescape(char *out, const char *str, size_t len) {
+  size_t ii, written;
+  int32_t cp, low;
+
+  ii = 0;
+  written = 0;
+  while(ii < len) {
+    if(str[ii] != '\\' || ii + 1 >= len) {
+      out[written++] = str[ii++];
+      continue;
+    }
+    switch(str[ii + 1]) {
+    case 'b': out[written++] = '\b'; break;
+    case 'f': out[written++] = '\f'; break;
+    case 'n': out[written++] = '\n'; break;
+    case 'r': out[written++] = '\r'; break;
+    case 't': out[written++] = '\t'; break;
+    case 'u':
+      cp = ii + 6 <= len ? js_hex4(str + ii + 2) : -1;
+      if(cp < 0) {
+        out[written++] = str[ii++];
+        continue;
+      }
+      ii += 6;
+      if(cp >= 0xD800 && cp < 0xE000) {
+        low = ii + 6 <= len && str[ii] == '\\' && str[ii + 1] == 'u' ? js_hex4(str + ii + 2) : -1;
+        if(cp < 0xDC00 && low >= 0xDC00 && low < 0xE000) {
+          cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+          ii += 6;
+        } else {
+          cp = 0xFFFD;
+        }
+      }
+      if(cp < 0x80) {
+        out[written++] = (char)cp;
+      } else if(cp < 0x800) {
+        out[written++] = (char)(0xC0 | cp >> 6);
+        out[written++] = (char)(0x80 | (cp & 0x3F));
+      } else if(cp < 0x10000) {
+        out[written++] = (char)(0xE0 | cp >> 12);
+        out[written++] = (char)(0x80 | (cp >> 6 & 0x3F));
+        out[written++] = (char)(0x80 | (cp & 0x3F));
+      } else {
+        out[written++] = (char)(0xF0 | cp >> 18);
+        out[written++] = (char)(0x80 | (cp >> 12 & 0x3F));
+        out[written++] = (char)(0x80 | (cp >> 6 & 0x3F));
+        out[written++] = (char)(0x80 | (cp & 0x3F));
+      }
+      continue;
+    default: /* The quote, backslash and solidus stand for themselves. */
+      out[written++] = str[ii + 1];
+      break;
+    }
+    ii += 2;
+  }
+  return written;
+}
+
+
+
+/* Write the name of a JSON key as a binary string: the text between its quotes,
+   with any escapes decoded in place past the longest header. */
+int js_pack_json_key(json_stream_struct *js, const json_key *key) {
+  const char *text = key->bytes + 1;
+  size_t text_len = key->len - 4;
+  size_t head, content;
+  char *out;
+
+  if(!memchr(text, '\\', text_len)) return js_pack_string(js, text, text_len);
+  out = js_reserve(js, JS_PACK_MAX_HEAD + text_len);
+  if(!out) return -1;
+  content = js_json_unescape(out + JS_PACK_MAX_HEAD, text, text_len);
+  head = js_pack_string_head(out, js->encoding, content);
+  memmove(out + head, out + JS_PACK_MAX_HEAD, content);
+  js_commit(js, head + content);
+  return 0;
+}
+
+
+
+/* The name a binary key holds, for writing it in another encoding: what 
+   follows its header. */
+static void js_key_name(const json_key *key, const char **name, size_t *name_len) {
+  unsigned char lead = (unsigned char)key->bytes[0];
+  size_t skip;
+
+  if(key->encoding == JSON_ENCODING_CBOR) {
+    lead &= 0x1F;
+    skip = lead < 24 ? 1 : 1 + ((size_t)1 << (lead - 24));
+  } else {
+    skip = lead < 0xD9 ? 1 : 1 + ((size_t)1 << (lead - 0xD9));
+  }
+  *name = key->bytes + skip;
+  *name_len = key->len - skip;
+}
+
+
+
+/* Print a name and separator, either encoding name or copying a pre-encoded key.
+   A key made for another encoding is re-encoded from the name it holds. */
+int js_write_name(json_stream_struct *js, const char *name, size_t name_len, const json_key *key) {
+  if(key) {
+    if(key->encoding == js->encoding) return write_bytes(js, key->bytes, key->len);
+    if(key->encoding == JSON_ENCODING_JSON) return js_pack_json_key(js, key);
+    js_key_name(key, &name, &name_len);
+  }
+  if(JS_BINARY(js)) return js_pack_string(js, name, name_len);
+  return js_write_key(js, name, name_len);
+}
+
+
+
+/* Encode a member name as js would write it: quoted, escaped, and followed by 
+   the name separator. out must have room for 6 * name_len + 4 characters. 
+   Returns the number written. */
+size_t js_encode_key(json_stream_struct *js, char *out, const char *name, size_t name_len) {
+  size_t len;
+
+  out[0] = '"';
+  len = 1;
+  if(js->utf8_policy >= JSON_UTF8_REPLACE) {
+    len += js_escape_copy_utf8(out + len, name, name_len, js->escape_strings, js->utf8_policy);
+  } else if(js->escape_strings) {
+    len += js_escape_copy(out + len, name, name_len);
+  } else {
+    memcpy(out + len, name, name_len);
+    len += name_len;
+  }
+  memcpy(out + len, "\": ", 3);
+  return len + 3;
+}
+
+
+
+/* Pre-encode a member name for the _k writers. */
+int json_key_make(json_stream_struct *js, json_key *key, const char *name) {
+  size_t name_len, len;
+  char *bytes, *shrunk;
+
+  name_len = strlen(name);
+  if(js_check_utf8(js, name, name_len)) return -1;
+  bytes = js->realloc_fn(NULL, JS_BINARY(js) ? JS_PACK_MAX_HEAD + 3 * name_len : 6 * name_len + 4);
+  if(!bytes) {
+    js_set_error(js, JSON_ERROR_NO_MEMORY_KEY);
+    return -1;
+  }
+  if(JS_BINARY(js)) len = js_pack_encode_string(js, bytes, name, name_len);
+  else len = js_encode_key(js, bytes, name, name_len);
+
+  shrunk = js->realloc_fn(bytes, len);
+  key->bytes = shrunk ? shrunk : bytes;
+  key->len = len;
+  key->encoding = js->encoding;
+  return 0;
+}
+
+
+
+/* Release a key created by json_key_make. */
+void json_key_free(json_stream_struct *js, json_key *key) {
+  if(key->bytes) js->realloc_fn((char *)key->bytes, 0);
+  key->bytes = NULL;
+  key->len = 0;
+}
+
+
+
+/* Valid JSON must begin with an object or an array.  */
+
+/* Start a brace-enclosed object. 
+   An object may only begin in an array context or when no context has yet been started. (The beginning of a file) */
+int json_start_object(json_stream_struct *js) {
+  int status;
+
+  JS_STAT_CALL(js, JSON_CALL_START_OBJECT);
+  if(js->file_started != 0) {
+    if(js->stack_depth <= 0) {
+      js_set_error(js, JSON_ERROR_OBJECT_AFTER_END);
+      return -1;
+    }
+    if(JS_FRAME(js, js->stack_depth) != JSON_ARRAY) {
+      js_set_error(js, JSON_ERROR_OBJECT_CONTEXT);
+      return -1;
+    } 
+  }
+
+  status = js_check_depth(js, 1);
+  if(status) return status;
+
+  status = js_reset_buffer(js);
+  if(status) return status;
+
+  status = new_element(js); /* Print a comma if this follows a previous element. */
+  if(status) return status;
+
+  /* Indent and print the open brace. */
+  status = do_indent(js); 
+  if(status) return status;
+  status = js_write_open(js, JSON_OBJECT, JS_PACK_INDEFINITE);
+  if(status) return status;
+
+  /* Record that a new object has been opened. */
+  js->prior_element = JSON_NULL;
+  js_push_frame(js, JSON_OBJECT);
+  js->file_started = 1;
+
+  return js_end_call(js, 0);
+};
+
+
+  
+/* Start an named object. (A name: value pair where the value is a new object.)
+   Must be in an object or array context. The name is either name_len characters
+   long, or pre-encoded as key. */
+int json_start_object_named_internal(json_stream_struct *js, const char *name, size_t name_len, 
+                                  const json_key *key) {
+  int status;
+
+  if(js->stack_depth <= 0) {
+    js_set_error(js, JSON_ERROR_NAMED_OBJECT_NO_CONTEXT);
+    return -1;
+  }
+
+  if(JS_FRAME(js, js->stack_depth) != JSON_OBJECT) {
+    js_set_error(js, JSON_ERROR_NAMED_OBJECT_CONTEXT);
+    return -1;
+  }
+
+  status = js_check_depth(js, 1);
+  status = status?status:js_check_name_utf8(js, name, name_len, key);
+  if(status) return status;
+
+  status = js_reset_buffer(js);
+  if(status) return status;
+
+  status = new_element(js); /* Print a comma if this follows a previous element. */
+  if(status) return status;
+
+  /* Indent and print the name and open brace. */
+  status = do_indent(js); 
+  if(status) return status;
+
+  status = js_write_name(js, name, name_len, key);
+  status = status?status:js_write_open(js, JSON_OBJECT, JS_PACK_INDEFINITE);
+  if(status) return status;
+  // ggg fprintf(js->out, "\"%s\": {", name);
+
+  /* Record that a new object has been opened. */
+  js->prior_element = JSON_NULL;
+  js_push_frame(js, JSON_OBJECT);
+
+  return js_end_call(js, 0);
+};
+
+
+
+/* Start a named object from a name of name_len characters. */
+int json_start_object_named_n(json_stream_struct *js, const char *name, size_t name_len) {
+  JS_STAT_CALL(js, JSON_CALL_START_OBJECT);
+  return json_start_object_named_internal(js, name, name_len, NULL);
+}
+
+
+
+/* Start a named object from a pre-encoded key. */
+int json_start_object_named_k(json_stream_struct *js, const json_key *key) {
+  JS_STAT_CALL(js, JSON_CALL_START_OBJECT);
+  return json_start_object_named_internal(js, NULL, 0, key);
+}
+
+
+
+/* Start a named object from a NUL-terminated name, which is sanitized first. */
+int json_start_object_named(json_stream_struct *js, char *name) {
+  sanitize_string(js, name);
+  return json_start_object_named_n(js, name, strlen(name));
+}
+
+
+
+/* Start a bracket-enclosed array.
+   An array may only begin in an array context or when no context has yet been started. (The beginning of a file) 
+   count is the number of elements for a binary header, if known, or JS_PACK_INDEFINITE. */
+int json_start_array_internal(json_stream_struct *js, size_t count) {
+  int status;
+
+  if(js->file_started != 0) {
+    if(js->stack_depth <= 0) {
+      js_set_error(js, JSON_ERROR_ARRAY_AFTER_END);
+      return -1;
+    }
+    if(JS_FRAME(js, js->stack_depth) != JSON_ARRAY) {
+      js_set_error(js, JSON_ERROR_ARRAY_CONTEXT);
+      return -1;
+    } 
+  }
+
+  status = js_check_depth(js, 1);
+  if(status) return status;
+
+  status = js_reset_buffer(js);
+  if(status) return status;
+
+  status = new_element(js); /* Print a comma if this follows a previous element. */
+  if(status) return status;
+
+  /* Indent and print the open bracket. */
+  status = do_indent(js); 
+  if(status) return status;
+  status = js_write_open(js, JSON_ARRAY, count);
+  if(status) return status;
+
+  /* Record that a new array has been opened. */
+  js->prior_element = JSON_NULL;
+  js_push_frame(js, JSON_ARRAY);
+  js->file_started = 1;
+
+  return js_end_call(js, 0);
+};
+
+int json_start_array(json_stream_struct *js) {
+  JS_STAT_CALL(js, JSON_CALL_START_ARRAY);
+  return json_start_array_internal(js, JS_PACK_INDEFINITE);
+}
+
+
+
+/* Start an named array. (A name: value pair where the value is an array.)
+   Must be in an object context. The name is either name_len characters long, 
+   or pre-encoded as key. count is as for json_start_array_internal. */
+int json_start_array_named_internal(json_stream_struct *js, const char *name, size_t name_len, 
+                                  const json_key *key, size_t count) {
+  int status;
+
+  if(js->stack_depth <= 0) {
+    js_set_error(js, JSON_ERROR_NAMED_ARRAY_NO_CONTEXT);
+    return -1;
+  }
+
+  if(JS_FRAME(js, js->stack_depth) != JSON_OBJECT) {
+    js_set_error(js, JSON_ERROR_NAMED_ARRAY_CONTEXT);
+    return -1;
+  }
+
+  status = js_check_depth(js, 1);
+  status = status?status:js_check_name_utf8(js, name, name_len, key);
+  if(status) return status;
+
+  status = js_reset_buffer(js);
+  if(status) return status;
+
+  status = new_element(js); /* Print a comma if this follows a previous element. */
+  if(status) return status;
+
+  /* Indent and print the name and open bracket. */
+  status = do_indent(js); 
+  if(status) return status;
+
+  status = js_write_name(js, name, name_len, key);
+  status = status?status:js_write_open(js, JSON_ARRAY, count);
+  if(status) return status;
+  // ggg fprintf(js->out, "\"%s\": [", name);
+
+  /* Record that a new array has been opened. */
+  js->prior_element = JSON_NULL;
+  js_push_frame(js, JSON_ARRAY);
+
+  return js_end_call(js, 0);
+};
+
+
+
+/* Start a named array from a name of name_len characters. */
+int json_start_array_named_n(json_stream_struct *js, const char *name, size_t name_len) {
+  JS_STAT_CALL(js, JSON_CALL_START_ARRAY);
+  return json_start_array_named_internal(js, name, name_len, NULL, JS_PACK_INDEFINITE);
+}
+
+
+
+/* Start a named array from a pre-encoded key. */
+int json_start_array_named_k(json_stream_struct *js, const json_key *key) {
+  JS_STAT_CALL(js, JSON_CALL_START_ARRAY);
+  return json_start_array_named_internal(js, NULL, 0, key, JS_PACK_INDEFINITE);
+}
+
+
+
+/* Start a named array from a NUL-terminated name, which is sanitized first. */
+int json_start_array_named(json_stream_struct *js, char *name) {
+  sanitize_string(js, name);
+  return json_start_array_named_n(js, name, strlen(name));
+}
+
+
+  
+/* Close an array or object, shared internal-use function. */
+int json_end_context_internal(json_stream_struct *js) {
+  int status;
+  JSON_TYPE open_context;
+
+  if(js->stack_depth <= 0) {
+    js_set_error(js, JSON_ERROR_CLOSE_NO_CONTEXT);
+    return -1;
+  }
+
+  if(js->stack_depth <= js->fragment_depth) {
+    js_set_error(js, JSON_ERROR_CLOSE_FRAGMENT_PARENT);
+    return -1;
+  }
+
+  open_context = JS_FRAME(js, js->stack_depth);
+
+  js->stack_depth--; /* Record that the object has been closed. */
+
+  if(JS_BINARY(js)) {
+    status = js_pack_close(js, open_context);
+    if(status) return status;
+  } else {
+    status = do_indent(js);
+    if(status) return status;
+
+    if(open_context == JSON_OBJECT) {
+      status = write_bytes(js, "}", 1);
+      if(status) return status;
+    }
+    if(open_context == JSON_ARRAY) {
+      status = write_bytes(js, "]", 1);
+      if(status) return status;
+    }
+  }
+  
+  /* In record mode, closing the top-level context ends the record and its line,
+     and the stream is ready to start the next one. Binary records follow one 
+     another directly. */
+  if(js->record_mode && js->stack_depth == 0) {
+    status = JS_BINARY(js) ? 0 : write_bytes(js, "\n", 1);
+    if(status) return status;
+    js->file_started = 0;
+    js->prior_element = JSON_NULL;
+    js->records_pending++;
+    return 0;
+  }
+
+  /* The newly closed element is an element in its parent context. */
+  js->prior_element = JSON_ELEMENT;
+
+  return 0;
+};
+
+
+
+/* Close an array or object. */
+int json_end_context(json_stream_struct *js) {
+  int status;
+
+  JS_STAT_CALL(js, JSON_CALL_END_CONTEXT);
+  status = js_reset_buffer(js);
+  if(status) return status;
+  return js_end_call(js, json_end_context_internal(js));
+}
+
+
+  
+/* Write a singleton value. Must be in an array context.
+   String values will have enclosing quotes added. 
+   Number values should be serialized as a character array prior to passing. */
+int json_write_value(json_stream_struct *js, JSON_TYPE value_type, char *value) {
+  size_t value_len = 0;
+
+  if(value_type == JSON_STRING || value_type == JSON_NUMBER) {
+    sanitize_string(js, value);
+    value_len = strlen(value);
+  }
+  return json_write_value_n(js, value_type, value, value_len);
+}
+
+
+
+/* Write the value of a value or pair call: a string, number text, true, false
+   or null. */
+int js_write_scalar(json_stream_struct *js, JSON_TYPE value_type, const char *value, size_t value_len) {
+  int status;
+
+  if(JS_BINARY(js)) {
+    if(value_type == JSON_STRING) return js_pack_string(js, value, value_len);
+    if(value_type == JSON_NUMBER) return js_pack_number_text(js, value, value_len);
+    return js_pack_literal(js, value_type);
+  }
+
+  switch(value_type) {
+  case JSON_STRING:
+    status = write_bytes(js, "\"", 1);
+    status = status?status:write_string(js, value, value_len);
+    status = status?status:write_bytes(js, "\"", 1);
+    break;
+  case JSON_NUMBER:
+    status = write_bytes(js, value, value_len);
+    break;
+  case JSON_TRUE:
+    status = write_bytes(js, "true", 4);
+    break;
+  case JSON_FALSE:
+    status = write_bytes(js, "false", 5);
+    break;
+  default:
+    status = write_bytes(js, "null", 4);
+    break;
+  }
+  return status;
+}
+
+
+
+/* Write a singleton value of value_len characters. Must be in an array context. */
+int json_write_value_n(json_stream_struct *js, JSON_TYPE value_type, const char *value, size_t value_len) {
+  int status;
+
+  JS_STAT_CALL(js, JSON_CALL_WRITE_VALUE);
+  status = js_check_value_context(js);
+  if(status) return status;
+
+  if(value_type < JSON_STRING || value_type > JSON_NULL) {
+    js_set_error(js, JSON_ERROR_VALUE_TYPE);
+    return -1;
+  }
+  if(value_type == JSON_STRING) {
+    status = js_check_utf8(js, value, value_len);
+    if(status) return status;
+  } else if(value_type == JSON_NUMBER && JS_BINARY(js)) {
+    status = js_check_number_text(js, value, value_len);
+    if(status) return status;
+  }
+
+  status = js_begin_element(js);
+  if(status) return status;
+
+  return js_end_call(js, js_write_scalar(js, value_type, value, value_len));
+};
+
+
+  
+/* Write a name: value pair. Must be in an object context.
+   String values will have enclosing quotes added. 
+   Number values should be serialized as a character array prior to passing. */
+int json_write_pair(json_stream_struct *js, char *name, JSON_TYPE value_type, char *value) {
+  size_t value_len = 0;
+
+  sanitize_string(js, name);
+  if(value_type == JSON_STRING || value_type == JSON_NUMBER) {
+    sanitize_string(js, value);
+    value_len = strlen(value);
+  }
+  return json_write_pair_n(js, name, strlen(name), value_type, value, value_len);
+}
+
+
+
+/* Shared body of the pair writers. The name is either name_len characters long,
+   or pre-encoded as key. */
+int json_write_pair_internal(json_stream_struct *js, const char *name, size_t name_len, const json_key *key,
+                             JSON_TYPE value_type, const char *value, size_t value_len) {
+  int status;
+
+  JS_STAT_CALL(js, JSON_CALL_WRITE_PAIR);
+  status = js_check_pair_context(js);
+  if(status) return status;
+
+  if(value_type < JSON_STRING || value_type > JSON_NULL) {
+    js_set_error(js, JSON_ERROR_PAIR_TYPE);
+    return -1;
+  }
+  status = js_check_name_utf8(js, name, name_len, key);
+  if(!status && value_type == JSON_STRING) status = js_check_utf8(js, value, value_len);
+  if(!status && value_type == JSON_NUMBER && JS_BINARY(js)) status = js_check_number_text(js, value, value_len);
+  if(status) return status;
+
+  status = js_begin_element(js);
+  if(status) return status;
+
+  status = js_write_name(js, name, name_len, key);
+  if(status) return js_end_call(js, status);
+
+  return js_end_call(js, js_write_scalar(js, value_type, value, value_len));
+};
+
+
+
+/* Write a name: value pair with explicit lengths. Must be in an object context. */
+int json_write_pair_n(json_stream_struct *js, const char *name, size_t name_len, 
+                      JSON_TYPE value_type, const char *value, size_t value_len) {
+  return json_write_pair_internal(js, name, name_len, NULL, value_type, value, value_len);
+}
+
+
+
+/* Write a name: value pair with a pre-encoded key. Must be in an object context. */
+int json_write_pair_k(json_stream_struct *js, const json_key *key, 
+                      JSON_TYPE value_type, const char *value, size_t value_len) {
+  return json_write_pair_internal(js, NULL, 0, key, value_type, value, value_len);
+}
+
+
+
+/* Raw JSON. Validation is a single pass over the bytes with a bit per open 
+   object or array, as in the stream itself. String contents, where most of the
+   bytes of a typical document are, are skipped with the vectorized raw scan. */
+
+#define JS_IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+#define JS_IS_SPACE(c) ((c) == ' ' || (c) == '\n' || (c) == '\r' || (c) == '\t')
+
+/* What the validator expects next. */
+#define JS_RAW_VALUE 0 /* A value.                                     */
+#define JS_RAW_KEY   1 /* A member name and separator.                 */
+#define JS_RAW_NEXT  2 /* A comma or close after a value, or the end.  */
+
+static size_t js_raw_skip_space(const char *raw, size_t pos, size_t len) {
+  while(pos < len && JS_IS_SPACE(raw[pos])) pos++;
+  return pos;
+}
+
+
+
+/* Each of these checks the token starting at raw[pos] and returns the offset
+   just past it, or 0 if it is not valid. */
+
+static size_t js_raw_string(const char *raw, size_t pos, size_t len) {
+  size_t ii, seq_len;
+  char c;
+
+  pos++;
+  for(;;) {
+    pos += len - pos < 16 ? js_raw_scan_scalar(raw + pos, len - pos) : js_raw_scan(raw + pos, len - pos);
+    if(pos >= len) return 0;
+    c = raw[pos];
+    if(c == '"') return pos + 1;
+    if(c == '\\') {
+      if(pos + 1 >= len) return 0;
+      c = raw[pos + 1];
+      if(c == 'u') {
+        if(len - pos < 6) return 0;
+        for(ii = 2; ii < 6; ++ii) {
+          c = raw[pos + ii];
+          if(!JS_IS_DIGIT(c) && !((c | 0x20) >= 'a' && (c | 0x20) <= 'f')) return 0;
+        }
+        pos += 6;
+      } else if(c == '"' || c == '\\' || c == '/' || c == 'b' || c == 'f' || 
+                c == 'n' || c == 'r' || c == 't') {
+        pos += 2;
+      } else {
+        return 0;
+      }
+    } else if((unsigned char)c < 0x20) {
+      return 0;
+    } else {
+      seq_len = js_utf8_sequence(raw + pos, len - pos);
+      if(!seq_len) return 0;
+      pos += seq_len;
+    }
+  }
+}
+
+static size_t js_raw_number(const char *raw, size_t pos, size_t len) {
+  if(raw[pos] == '-') pos++;
+  if(pos >= len || !JS_IS_DIGIT(raw[pos])) return 0;
+  if(raw[pos] == '0') {
+    pos++;
+  } else {
+    while(pos < len && JS_IS_DIGIT(raw[pos])) pos++;
+  }
+  if(pos < len && raw[pos] == '.') {
+    pos++;
+    if(pos >= len || !JS_IS_DIGIT(raw[pos])) return 0;
+    while(pos < len && JS_IS_DIGIT(raw[pos])) pos++;
+  }
+  if(pos < len && (raw[pos] == 'e' || raw[pos] == 'E')) {
+    pos++;
+    if(pos < len && (raw[pos] == '+' || raw[pos] == '-')) pos++;
+    if(pos >= len || !JS_IS_DIGIT(raw[pos])) return 0;
+    while(pos < len && JS_IS_DIGIT(raw[pos])) pos++;
+  }
+  return pos;
+}
+
+static size_t js_raw_literal(const char *raw, size_t pos, size_t len, const char *literal, size_t literal_len) {
+  if(len - pos < literal_len || memcmp(raw + pos, literal, literal_len) != 0) return 0;
+  return pos + literal_len;
+}
+
+
+
+/* Check that raw[0, len) is exactly one JSON value nested no more than 
+   max_depth levels. Returns JSON_OK, JSON_ERROR_RAW_INVALID or JSON_ERROR_TOO_DEEP. */
+json_error js_validate_raw(const char *raw, size_t len, int max_depth) {
+  uint32_t frame_bits[(MAX_JSON_NESTED_DEPTH + 31) / 32];
+  uint32_t bit;
+  int depth, expect, is_array;
+  size_t pos;
+  char c;
+
+  depth = 0;
+  expect = JS_RAW_VALUE;
+  pos = 0;
+  for(;;) {
+    pos = js_raw_skip_space(raw, pos, len);
+    if(expect == JS_RAW_NEXT) {
+      if(depth == 0) return pos == len ? JSON_OK : JSON_ERROR_RAW_INVALID;
+      if(pos >= len) return JSON_ERROR_RAW_INVALID;
+      is_array = (frame_bits[(depth - 1) / 32] >> ((depth - 1) % 32)) & 1u;
+      c = raw[pos++];
+      if(c == ',') {
+        expect = is_array ? JS_RAW_VALUE : JS_RAW_KEY;
+      } else if(c == (is_array ? ']' : '}')) {
+        depth--;
+      } else {
+        return JSON_ERROR_RAW_INVALID;
+      }
+      continue;
+    }
+
+    if(pos >= len) return JSON_ERROR_RAW_INVALID;
+    c = raw[pos];
+    if(expect == JS_RAW_KEY) {
+      if(c != '"') return JSON_ERROR_RAW_INVALID;
+      pos = js_raw_string(raw, pos, len);
+      if(!pos) return JSON_ERROR_RAW_INVALID;
+      pos = js_raw_skip_space(raw, pos, len);
+      if(pos >= len || raw[pos] != ':') return JSON_ERROR_RAW_INVALID;
+      pos++;
+      expect = JS_RAW_VALUE;
+      continue;
+    }
+
+    if(c == '{' || c == '[') {
+      if(depth >= max_depth) return JSON_ERROR_TOO_DEEP;
+      bit = (uint32_t)1 << (depth % 32);
+      if(c == '[') {
+        frame_bits[depth / 32] |= bit;
+      } else {
+        frame_bits[depth / 32] &= ~bit;
+      }
+      depth++;
+      pos = js_raw_skip_space(raw, pos + 1, len);
+      if(pos < len && raw[pos] == (c == '[' ? ']' : '}')) {
+        depth--;
+        pos++;
+        expect = JS_RAW_NEXT;
+      } else {
+        expect = c == '[' ? JS_RAW_VALUE : JS_RAW_KEY;
+      }
+      continue;
+    }
+
+    if(c == '"') {
+      pos = js_raw_string(raw, pos, len);
+    } else if(c == '-' || JS_IS_DIGIT(c)) {
+      pos = js_raw_number(raw, pos, len);
+    } else if(c == 't') {
+      pos = js_raw_literal(raw, pos, len, "true", 4);
+    } else if(c == 'f') {
+      pos = js_raw_literal(raw, pos, len, "false", 5);
+    } else if(c == 'n') {
+      pos = js_raw_literal(raw, pos, len, "null", 4);
+    } else {
+      return JSON_ERROR_RAW_INVALID;
+    }
+    if(!pos) return JSON_ERROR_RAW_INVALID;
+    expect = JS_RAW_NEXT;
+  }
+}
+
+
+
+int json_validate_raw(const char *raw, size_t raw_len) {
+  return js_validate_raw(raw, raw_len, MAX_JSON_NESTED_DEPTH) == JSON_OK ? 0 : -1;
+}
+
+
+
+/* Shared check of the raw writers, before anything is written. Even trusted 
+   input must not be empty, which would leave a dangling comma or name. */
+int js_check_raw(json_stream_struct *js, const char *raw, size_t raw_len, int validate) {
+  json_error code;
+
+  if(JS_BINARY(js)) code = JSON_ERROR_ENCODING; /* Raw JSON is JSON text. */
+  else code = raw_len == 0 ? JSON_ERROR_RAW_INVALID : JSON_OK;
+  if(code == JSON_OK && validate) code = js_validate_raw(raw, raw_len, js->max_depth - js->stack_depth);
+  if(code != JSON_OK) {
+    js_set_error(js, code);
+    return -1;
+  }
+  return 0;
+}
+
+
+
+/* Splice raw JSON as a singleton value. Must be in an array context. */
+int json_write_raw_value(json_stream_struct *js, const char *raw, size_t raw_len, int validate) {
+  int status;
+
+  JS_STAT_CALL(js, JSON_CALL_WRITE_RAW);
+  status = js_check_value_context(js);
+  status = status?status:js_check_raw(js, raw, raw_len, validate);
+  if(status) return status;
+
+  status = js_begin_element(js);
+  if(status) return status;
+  return js_end_call(js, write_bytes(js, raw, raw_len));
+}
+
+
+
+/* Shared body of the raw pair writers. The name is either name_len characters 
+   long, or pre-encoded as key. */
+int json_write_raw_pair_internal(json_stream_struct *js, const char *name, size_t name_len, const json_key *key,
+                                 const char *raw, size_t raw_len, int validate) {
+  int status;
+
+  JS_STAT_CALL(js, JSON_CALL_WRITE_RAW);
+  status = js_check_pair_context(js);
+  status = status?status:js_check_name_utf8(js, name, name_len, key);
+  status = status?status:js_check_raw(js, raw, raw_len, validate);
+  if(status) return status;
+
+  status = js_begin_element(js);
+  if(status) return status;
+
+  status = js_write_name(js, name, name_len, key);
+  status = status?status:write_bytes(js, raw, raw_len);
+  return js_end_call(js, status);
+}
+
+
+
+int json_write_raw_pair(json_stream_struct *js, char *name, 
+                        const char *raw, size_t raw_len, int validate) {
+  sanitize_string(js, name);
+  return json_write_raw_pair_internal(js, name, strlen(name), NULL, raw, raw_len, validate);
+}
+
+
+
+int json_write_raw_pair_n(json_stream_struct *js, const char *name, size_t name_len, 
+                          const char *raw, size_t raw_len, int validate) {
+  return json_write_raw_pair_internal(js, name, name_len, NULL, raw, raw_len, validate);
+}
+
+
+
+int json_write_raw_pair_k(json_stream_struct *js, const json_key *key, 
+                          const char *raw, size_t raw_len, int validate) {
+  return json_write_raw_pair_internal(js, NULL, 0, key, raw, raw_len, validate);
+}
+
+
+
+/* Number formatting. Integers are converted two digits at a time from a table.
+   Doubles use Grisu2 (Loitsch, "Printing Floating-Point Numbers Quickly and 
+   Accurately with Integers", PLDI 2010), which always round-trips and yields 
+   the shortest digit string for all but a tiny fraction of inputs. */
+
+static const char js_digit_pairs[201] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+/* Write the decimal digits of value to out. Returns the number of characters. */
+static int js_format_uint64(char *out, uint64_t value) {
+  char digits[20];
+  int pos, len;
+  unsigned pair;
+
+  pos = 20;
+  while(value >= 100) {
+    pair = (unsigned)(value % 100) * 2;
+    value /= 100;
+    digits[--pos] = js_digit_pairs[pair + 1];
+    digits[--pos] = js_digit_pairs[pair];
+  }
+  if(value >= 10) {
+    pair = (unsigned)value * 2;
+    digits[--pos] = js_digit_pairs[pair + 1];
+    digits[--pos] = js_digit_pairs[pair];
+  } else {
+    digits[--pos] = (char)('0' + value);
+  }
+  len = 20 - pos;
+  memcpy(out, digits + pos, (size_t)len);
+  return len;
+}
+
+static int js_format_int64(char *out, int64_t value) {
+  if(value < 0) {
+    *out = '-';
+    /* Negate in unsigned arithmetic so INT64_MIN does not overflow. */
+    return 1 + js_format_uint64(out + 1, (uint64_t)0 - (uint64_t)value);
+  }
+  return js_format_uint64(out, (uint64_t)value);
+}
+
+/* Floating point value as f * 2^e, with a 64-bit significand. */
+typedef struct {
+  uint64_t f;
+  int e;
+} js_diy_fp;
+
+#define JS_DP_SIGNIFICAND_MASK UINT64_C(0x000FFFFFFFFFFFFF)
+#define JS_DP_HIDDEN_BIT       UINT64_C(0x0010000000000000)
+#define JS_DP_EXPONENT_BIAS    (0x3FF + 52)
+
+/* Normalized 10^k for k = -348, -340, ..., 340. */
+static const uint64_t js_cached_powers_f[] = {
+  UINT64_C(0xfa8fd5a0081c0288), UINT64_C(0xbaaee17fa23ebf76), UINT64_C(0x8b16fb203055ac76),
+  UINT64_C(0xcf42894a5dce35ea), UINT64_C(0x9a6bb0aa55653b2d), UINT64_C(0xe61acf033d1a45df),
+  UINT64_C(0xab70fe17c79ac6ca), UINT64_C(0xff77b1fcbebcdc4f), UINT64_C(0xbe5691ef416bd60c),
+  UINT64_C(0x8dd01fad907ffc3c), UINT64_C(0xd3515c2831559a83), UINT64_C(0x9d71ac8fada6c9b5),
+  UINT64_C(0xea9c227723ee8bcb), UINT64_C(0xaecc49914078536d), UINT64_C(0x823c12795db6ce57),
+  UINT64_C(0xc21094364dfb5637), UINT64_C(0x9096ea6f3848984f), UINT64_C(0xd77485cb25823ac7),
+  UINT64_C(0xa086cfcd97bf97f4), UINT64_C(0xef340a98172aace5), UINT64_C(0xb23867fb2a35b28e),
+  UINT64_C(0x84c8d4dfd2c63f3b), UINT64_C(0xc5dd44271ad3cdba), UINT64_C(0x936b9fcebb25c996),
+  UINT64_C(0xdbac6c247d62a584), UINT64_C(0xa3ab66580d5fdaf6), UINT64_C(0xf3e2f893dec3f126),
+  UINT64_C(0xb5b5ada8aaff80b8), UINT64_C(0x87625f056c7c4a8b), UINT64_C(0xc9bcff6034c13053),
+  UINT64_C(0x964e858c91ba2655), UINT64_C(0xdff9772470297ebd), UINT64_C(0xa6dfbd9fb8e5b88f),
+  UINT64_C(0xf8a95fcf88747d94), UINT64_C(0xb94470938fa89bcf), UINT64_C(0x8a08f0f8bf0f156b),
+  UINT64_C(0xcdb02555653131b6), UINT64_C(0x993fe2c6d07b7fac), UINT64_C(0xe45c10c42a2b3b06),
+  UINT64_C(0xaa242499697392d3), UINT64_C(0xfd87b5f28300ca0e), UINT64_C(0xbce5086492111aeb),
+  UINT64_C(0x8cbccc096f5088cc), UINT64_C(0xd1b71758e219652c), UINT64_C(0x9c40000000000000),
+  UINT64_C(0xe8d4a51000000000), UINT64_C(0xad78ebc5ac620000), UINT64_C(0x813f3978f8940984),
+  UINT64_C(0xc097ce7bc90715b3), UINT64_C(0x8f7e32ce7bea5c70), UINT64_C(0xd5d238a4abe98068),
+  UINT64_C(0x9f4f2726179a2245), UINT64_C(0xed63a231d4c4fb27), UINT64_C(0xb0de65388cc8ada8),
+  UINT64_C(0x83c7088e1aab65db), UINT64_C(0xc45d1df942711d9a), UINT64_C(0x924d692ca61be758),
+  UINT64_C(0xda01ee641a708dea), UINT64_C(0xa26da3999aef774a), UINT64_C(0xf209787bb47d6b85),
+  UINT64_C(0xb454e4a179dd1877), UINT64_C(0x865b86925b9bc5c2), UINT64_C(0xc83553c5c8965d3d),
+  UINT64_C(0x952ab45cfa97a0b3), UINT64_C(0xde469fbd99a05fe3), UINT64_C(0xa59bc234db398c25),
+  UINT64_C(0xf6c69a72a3989f5c), UINT64_C(0xb7dcbf5354e9bece), UINT64_C(0x88fcf317f22241e2),
+  UINT64_C(0xcc20ce9bd35c78a5), UINT64_C(0x98165af37b2153df), UINT64_C(0xe2a0b5dc971f303a),
+  UINT64_C(0xa8d9d1535ce3b396), UINT64_C(0xfb9b7cd9a4a7443c), UINT64_C(0xbb764c4ca7a44410),
+  UINT64_C(0x8bab8eefb6409c1a), UINT64_C(0xd01fef10a657842c), UINT64_C(0x9b10a4e5e9913129),
+  UINT64_C(0xe7109bfba19c0c9d), UINT64_C(0xac2820d9623bf429), UINT64_C(0x80444b5e7aa7cf85),
+  UINT64_C(0xbf21e44003acdd2d), UINT64_C(0x8e679c2f5e44ff8f), UINT64_C(0xd433179d9c8cb841),
+  UINT64_C(0x9e19db92b4e31ba9), UINT64_C(0xeb96bf6ebadf77d9), UINT64_C(0xaf87023b9bf0ee6b)
+};
+
+static const int16_t js_cached_powers_e[] = {
+  -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+  -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+  -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+  -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+  -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+  109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+  375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+  641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+  907, 933, 960, 986, 1013, 1039, 1066
+};
+
+static js_diy_fp js_diy_fp_multiply(js_diy_fp x, js_diy_fp y) {
+  const uint64_t mask32 = UINT64_C(0xFFFFFFFF);
+  uint64_t a, b, c, d, ac, bc, ad, bd, tmp;
+  js_diy_fp r;
+
+  a = x.f >> 32;
+  b = x.f & mask32;
+  c = y.f >> 32;
+  d = y.f & mask32;
+  ac = a * c;
+  bc = b * c;
+  ad = a * d;
+  bd = b * d;
+  tmp = (bd >> 32) + (ad & mask32) + (bc & mask32);
+  tmp += UINT64_C(1) << 31; /* Round. */
+  r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+  r.e = x.e + y.e + 64;
+  return r;
+}
+
+static js_diy_fp js_diy_fp_normalize(js_diy_fp x) {
+  while(!(x.f & (UINT64_C(1) << 63))) {
+    x.f <<= 1;
+    x.e--;
+  }
+  return x;
+}
+
+/* Round the last generated digit towards the exact value when still inside the bounds. */
+static void js_grisu_round(char *buffer, int len, uint64_t delta, uint64_t rest, 
+                           uint64_t ten_kappa, uint64_t wp_w) {
+  while(rest < wp_w && delta - rest >= ten_kappa &&
+        (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+    buffer[len - 1]--;
+    rest += ten_kappa;
+  }
+}
+
+static void js_grisu_digit_gen(js_diy_fp w, js_diy_fp mp, uint64_t delta, 
+                               char *buffer, int *len, int *k) {
+  static const uint64_t pow10[] = {
+    UINT64_C(1), UINT64_C(10), UINT64_C(100), UINT64_C(1000), UINT64_C(10000), 
+    UINT64_C(100000), UINT64_C(1000000), UINT64_C(10000000), UINT64_C(100000000), 
+    UINT64_C(1000000000), UINT64_C(10000000000), UINT64_C(100000000000), 
+    UINT64_C(1000000000000), UINT64_C(10000000000000), UINT64_C(100000000000000), 
+    UINT64_C(1000000000000000), UINT64_C(10000000000000000), 
+    UINT64_C(100000000000000000), UINT64_C(1000000000000000000), 
+    UINT64_C(10000000000000000000)
+  };
+  js_diy_fp one;
+  uint64_t wp_w, p2, tmp;
+  uint32_t p1, d;
+  int kappa, index;
+
+  one.e = mp.e;
+  one.f = UINT64_C(1) << -mp.e;
+  wp_w = mp.f - w.f;
+  p1 = (uint32_t)(mp.f >> -one.e);
+  p2 = mp.f & (one.f - 1);
+
+  kappa = 1;
+  while(kappa < 10 && p1 >= pow10[kappa]) kappa++;
+  *len = 0;
+
+  while(kappa > 0) {
+    d = p1 / (uint32_t)pow10[kappa - 1];
+    p1 %= (uint32_t)pow10[kappa - 1];
+    if(d || *len) buffer[(*len)++] = (char)('0' + d);
+    kappa--;
+    tmp = ((uint64_t)p1 << -one.e) + p2;
+    if(tmp <= delta) {
+      *k += kappa;
+      js_grisu_round(buffer, *len, delta, tmp, pow10[kappa] << -one.e, wp_w);
+      return;
+    }
+  }
+
+  for(;;) {
+    p2 *= 10;
+    delta *= 10;
+    d = (uint32_t)(p2 >> -one.e);
+    if(d || *len) buffer[(*len)++] = (char)('0' + d);
+    p2 &= one.f - 1;
+    kappa--;
+    if(p2 < delta) {
+      *k += kappa;
+      index = -kappa;
+      js_grisu_round(buffer, *len, delta, p2, one.f, wp_w * (index < 20 ? pow10[index] : 0));
+      return;
+    }
+  }
+}
+
+/* Shortest digits of a positive finite value: value ~= digits * 10^k. */
+static void js_grisu2(double value, char *buffer, int *len, int *k) {
+  js_diy_fp v, w_plus, w_minus, c_mk, w, wp, wm;
+  uint64_t bits;
+  int biased_e, shift, cached_k, index;
+  double dk;
+
+  memcpy(&bits, &value, sizeof(bits));
+  biased_e = (int)((bits >> 52) & 0x7FF);
+  v.f = bits & JS_DP_SIGNIFICAND_MASK;
+  if(biased_e != 0) {
+    v.f += JS_DP_HIDDEN_BIT;
+    v.e = biased_e - JS_DP_EXPONENT_BIAS;
+  } else {
+    v.e = 1 - JS_DP_EXPONENT_BIAS;
+  }
+
+  /* Boundaries halfway to the neighbouring doubles, sharing w_plus's exponent. */
+  w_plus.f = (v.f << 1) + 1;
+  w_plus.e = v.e - 1;
+  while(!(w_plus.f & (JS_DP_HIDDEN_BIT << 1))) {
+    w_plus.f <<= 1;
+    w_plus.e--;
+  }
+  w_plus.f <<= 64 - 52 - 2;
+  w_plus.e -= 64 - 52 - 2;
+  if(v.f == JS_DP_HIDDEN_BIT) {
+    w_minus.f = (v.f << 2) - 1;
+    w_minus.e = v.e - 2;
+  } else {
+    w_minus.f = (v.f << 1) - 1;
+    w_minus.e = v.e - 1;
+  }
+  shift = w_minus.e - w_plus.e;
+  w_minus.f <<= shift;
+  w_minus.e = w_plus.e;
+
+  /* Cached power of ten bringing w_plus's exponent into [-60, -32]. */
+  dk = (-61 - w_plus.e) * 0.30102999566398114 + 347;
+  cached_k = (int)dk;
+  if(dk - cached_k > 0.0) cached_k++;
+  index = (cached_k >> 3) + 1;
+  *k = -(-348 + index * 8);
+  c_mk.f = js_cached_powers_f[index];
+  c_mk.e = js_cached_powers_e[index];
+
+  w = js_diy_fp_multiply(js_diy_fp_normalize(v), c_mk);
+  wp = js_diy_fp_multiply(w_plus, c_mk);
+  wm = js_diy_fp_multiply(w_minus, c_mk);
+  wm.f++;
+  wp.f--;
+  js_grisu_digit_gen(w, wp, wp.f - wm.f, buffer, len, k);
+}
+
+/* Write a finite double in the shortest form that reads back as the same value,
+   laid out like JavaScript's Number.prototype.toString. Needs 25 characters. */
+static int js_format_double(char *out, double value) {
+  char digits[20];
+  char *p;
+  int len, k, kk, ii, exponent;
+  uint64_t bits;
+
+  p = out;
+  memcpy(&bits, &value, sizeof(bits));
+  if(bits >> 63) {
+    *p++ = '-';
+    value = -value;
+  }
+  if(value == 0.0) {
+    *p++ = '0';
+    return (int)(p - out);
+  }
+
+  js_grisu2(value, digits, &len, &k);
+  kk = len + k; /* 10^(kk-1) <= value < 10^kk */
+
+  if(k >= 0 && kk <= 21) {
+    /* 1234e7 -> 12340000000 */
+    memcpy(p, digits, (size_t)len);
+    for(ii = len; ii < kk; ++ii) p[ii] = '0';
+    p += kk;
+  } else if(kk > 0 && kk <= 21) {
+    /* 1234e-2 -> 12.34 */
+    memcpy(p, digits, (size_t)kk);
+    p[kk] = '.';
+    memcpy(p + kk + 1, digits + kk, (size_t)(len - kk));
+    p += len + 1;
+  } else if(kk > -6 && kk <= 0) {
+    /* 1234e-6 -> 0.001234 */
+    *p++ = '0';
+    *p++ = '.';
+    for(ii = kk; ii < 0; ++ii) *p++ = '0';
+    memcpy(p, digits, (size_t)len);
+    p += len;
+  } else {
+    /* 1234e30 -> 1.234e+33 */
+    *p++ = digits[0];
+    if(len > 1) {
+      *p++ = '.';
+      memcpy(p, digits + 1, (size_t)(len - 1));
+      p += len - 1;
+    }
+    *p++ = 'e';
+    exponent = kk - 1;
+    if(exponent < 0) {
+      *p++ = '-';
+      exponent = -exponent;
+    } else {
+      *p++ = '+';
+    }
+    p += js_format_uint64(p, (uint64_t)exponent);
+  }
+  return (int)(p - out);
+}
+
+/* Longest output of js_format_int64, js_format_uint64 or js_format_double. */
+#define JS_MAX_NUMBER_LEN 25
+
+
+
+/* Format a number straight into the stream buffer. */
+int write_int64(json_stream_struct *js, int64_t value) {
+  char *out;
+  if(JS_BINARY(js)) return js_pack_int64(js, value);
+  out = js_reserve(js, JS_MAX_NUMBER_LEN);
+  if(!out) return -1;
+  js_commit(js, (size_t)js_format_int64(out, value));
+  return 0;
+}
+
+int write_uint64(json_stream_struct *js, uint64_t value) {
+  char *out;
+  if(JS_BINARY(js)) return js_pack_uint64(js, value);
+  out = js_reserve(js, JS_MAX_NUMBER_LEN);
+  if(!out) return -1;
+  js_commit(js, (size_t)js_format_uint64(out, value));
+  return 0;
+}
+
+int write_double(json_stream_struct *js, double value) {
+  char *out;
+  if(JS_BINARY(js)) return js_pack_double(js, value);
+  out = js_reserve(js, JS_MAX_NUMBER_LEN);
+  if(!out) return -1;
+  js_commit(js, (size_t)js_format_double(out, value));
+  return 0;
+}
+
+
+
+/* JSON has no representation for NaN or infinities. */
+int js_check_finite(json_stream_struct *js, double value) {
+  if(value != value || value - value != 0.0) {
+    js_set_error(js, JSON_ERROR_NOT_FINITE);
+    return -1;
+  }
+  return 0;
+}
+
+
+
+/* Write a number as a singleton value. Must be in an array context. */
+int json_write_int64(json_stream_struct *js, int64_t value) {
+  int status;
+
+  JS_STAT_CALL(js, JSON_CALL_WRITE_NUMBER);
+  status = js_check_value_context(js);
+  if(status) return status;
+  status = js_begin_element(js);
+  status = status?status:write_int64(js, value);
+  return js_end_call(js, status);
+}
+
+int json_write_uint64(json_stream_struct *js, uint64_t value) {
+  int status;
+
+  JS_STAT_CALL(js, JSON_CALL_WRITE_NUMBER);
+  status = js_check_value_context(js);
+  if(status) return status;
+  status = js_begin_element(js);
+  status = status?status:write_uint64(js, value);
+  return js_end_call(js, status);
+}
+
+int json_write_double(json_stream_struct *js, double value) {
+  int status;
+
+  JS_STAT_CALL(js, JSON_CALL_WRITE_NUMBER);
+  status = js_check_value_context(js);
+  if(status) return status;
+  status = js_check_finite(js, value);
+  if(status) return status;
+  status = js_begin_element(js);
+  status = status?status:write_double(js, value);
+  return js_end_call(js, status);
+}
+
+
+
+/* Write a name: number pair. Must be in an object context. The _n forms take
+   the name's length instead of sanitizing a NUL-terminated name, and the _k 
+   forms a pre-encoded key. */
+int json_write_pair_int64(json_stream_struct *js, char *name, int64_t value) {
+  sanitize_string(js, name);
+  return json_write_pair_int64_n(js, name, strlen(name), value);
+}
+
+int json_write_pair_int64_internal(json_stream_struct *js, const char *name, size_t name_len, 
+                                const json_key *key, int64_t value) {
+  int status;
+
+  JS_STAT_CALL(js, JSON_CALL_WRITE_PAIR_NUMBER);
+  status = js_check_pair_context(js);
+  if(status) return status;
+  status = js_begin_element(js);
+  status = status?status:js_write_name(js, name, name_len, key);
+  status = status?status:write_int64(js, value);
+  return js_end_call(js, status);
+}
+
+int json_write_pair_int64_n(json_stream_struct *js, const char *name, size_t name_len, int64_t value) {
+  return json_write_pair_int64_internal(js, name, name_len, NULL, value);
+}
+
+int json_write_pair_int64_k(json_stream_struct *js, const json_key *key, int64_t value) {
+  return json_write_pair_int64_internal(js, NULL, 0, key, value);
+}
+
+int json_write_pair_uint64(json_stream_struct *js, char *name, uint64_t value) {
+  sanitize_string(js, name);
+  return json_write_pair_uint64_n(js, name, strlen(name), value);
+}
+
+int json_write_pair_uint64_internal(json_stream_struct *js, const char *name, size_t name_len, 
+                                const json_key *key, uint64_t value) {
+  int status;
+
+  JS_STAT_CALL(js, JSON_CALL_WRITE_PAIR_NUMBER);
+  status = js_check_pair_context(js);
+  if(status) return status;
+  status = js_begin_element(js);
+  status = status?status:js_write_name(js, name, name_len, key);
+  status = status?status:write_uint64(js, value);
+  return js_end_call(js, status);
+}
+
+int json_write_pair_uint64_n(json_stream_struct *js, const char *name, size_t name_len, uint64_t value) {
+  return json_write_pair_uint64_internal(js, name, name_len, NULL, value);
+}
+
+int json_write_pair_uint64_k(json_stream_struct *js, const json_key *key, uint64_t value) {
+  return json_write_pair_uint64_internal(js, NULL, 0, key, value);
+}
+
+int json_write_pair_double(json_stream_struct *js, char *name, double value) {
+  sanitize_string(js, name);
+  return json_write_pair_double_n(js, name, strlen(name), value);
+}
+
+int json_write_pair_double_internal(json_stream_struct *js, const char *name, size_t name_len, 
+                                const json_key *key, double value) {
+  int status;
+
+  JS_STAT_CALL(js, JSON_CALL_WRITE_PAIR_NUMBER);
+  status = js_check_pair_context(js);
+  if(status) return status;
+  status = js_check_finite(js, value);
+  if(status) return status;
+  status = js_begin_element(js);
+  status = status?status:js_write_name(js, name, name_len, key);
+  status = status?status:write_double(js, value);
+  return js_end_call(js, status);
+}
+
+int json_write_pair_double_n(json_stream_struct *js, const char *name, size_t name_len, double value) {
+  return json_write_pair_double_internal(js, name, name_len, NULL, value);
+}
+
+int json_write_pair_double_k(json_stream_struct *js, const json_key *key, double value) {
+  return json_write_pair_double_internal(js, NULL, 0, key, value);
+}
+
+
+
+/* Bulk array writers. The context is checked and the brackets written once, then
+   every element is formatted in a tight loop straight into the stream buffer. */
+
+typedef enum {
+  JS_BULK_INT64,
+  JS_BULK_DOUBLE,
+  JS_BULK_BOOL,
+  JS_BULK_STRING
+} js_bulk_type;
+
+/* The elements of a bulk array in a binary encoding, after a header holding 
+   their count. Nothing separates them. */
+int js_pack_bulk(json_stream_struct *js, js_bulk_type type, const void *values, 
+                 const size_t *lengths, size_t count) {
+  const int64_t *ints = (const int64_t *)values;
+  const double *doubles = (const double *)values;
+  const int *bools = (const int *)values;
+  const char *const *strings = (const char *const *)values;
+  size_t ii;
+  int status = 0;
+
+  for(ii = 0; ii < count && !status; ++ii) {
+    switch(type) {
+    case JS_BULK_INT64:
+      status = js_pack_int64(js, ints[ii]);
+      break;
+    case JS_BULK_DOUBLE:
+      status = js_pack_double(js, doubles[ii]);
+      break;
+    case JS_BULK_BOOL:
+      status = js_pack_literal(js, bools[ii] ? JSON_TRUE : JSON_FALSE);
+      break;
+    case JS_BULK_STRING:
+      status = js_pack_string(js, strings[ii], lengths ? lengths[ii] : strlen(strings[ii]));
+      break;
+    }
+    status = js_end_call(js, status);
+  }
+  return status;
+}
+
+/* Shared body of the bulk array writers. The array is named (by name or key) 
+   when named is nonzero. lengths applies to strings only and may be NULL. */
+int json_write_array_internal(json_stream_struct *js, int named, const char *name, size_t name_len, 
+                              const json_key *key, js_bulk_type type, const void *values, 
+                              const size_t *lengths, size_t count) {
+  const int64_t *ints = (const int64_t *)values;
+  const double *doubles = (const double *)values;
+  const int *bools = (const int *)values;
+  const char *const *strings = (const char *const *)values;
+  size_t ii;
+  char *out;
+  int status, pretty, comma;
+
+  JS_STAT_CALL(js, JSON_CALL_WRITE_ARRAY);
+
+  /* Reject the whole array up front rather than stop partway through it. */
+  if(type == JS_BULK_DOUBLE) {
+    for(ii = 0; ii < count; ++ii) {
+      status = js_check_finite(js, doubles[ii]);
+      if(status) return status;
+    }
+  } else if(type == JS_BULK_STRING && js->utf8_policy == JSON_UTF8_REJECT) {
+    for(ii = 0; ii < count; ++ii) {
+      status = js_check_utf8(js, strings[ii], lengths ? lengths[ii] : strlen(strings[ii]));
+      if(status) return status;
+    }
+  }
+
+  if(named) {
+    status = json_start_array_named_internal(js, name, name_len, key, count);
+  } else {
+    status = json_start_array_internal(js, count);
+  }
+  if(status) return status;
+
+  if(JS_BINARY(js)) {
+    status = js_pack_bulk(js, type, values, lengths, count);
+    status = status?status:json_end_context_internal(js);
+    return js_end_call(js, status);
+  }
+
+  pretty = JS_HUMAN_READABLE(js);
+  for(ii = 0; ii < count && !status; ++ii) {
+    /* Compact numbers get their separating comma in the same reservation. */
+    comma = ii > 0 ? 1 : 0;
+    if(pretty || type == JS_BULK_BOOL || type == JS_BULK_STRING) {
+      if(comma) status = write_bytes(js, ",", 1);
+      status = status?status:do_indent(js);
+      if(status) break;
+      comma = 0;
+    }
+
+    switch(type) {
+    case JS_BULK_INT64:
+      out = js_reserve(js, 1 + JS_MAX_NUMBER_LEN);
+      if(!out) {
+        status = -1;
+        break;
+      }
+      out[0] = ',';
+      js_commit(js, (size_t)comma + (size_t)js_format_int64(out + comma, ints[ii]));
+      break;
+    case JS_BULK_DOUBLE:
+      out = js_reserve(js, 1 + JS_MAX_NUMBER_LEN);
+      if(!out) {
+        status = -1;
+        break;
+      }
+      out[0] = ',';
+      js_commit(js, (size_t)comma + (size_t)js_format_double(out + comma, doubles[ii]));
+      break;
+    case JS_BULK_BOOL:
+      status = bools[ii] ? write_bytes(js, "true", 4) : write_bytes(js, "false", 5);
+      break;
+    case JS_BULK_STRING:
+      status = write_bytes(js, "\"", 1);
+      status = status?status:write_string(js, strings[ii], lengths ? lengths[ii] : strlen(strings[ii]));
+      status = status?status:write_bytes(js, "\"", 1);
+      break;
+    }
+
+    /* Keep the buffer bounded when writing a long array to a sink. */
+    status = js_end_call(js, status);
+  }
+  if(count > 0) js->prior_element = JSON_ELEMENT;
+
+  status = status?status:json_end_context_internal(js);
+  return js_end_call(js, status);
+}
+
+
+
+/* Write a whole array of numbers, booleans or strings as one element. An array 
+   may only begin in an array context or when no context has yet been started. */
+int json_write_int64_array(json_stream_struct *js, const int64_t *values, size_t count) {
+  return json_write_array_internal(js, 0, NULL, 0, NULL, JS_BULK_INT64, values, NULL, count);
+}
+
+int json_write_double_array(json_stream_struct *js, const double *values, size_t count) {
+  return json_write_array_internal(js, 0, NULL, 0, NULL, JS_BULK_DOUBLE, values, NULL, count);
+}
+
+int json_write_bool_array(json_stream_struct *js, const int *values, size_t count) {
+  return json_write_array_internal(js, 0, NULL, 0, NULL, JS_BULK_BOOL, values, NULL, count);
+}
+
+int json_write_string_array(json_stream_struct *js, const char *const *values, 
+                            const size_t *lengths, size_t count) {
+  return json_write_array_internal(js, 0, NULL, 0, NULL, JS_BULK_STRING, values, lengths, count);
+}
+
+
+
+/* Write a whole named array. Must be in an object context. */
+int json_write_int64_array_named_n(json_stream_struct *js, const char *name, size_t name_len, 
+                                   const int64_t *values, size_t count) {
+  return json_write_array_internal(js, 1, name, name_len, NULL, JS_BULK_INT64, values, NULL, count);
+}
+
+int json_write_double_array_named_n(json_stream_struct *js, const char *name, size_t name_len, 
+                                    const double *values, size_t count) {
+  return json_write_array_internal(js, 1, name, name_len, NULL, JS_BULK_DOUBLE, values, NULL, count);
+}
+
+int json_write_bool_array_named_n(json_stream_struct *js, const char *name, size_t name_len, 
+                                  const int *values, size_t count) {
+  return json_write_array_internal(js, 1, name, name_len, NULL, JS_BULK_BOOL, values, NULL, count);
+}
+
+int json_write_string_array_named_n(json_stream_struct *js, const char *name, size_t name_len, 
+                                    const char *const *values, const size_t *lengths, size_t count) {
+  return json_write_array_internal(js, 1, name, name_len, NULL, JS_BULK_STRING, values, lengths, count);
+}
+
+int json_write_int64_array_named_k(json_stream_struct *js, const json_key *key, 
+                                   const int64_t *values, size_t count) {
+  return json_write_array_internal(js, 1, NULL, 0, key, JS_BULK_INT64, values, NULL, count);
+}
+
+int json_write_double_array_named_k(json_stream_struct *js, const json_key *key, 
+                                    const double *values, size_t count) {
+  return json_write_array_internal(js, 1, NULL, 0, key, JS_BULK_DOUBLE, values, NULL, count);
+}
+
+int json_write_bool_array_named_k(json_stream_struct *js, const json_key *key, 
+                                  const int *values, size_t count) {
+  return json_write_array_internal(js, 1, NULL, 0, key, JS_BULK_BOOL, values, NULL, count);
+}
+
+int json_write_string_array_named_k(json_stream_struct *js, const json_key *key, 
+                                    const char *const *values, const size_t *lengths, size_t count) {
+  return json_write_array_internal(js, 1, NULL, 0, key, JS_BULK_STRING, values, lengths, count);
+}
+
+
+
+/* Struct descriptors. Each name is encoded once, with a leading comma, so that
+   in compact output a member's separator and name are a single copy ahead of a
+   value formatted in place. */
+
+/* Check that a field can be read at its recorded size. */
+int js_check_field(json_stream_struct *js, const json_field *field) {
+  switch(field->type) {
+  case JSON_FIELD_INT:
+  case JSON_FIELD_UINT:
+  case JSON_FIELD_BOOL:
+    if(field->size == 1 || field->size == 2 || field->size == 4 || field->size == 8) return 0;
+    break;
+  case JSON_FIELD_DOUBLE:
+    if(field->size == sizeof(float) || field->size == sizeof(double)) return 0;
+    break;
+  case JSON_FIELD_STRING:
+    return 0;
+  case JSON_FIELD_CHARS:
+    if(field->size > 0) return 0;
+    break;
+  }
+  js_set_error(js, JSON_ERROR_FIELD);
+  return -1;
+}
+
+
+
+int json_struct_desc_make(json_stream_struct *js, json_struct_desc *desc, 
+                          const json_field *fields, size_t field_count) {
+  json_struct_field *compiled;
+  char *block, *bytes;
+  size_t ii, name_len, bytes_len;
+  int status;
+
+  desc->fields = NULL;
+  desc->field_count = 0;
+  desc->has_doubles = 0;
+
+  bytes_len = 0;
+  for(ii = 0; ii < field_count; ++ii) {
+    status = js_check_field(js, &fields[ii]);
+    status = status?status:js_check_utf8(js, fields[ii].name, strlen(fields[ii].name));
+    if(status) return status;
+    if(JS_BINARY(js)) bytes_len += JS_PACK_MAX_HEAD + 3 * strlen(fields[ii].name);
+    else bytes_len += 1 + 6 * strlen(fields[ii].name) + 4;
+  }
+
+  /* The fields and their keys share one allocation. */
+  block = js->realloc_fn(NULL, field_count * sizeof(json_struct_field) + bytes_len + 1);
+  if(!block) {
+    js_set_error(js, JSON_ERROR_NO_MEMORY_DESC);
+    return -1;
+  }
+  compiled = (json_struct_field *)block;
+  bytes = block + field_count * sizeof(json_struct_field);
+
+  for(ii = 0; ii < field_count; ++ii) {
+    name_len = strlen(fields[ii].name);
+    compiled[ii].type = fields[ii].type;
+    compiled[ii].offset = fields[ii].offset;
+    compiled[ii].size = fields[ii].size;
+    compiled[ii].key = bytes;
+    if(JS_BINARY(js)) {
+      compiled[ii].key_len = js_pack_encode_string(js, bytes, fields[ii].name, name_len);
+    } else {
+      bytes[0] = ',';
+      compiled[ii].key_len = 1 + js_encode_key(js, bytes + 1, fields[ii].name, name_len);
+    }
+    bytes += compiled[ii].key_len;
+    if(fields[ii].type == JSON_FIELD_DOUBLE) desc->has_doubles = 1;
+  }
+
+  desc->fields = compiled;
+  desc->field_count = field_count;
+  desc->encoding = js->encoding;
+  return 0;
+}
+
+
+
+void json_struct_desc_free(json_stream_struct *js, json_struct_desc *desc) {
+  if(desc->fields) js->realloc_fn(desc->fields, 0);
+  desc->fields = NULL;
+  desc->field_count = 0;
+  desc->has_doubles = 0;
+}
+
+
+
+/* Read struct members of the sizes js_check_field permits. memcpy keeps the 
+   reads legal whatever the alignment of the record. */
+static int64_t js_load_int(const char *p, size_t size) {
+  int8_t i8;
+  int16_t i16;
+  int32_t i32;
+  int64_t i64;
+
+  switch(size) {
+  case 1: memcpy(&i8, p, 1); return i8;
+  case 2: memcpy(&i16, p, 2); return i16;
+  case 4: memcpy(&i32, p, 4); return i32;
+  default: memcpy(&i64, p, 8); return i64;
+  }
+}
+
+static uint64_t js_load_uint(const char *p, size_t size) {
+  uint8_t u8;
+  uint16_t u16;
+  uint32_t u32;
+  uint64_t u64;
+
+  switch(size) {
+  case 1: memcpy(&u8, p, 1); return u8;
+  case 2: memcpy(&u16, p, 2); return u16;
+  case 4: memcpy(&u32, p, 4); return u32;
+  default: memcpy(&u64, p, 8); return u64;
+  }
+}
+
+static double js_load_double(const char *p, size_t size) {
+  float f;
+  double d;
+
+  if(size == sizeof(float)) {
+    memcpy(&f, p, sizeof(float));
+    return f;
+  }
+  memcpy(&d, p, sizeof(double));
+  return d;
+}
+
+
+
+/* Check the string a JSON_FIELD_STRING or JSON_FIELD_CHARS field of record
+   holds, under JSON_UTF8_REJECT. */
+int js_check_field_utf8(json_stream_struct *js, const json_struct_field *field, const char *record) {
+  const char *value = record + field->offset;
+  const char *str, *end;
+
+  if(field->type == JSON_FIELD_STRING) {
+    memcpy(&str, value, sizeof(str));
+    return str ? js_check_utf8(js, str, strlen(str)) : 0;
+  }
+  if(field->type == JSON_FIELD_CHARS) {
+    end = memchr(value, '\0', field->size);
+    return js_check_utf8(js, value, end ? (size_t)(end - value) : field->size);
+  }
+  return 0;
+}
+
+
+
+/* Write one member: key_len characters of encoded key, then the field's value
+   read from record. */
+int js_write_field(json_stream_struct *js, const json_struct_field *field, 
+                   const char *key, size_t key_len, const char *record) {
+  const char *value = record + field->offset;
+  const char *str, *end;
+  char *out;
+  int status;
+
+  switch(field->type) {
+  case JSON_FIELD_INT:
+  case JSON_FIELD_UINT:
+  case JSON_FIELD_DOUBLE:
+    out = js_reserve(js, key_len + JS_MAX_NUMBER_LEN);
+    if(!out) return -1;
+    memcpy(out, key, key_len);
+    out += key_len;
+    if(field->type == JSON_FIELD_INT) {
+      js_commit(js, key_len + (size_t)js_format_int64(out, js_load_int(value, field->size)));
+    } else if(field->type == JSON_FIELD_UINT) {
+      js_commit(js, key_len + (size_t)js_format_uint64(out, js_load_uint(value, field->size)));
+    } else {
+      js_commit(js, key_len + (size_t)js_format_double(out, js_load_double(value, field->size)));
+    }
+    return 0;
+  case JSON_FIELD_BOOL:
+    status = write_bytes(js, key, key_len);
+    if(status) return status;
+    return js_load_uint(value, field->size) ? write_bytes(js, "true", 4) : write_bytes(js, "false", 5);
+  case JSON_FIELD_STRING:
+    status = write_bytes(js, key, key_len);
+    if(status) return status;
+    memcpy(&str, value, sizeof(str));
+    if(!str) return write_bytes(js, "null", 4);
+    status = write_bytes(js, "\"", 1);
+    status = status?status:write_string(js, str, strlen(str));
+    return status?status:write_bytes(js, "\"", 1);
+  default: /* JSON_FIELD_CHARS */
+    status = write_bytes(js, key, key_len);
+    if(status) return status;
+    end = memchr(value, '\0', field->size);
+    status = write_bytes(js, "\"", 1);
+    status = status?status:write_string(js, value, end ? (size_t)(end - value) : field->size);
+    return status?status:write_bytes(js, "\"", 1);
+  }
+}
+
+
+
+/* Write one member in a binary encoding: the field's key, then its value read
+   from record. */
+int js_pack_field(json_stream_struct *js, const json_struct_field *field, const char *record) {
+  const char *value = record + field->offset;
+  const char *str, *end;
+  int status;
+
+  status = write_bytes(js, field->key, field->key_len);
+  if(status) return status;
+
+  switch(field->type) {
+  case JSON_FIELD_INT:
+    return js_pack_int64(js, js_load_int(value, field->size));
+  case JSON_FIELD_UINT:
+    return js_pack_uint64(js, js_load_uint(value, field->size));
+  case JSON_FIELD_DOUBLE:
+    return js_pack_double(js, js_load_double(value, field->size));
+  case JSON_FIELD_BOOL:
+    return js_pack_literal(js, js_load_uint(value, field->size) ? JSON_TRUE : JSON_FALSE);
+  case JSON_FIELD_STRING:
+    memcpy(&str, value, sizeof(str));
+    return str ? js_pack_string(js, str, strlen(str)) : js_pack_literal(js, JSON_NULL);
+  default: /* JSON_FIELD_CHARS */
+    end = memchr(value, '\0', field->size);
+    return js_pack_string(js, value, end ? (size_t)(end - value) : field->size);
+  }
+}
+
+
+
+/* Shared body of the struct array writers. The array is named (by name or key) 
+   when named is nonzero. */
+int json_write_struct_array_internal(json_stream_struct *js, int named, const char *name, size_t name_len, 
+                                     const json_key *key, const json_struct_desc *desc, 
+                                     const void *base, size_t count, size_t stride) {
+  const json_struct_field *field;
+  const char *record;
+  size_t ii, jj, skip;
+  int status, pretty;
+
+  JS_STAT_CALL(js, JSON_CALL_WRITE_STRUCT_ARRAY);
+
+  /* The keys are encoded already. */
+  if(desc->encoding != js->encoding) {
+    js_set_error(js, JSON_ERROR_ENCODING);
+    return -1;
+  }
+
+  /* The array and each record's object. */
+  status = js_check_depth(js, count > 0 ? 2 : 1);
+  if(status) return status;
+
+  /* Reject the whole array up front rather than stop partway through it. */
+  if(desc->has_doubles) {
+    for(ii = 0; ii < count; ++ii) {
+      record = (const char *)base + ii * stride;
+      for(jj = 0; jj < desc->field_count; ++jj) {
+        field = &desc->fields[jj];
+        if(field->type != JSON_FIELD_DOUBLE) continue;
+        status = js_check_finite(js, js_load_double(record + field->offset, field->size));
+        if(status) return status;
+      }
+    }
+  }
+  if(js->utf8_policy == JSON_UTF8_REJECT) {
+    for(ii = 0; ii < count; ++ii) {
+      record = (const char *)base + ii * stride;
+      for(jj = 0; jj < desc->field_count; ++jj) {
+        status = js_check_field_utf8(js, &desc->fields[jj], record);
+        if(status) return status;
+      }
+    }
+  }
+
+  if(named) {
+    status = json_start_array_named_internal(js, name, name_len, key, count);
+  } else {
+    status = json_start_array_internal(js, count);
+  }
+  if(status) return status;
+
+  if(JS_BINARY(js)) {
+    /* Every record is a map of field_count members. */
+    for(ii = 0; ii < count && !status; ++ii) {
+      record = (const char *)base + ii * stride;
+      status = js_pack_open(js, JSON_OBJECT, desc->field_count);
+      if(status) break;
+      js_push_frame(js, JSON_OBJECT);
+      for(jj = 0; jj < desc->field_count && !status; ++jj) {
+        status = js_pack_field(js, &desc->fields[jj], record);
+      }
+      status = status?status:json_end_context_internal(js);
+      status = js_end_call(js, status);
+    }
+    status = status?status:json_end_context_internal(js);
+    return js_end_call(js, status);
+  }
+
+  /* Each record indents its object and then its members one level deeper in 
+     the same call, so grow the run to the members' depth before the object's 
+     indentation can be gathered by reference. */
+  pretty = JS_HUMAN_READABLE(js);
+  if(pretty && count > 0 && 
+     (!js->indent_run || (size_t)js->stack_depth + 1 > js->indent_run_levels)) {
+    status = js_grow_indent(js, js->stack_depth + 1);
+    if(status) return js_end_call(js, status);
+  }
+  for(ii = 0; ii < count && !status; ++ii) {
+    record = (const char *)base + ii * stride;
+
+    if(ii > 0) status = write_bytes(js, ",", 1);
+    status = status?status:do_indent(js);
+    status = status?status:write_bytes(js, "{", 1);
+    if(status) break;
+    js_push_frame(js, JSON_OBJECT);
+
+    for(jj = 0; jj < desc->field_count && !status; ++jj) {
+      field = &desc->fields[jj];
+      /* Skip the comma ahead of the first member, and in human_readable mode 
+         write it separately, ahead of the indentation. */
+      skip = jj == 0 ? 1 : 0;
+      if(pretty) {
+        if(!skip) status = write_bytes(js, ",", 1);
+        status = status?status:do_indent(js);
+        skip = 1;
+      }
+      status = status?status:js_write_field(js, field, field->key + skip, field->key_len - skip, record);
+    }
+
+    status = status?status:json_end_context_internal(js);
+
+    /* Keep the buffer bounded when writing a long array to a sink. */
+    status = js_end_call(js, status);
   }
-  return 0;
+
+  status = status?status:json_end_context_internal(js);
+  return js_end_call(js, status);
 }
 
 
 
-/* Utility function to print human-readable indentation. */
-int do_indent(json_stream_struct *js) {
-  int ii, status;
-  if(js->file_started != 0 && js->human_readable != 0) {
-    for(ii = 0; ii < js->stack_depth; ++ii) {
-      status = write_str(js, js->indent_token);
-      if(status) return status;
-    }
-  }
-  return 0;
+/* Write a whole array of structs as one element. */
+int json_write_struct_array(json_stream_struct *js, const json_struct_desc *desc, 
+                            const void *base, size_t count, size_t stride) {
+  return json_write_struct_array_internal(js, 0, NULL, 0, NULL, desc, base, count, stride);
 }
 
+int json_write_struct_array_named_n(json_stream_struct *js, const char *name, size_t name_len, 
+                                    const json_struct_desc *desc, const void *base, 
+                                    size_t count, size_t stride) {
+  return json_write_struct_array_internal(js, 1, name, name_len, NULL, desc, base, count, stride);
+}
 
+int json_write_struct_array_named_k(json_stream_struct *js, const json_key *key, 
+                                    const json_struct_desc *desc, const void *base, 
+                                    size_t count, size_t stride) {
+  return json_write_struct_array_internal(js, 1, NULL, 0, key, desc, base, count, stride);
+}
 
-/* Utility function to print a comma when needed and record that an element has 
-   been printed inside the current context. */
-int new_element(json_stream_struct *js) {
-  int status;
-  /* Element names from the JSON structure are abused here because they make
-     readable labels. */
 
-  /* JSON_ELEMENT indicates that this is not the first element of an object or array. */
-  if(js->prior_element == JSON_ELEMENT) {
-    status = write_str(js, ",");
-    if(status) return status;
-  } else { /* JSON_NULL indicates that there was not a prior element. */
-    js->prior_element = JSON_ELEMENT;
-  }
-  status = js_newline(js);
-  return status;
+
+/* Templates. Recording is ordinary writing to a retained buffer; a hole is 
+   the element prefix (comma, indentation and name) with nothing after it, and
+   its offset in the buffer. Writing copies the runs between holes. */
+void json_template_begin(json_template *tpl, int human_readable, json_realloc_fn realloc_fn) {
+  json_init_stream_buffer(&tpl->rec, human_readable, realloc_fn);
+  tpl->rec.retain_buffer = 1;
+  tpl->holes = NULL;
+  tpl->hole_count = 0;
+  tpl->hole_cap = 0;
+  tpl->root = JSON_OBJECT;
+  tpl->depth = 0;
+  tpl->has_doubles = 0;
+  tpl->complete = 0;
 }
 
 
 
-/* Utility function. Permit a callback for string sanitization to be defined. 
-   NULL by default. (TODO: Are there C/C++ issues here?) */
-/*void (*string_sanitize_fn)(char *str) = NULL;*/
+/* Shared checks of the hole writers: a valid type, and room for one more hole. */
+int js_template_prepare_hole(json_template *tpl, json_field_type type) {
+  json_hole *holes;
+  size_t cap;
 
-void sanitize_string(json_stream_struct *js, char *str) {
-  if(js->string_sanitize_fn) {
-    (*(js->string_sanitize_fn))(str);
+  if(type != JSON_FIELD_INT && type != JSON_FIELD_UINT && type != JSON_FIELD_DOUBLE && 
+     type != JSON_FIELD_BOOL && type != JSON_FIELD_STRING) {
+    js_set_error(&tpl->rec, JSON_ERROR_HOLE_TYPE);
+    return -1;
   }
+  if(tpl->hole_count < tpl->hole_cap) return 0;
+
+  cap = tpl->hole_cap ? 2 * tpl->hole_cap : 8;
+  holes = (json_hole *)tpl->rec.realloc_fn(tpl->holes, cap * sizeof(json_hole));
+  if(!holes) {
+    js_set_error(&tpl->rec, JSON_ERROR_NO_MEMORY_TEMPLATE);
+    return -1;
+  }
+  tpl->holes = holes;
+  tpl->hole_cap = cap;
+  return 0;
 }
 
 
 
-/* Valid JSON must begin with an object or an array.  */
+/* Record a hole at the write cursor, once its element prefix is written. */
+void js_template_add_hole(json_template *tpl, json_field_type type) {
+  tpl->holes[tpl->hole_count].offset = tpl->rec.stream_buffer_len;
+  tpl->holes[tpl->hole_count].type = type;
+  tpl->hole_count++;
+  if(type == JSON_FIELD_DOUBLE) tpl->has_doubles = 1;
+}
 
-/* Start a brace-enclosed object. 
-   An object may only begin in an array context or when no context has yet been started. (The beginning of a file) */
-int json_start_object(json_stream_struct *js) {
-  int status;
 
-  if(js->file_started != 0) {
-    if(js->stack_depth <= 0) {
-      strcpy(js->error_string, "Attempted to open an object when file is already complete.");
-      return -1;
-    }
-    if(js->object_array_stack[js->stack_depth - 1] != JSON_ARRAY) {
-      strcpy(js->error_string, "Attempted to open an object when not starting a file or in array context.");
-      return -1;
-    } 
-  }
 
-  strcpy(js->stream_buffer, "");
+int json_template_hole(json_template *tpl, json_field_type type) {
+  json_stream_struct *js = &tpl->rec;
+  int status;
 
-  status = new_element(js); /* Print a comma if this follows a previous element. */
+  status = js_check_value_context(js);
+  status = status?status:js_template_prepare_hole(tpl, type);
   if(status) return status;
 
-  /* Indent and print the open brace. */
-  status = do_indent(js); 
-  if(status) return status;
-  status = write_str(js, "{");
+  status = js_begin_element(js);
   if(status) return status;
+  js_template_add_hole(tpl, type);
+  return js_end_call(js, 0);
+}
 
-  /* Record that a new object has been opened. */
-  js->prior_element = JSON_NULL;
-  js->stack_depth++;
-  js->object_array_stack[js->stack_depth - 1] = JSON_OBJECT;
-  js->file_started = 1;
-
-  return 0;
-};
 
 
-  
-/* Start an named object. (A name: value pair where the value is a new object.)
-   Must be in an object or array context. */
-int json_start_object_named(json_stream_struct *js, char *name) {
+/* Shared body of the pair hole writers. The name is either name_len characters 
+   long, or pre-encoded as key. */
+int js_template_pair_hole_internal(json_template *tpl, const char *name, size_t name_len, 
+                                   const json_key *key, json_field_type type) {
+  json_stream_struct *js = &tpl->rec;
   int status;
 
-  if(js->stack_depth <= 0) {
-    strcpy(js->error_string, "Attempted to start a named object when no context is open.");
-    return -1;
-  }
-
-  if(js->object_array_stack[js->stack_depth - 1] != JSON_OBJECT) {
-    strcpy(js->error_string, "Attempted to open a named object outside an object context.");
-    return -1;
-  }
+  status = js_check_pair_context(js);
+  status = status?status:js_check_name_utf8(js, name, name_len, key);
+  status = status?status:js_template_prepare_hole(tpl, type);
+  if(status) return status;
 
-  strcpy(js->stream_buffer, "");
+  status = js_begin_element(js);
+  status = status?status:js_write_name(js, name, name_len, key);
+  if(status) return js_end_call(js, status);
+  js_template_add_hole(tpl, type);
+  return js_end_call(js, 0);
+}
 
-  status = new_element(js); /* Print a comma if this follows a previous element. */
-  if(status) return status;
 
-  /* Indent and print the name and open brace. */
-  status = do_indent(js); 
-  if(status) return status;
 
-  sanitize_string(js, name);
-  status = write_str(js, "\"");
-  status = status?status:write_str(js, name);
-  status = status?status:write_str(js, "\": {");
-  if(status) return status;
-  // ggg fprintf(js->out, "\"%s\": {", name);
+int json_template_pair_hole(json_template *tpl, char *name, json_field_type type) {
+  sanitize_string(&tpl->rec, name);
+  return js_template_pair_hole_internal(tpl, name, strlen(name), NULL, type);
+}
 
-  /* Record that a new object has been opened. */
-  js->prior_element = JSON_NULL;
-  js->stack_depth++;
-  js->object_array_stack[js->stack_depth - 1] = JSON_OBJECT;
+int json_template_pair_hole_n(json_template *tpl, const char *name, size_t name_len, json_field_type type) {
+  return js_template_pair_hole_internal(tpl, name, name_len, NULL, type);
+}
 
-  return 0;
-};
+int json_template_pair_hole_k(json_template *tpl, const json_key *key, json_field_type type) {
+  return js_template_pair_hole_internal(tpl, NULL, 0, key, type);
+}
 
 
 
-/* Start a bracket-enclosed array.
-   An array may only begin in an array context or when no context has yet been started. (The beginning of a file) */
-int json_start_array(json_stream_struct *js) {
-  int status;
+/* Deepest nesting in the recorded output. Strings are skipped, so brackets in
+   names and values do not count. */
+static int js_template_depth(const char *bytes, size_t len) {
+  size_t ii;
+  int depth, max_depth, in_string;
 
-  if(js->file_started != 0) {
-    if(js->stack_depth <= 0) {
-      strcpy(js->error_string, "Attempted to open an array when file is already complete.");
-      return -1;
+  depth = 0;
+  max_depth = 0;
+  in_string = 0;
+  for(ii = 0; ii < len; ++ii) {
+    if(in_string) {
+      if(bytes[ii] == '\\') {
+        ii++;
+      } else if(bytes[ii] == '"') {
+        in_string = 0;
+      }
+    } else if(bytes[ii] == '"') {
+      in_string = 1;
+    } else if(bytes[ii] == '{' || bytes[ii] == '[') {
+      if(++depth > max_depth) max_depth = depth;
+    } else if(bytes[ii] == '}' || bytes[ii] == ']') {
+      depth--;
     }
-    if(js->object_array_stack[js->stack_depth - 1] != JSON_ARRAY) {
-      strcpy(js->error_string, "Attempted to open an array when not starting a file or in array context.");
-      return -1;
-    } 
   }
+  return max_depth;
+}
 
-  strcpy(js->stream_buffer, "");
-
-  status = new_element(js); /* Print a comma if this follows a previous element. */
-  if(status) return status;
 
-  /* Indent and print the open bracket. */
-  status = do_indent(js); 
-  if(status) return status;
-  status = write_str(js, "[");
-  if(status) return status;
 
-  /* Record that a new array has been opened. */
-  js->prior_element = JSON_NULL;
-  js->stack_depth++;
-  js->object_array_stack[js->stack_depth - 1] = JSON_ARRAY;
-  js->file_started = 1;
+int json_template_end(json_template *tpl) {
+  json_stream_struct *js = &tpl->rec;
 
+  if(JS_BINARY(js)) {
+    js_set_error(js, JSON_ERROR_ENCODING); /* Templates are JSON text. */
+    return -1;
+  }
+  if(js->error_code != JSON_OK || js->file_started == 0 || js->stack_depth != 0 || 
+     js->record_mode || js->stream_buffer_len == 0) {
+    js_set_error(js, JSON_ERROR_TEMPLATE_INCOMPLETE);
+    return -1;
+  }
+  tpl->root = js->stream_buffer[0] == '[' ? JSON_ARRAY : JSON_OBJECT;
+  tpl->depth = js_template_depth(js->stream_buffer, js->stream_buffer_len);
+  tpl->complete = 1;
   return 0;
-};
+}
 
 
 
-/* Start an named array. (A name: value pair where the value is an array.)
-   Must be in an object context. */
-int json_start_array_named(json_stream_struct *js, char *name) {
+void json_template_free(json_template *tpl) {
+  if(tpl->holes) tpl->rec.realloc_fn(tpl->holes, 0);
+  json_free_stream(&tpl->rec);
+  tpl->holes = NULL;
+  tpl->hole_count = 0;
+  tpl->hole_cap = 0;
+  tpl->complete = 0;
+}
+
+
+
+/* Write len characters of recorded output. A human readable template was 
+   recorded at the top level, so below it each line break gets the stream's 
+   indentation for the current depth ahead of the recorded indentation. */
+int js_write_template_bytes(json_stream_struct *js, const char *str, size_t len) {
+  const char *line_end;
+  size_t indent_len;
   int status;
 
-  if(js->stack_depth <= 0) {
-    strcpy(js->error_string, "Attempted to start a named array when no context is open.");
-    return -1;
-  }
+  if(!JS_HUMAN_READABLE(js) || js->stack_depth == 0) return write_bytes(js, str, len);
 
-  if(js->object_array_stack[js->stack_depth - 1] != JSON_OBJECT) {
-    strcpy(js->error_string, "Attempted to open a named array outside an object context.");
-    return -1;
+  if(!js->indent_run || (size_t)js->stack_depth > js->indent_run_levels) {
+    status = js_grow_indent(js, js->stack_depth);
+    if(status) return status;
   }
+  indent_len = 1 + (size_t)js->stack_depth * js->indent_token_len;
+  while((line_end = (const char *)memchr(str, '\n', len)) != NULL) {
+    status = write_bytes(js, str, (size_t)(line_end - str));
+    status = status?status:write_bytes(js, js->indent_run, indent_len);
+    if(status) return status;
+    len -= (size_t)(line_end + 1 - str);
+    str = line_end + 1;
+  }
+  return write_bytes(js, str, len);
+}
 
-  strcpy(js->stream_buffer, "");
-
-  status = new_element(js); /* Print a comma if this follows a previous element. */
-  if(status) return status;
 
-  /* Indent and print the name and open bracket. */
-  status = do_indent(js); 
-  if(status) return status;
 
-  sanitize_string(js, name);
-  status = write_str(js, "\"");
-  status = status?status:write_str(js, name);
-  status = status?status:write_str(js, "\": [");
-  if(status) return status;
-  // ggg fprintf(js->out, "\"%s\": [", name);
+/* Format the value of one hole. */
+int js_write_hole(json_stream_struct *js, json_field_type type, const json_hole_value *value) {
+  int status;
 
-  /* Record that a new array has been opened. */
-  js->prior_element = JSON_NULL;
-  js->stack_depth++;
-  js->object_array_stack[js->stack_depth - 1] = JSON_ARRAY;
+  switch(type) {
+  case JSON_FIELD_INT:
+    return write_int64(js, value->as.i);
+  case JSON_FIELD_UINT:
+    return write_uint64(js, value->as.u);
+  case JSON_FIELD_DOUBLE:
+    return write_double(js, value->as.d);
+  case JSON_FIELD_BOOL:
+    return value->as.b ? write_bytes(js, "true", 4) : write_bytes(js, "false", 5);
+  default: /* JSON_FIELD_STRING */
+    if(!value->as.str) return write_bytes(js, "null", 4);
+    status = write_bytes(js, "\"", 1);
+    status = status?status:write_string(js, value->as.str, value->len);
+    return status?status:write_bytes(js, "\"", 1);
+  }
+}
 
-  return 0;
-};
 
 
-  
-/* Close an array or object, shared internal-use function. */
-int json_end_context_internal(json_stream_struct *js) {
+int json_write_template(json_stream_struct *js, const json_template *tpl, const json_hole_value *values) {
+  const char *bytes;
+  size_t ii, pos;
   int status;
-  JSON_TYPE open_context;
 
-  if(js->stack_depth <= 0) {
-    strcpy(js->error_string, "Attempted to close a context when none is open.");
+  JS_STAT_CALL(js, JSON_CALL_WRITE_TEMPLATE);
+  if(JS_BINARY(js)) {
+    js_set_error(js, JSON_ERROR_ENCODING);
     return -1;
   }
+  if(!tpl->complete) {
+    js_set_error(js, JSON_ERROR_TEMPLATE_INCOMPLETE);
+    return -1;
+  }
+  if(js->file_started != 0) {
+    if(js->stack_depth <= 0) {
+      js_set_error(js, tpl->root == JSON_ARRAY ? JSON_ERROR_ARRAY_AFTER_END : JSON_ERROR_OBJECT_AFTER_END);
+      return -1;
+    }
+    if(JS_FRAME(js, js->stack_depth) != JSON_ARRAY) {
+      js_set_error(js, tpl->root == JSON_ARRAY ? JSON_ERROR_ARRAY_CONTEXT : JSON_ERROR_OBJECT_CONTEXT);
+      return -1;
+    }
+  }
 
-  open_context = js->object_array_stack[js->stack_depth - 1];
-
-  status = js_newline(js);
+  status = js_check_depth(js, tpl->depth);
   if(status) return status;
 
-  js->stack_depth--; /* Record that the object has been closed. */
+  /* Reject the whole template up front rather than stop partway through it. */
+  if(tpl->has_doubles) {
+    for(ii = 0; ii < tpl->hole_count; ++ii) {
+      if(tpl->holes[ii].type != JSON_FIELD_DOUBLE) continue;
+      status = js_check_finite(js, values[ii].as.d);
+      if(status) return status;
+    }
+  }
+  if(js->utf8_policy == JSON_UTF8_REJECT) {
+    for(ii = 0; ii < tpl->hole_count; ++ii) {
+      if(tpl->holes[ii].type != JSON_FIELD_STRING || !values[ii].as.str) continue;
+      status = js_check_utf8(js, values[ii].as.str, values[ii].len);
+      if(status) return status;
+    }
+  }
 
-  status = do_indent(js);
+  status = js_begin_element(js);
   if(status) return status;
 
-  if(open_context == JSON_OBJECT) {
-    status = write_str(js, "}");
-    if(status) return status;
-  }
-  if(open_context == JSON_ARRAY) {
-    status = write_str(js, "]");
-    if(status) return status;
+  bytes = tpl->rec.stream_buffer;
+  pos = 0;
+  for(ii = 0; ii < tpl->hole_count && !status; ++ii) {
+    status = js_write_template_bytes(js, bytes + pos, tpl->holes[ii].offset - pos);
+    status = status?status:js_write_hole(js, tpl->holes[ii].type, &values[ii]);
+    pos = tpl->holes[ii].offset;
   }
-  
-  /* The newly closed element is an element in its parent context. */
-  js->prior_element = JSON_ELEMENT;
-
-  return 0;
-};
+  status = status?status:js_write_template_bytes(js, bytes + pos, tpl->rec.stream_buffer_len - pos);
+  if(status) return js_end_call(js, status);
+  JS_STAT_DEPTH(js, js->stack_depth + tpl->depth);
 
+  /* As when closing an object or array: a complete record in record mode, 
+     otherwise an element of the enclosing context or the whole document. */
+  if(js->record_mode && js->stack_depth == 0) {
+    status = write_bytes(js, "\n", 1);
+    js->file_started = 0;
+    js->prior_element = JSON_NULL;
+    js->records_pending++;
+  } else {
+    js->file_started = 1;
+    js->prior_element = JSON_ELEMENT;
+  }
+  return js_end_call(js, status);
+}
 
 
-/* Close an array or object. */
-int json_end_context(json_stream_struct *js) {
-  strcpy(js->stream_buffer, "");
-  return json_end_context_internal(js);
-}
 
+/* Fragments. A fragment copies the parent's context stack, so that it writes 
+   the same commas and indentation the parent would have at that point, except
+   for the comma ahead of its first element, which the splice adds. */
+int json_init_fragment(json_stream_struct *fragment, const json_stream_struct *parent) {
+  size_t run_len;
+  int ii;
 
-  
-/* Write a singleton value. Must be in an array context.
-   String values will have enclosing quotes added. 
-   Number values should be serialized as a character array prior to passing. */
-int json_write_value(json_stream_struct *js, JSON_TYPE value_type, char *value) {
-  int status;
+  json_init_stream_buffer(fragment, parent->human_readable, parent->realloc_fn);
+  fragment->escape_strings = parent->escape_strings;
+  fragment->utf8_policy = parent->utf8_policy;
+  fragment->string_sanitize_fn = parent->string_sanitize_fn;
+  fragment->max_depth = parent->max_depth;
+  fragment->encoding = parent->encoding;
 
-  if(js->stack_depth <= 0) {
-    strcpy(js->error_string, "Attempted to print a single value when no context is open.");
+  if(parent->stack_depth <= 0 || JS_FRAME(parent, parent->stack_depth) != JSON_ARRAY) {
+    js_set_error(fragment, JSON_ERROR_FRAGMENT_CONTEXT);
     return -1;
   }
 
-  if(js->object_array_stack[js->stack_depth - 1] != JSON_ARRAY) {
-    strcpy(js->error_string, "Attempted to print a single value outside an array context.");
-    return -1;
+  if(parent->indent_run) {
+    run_len = 1 + parent->indent_run_levels * parent->indent_token_len;
+    fragment->indent_run = fragment->realloc_fn(NULL, run_len);
+    if(!fragment->indent_run) {
+      js_set_error(fragment, JSON_ERROR_NO_MEMORY_INDENT);
+      return -1;
+    }
+    memcpy(fragment->indent_run, parent->indent_run, run_len);
+    fragment->indent_run_levels = parent->indent_run_levels;
+    fragment->indent_token_len = parent->indent_token_len;
   }
 
-  strcpy(js->stream_buffer, "");
-
-  status = new_element(js); /* Print a comma if this follows a previous element. */
-  if(status) return status;
-  status = do_indent(js); 
-  if(status) return status;
-
-  switch(value_type) {
-  case JSON_STRING:
-    sanitize_string(js, value);
-    status = write_str(js, "\"");
-    status = status?status:write_str(js, value);
-    status = status?status:write_str(js, "\"");
-    return status;
-    // ggg fprintf(js->out, "\"%s\"", value);
-    break;
-  case JSON_NUMBER:
-    sanitize_string(js, value);
-    return write_str(js, value);
-    break;
-  case JSON_TRUE:
-    return write_str(js, "true");
-    break;
-  case JSON_FALSE:
-    return write_str(js, "false");
-    break;
-  case JSON_NULL:
-    return write_str(js, "null");
-    break;
-  default:
-    strcpy(js->error_string, "Attempted to print a single value of an invalid type.");
-    return -1;
+  /* The parent's levels are never closed by the fragment, but the innermost 
+     counts the MessagePack elements to splice. */
+  if(JS_BINARY(parent)) {
+    if(js_grow_pack_frames(fragment, parent->stack_depth)) return -1;
+    for(ii = 0; ii < parent->stack_depth; ++ii) {
+      fragment->pack_frames[ii].header = 0;
+      fragment->pack_frames[ii].count = 0;
+      fragment->pack_frames[ii].definite = 1;
+    }
   }
+
+  memcpy(fragment->frame_bits, parent->frame_bits, sizeof(parent->frame_bits));
+  fragment->stack_depth = parent->stack_depth;
+  fragment->fragment_depth = parent->stack_depth;
+  fragment->file_started = 1;
   return 0;
-};
+}
 
 
-  
-/* Write a name: value pair. Must be in an object context.
-   String values will have enclosing quotes added. 
-   Number values should be serialized as a character array prior to passing. */
-int json_write_pair(json_stream_struct *js, char *name, JSON_TYPE value_type, char *value) {
+
+int json_splice_fragment(json_stream_struct *js, json_stream_struct *fragment) {
   int status;
 
-  if(js->stack_depth <= 0) {
-    strcpy(js->error_string, "Attempted to print a pair when no context is open.");
+  JS_STAT_CALL(js, JSON_CALL_SPLICE_FRAGMENT);
+  if(js->stack_depth <= 0 || JS_FRAME(js, js->stack_depth) != JSON_ARRAY) {
+    js_set_error(js, JSON_ERROR_SPLICE_CONTEXT);
     return -1;
   }
-
-  if(js->object_array_stack[js->stack_depth - 1] != JSON_OBJECT) {
-    strcpy(js->error_string, "Attempted to print a name: value pair outside an object context.");
+  if(js->stack_depth != fragment->fragment_depth) {
+    js_set_error(js, JSON_ERROR_SPLICE_DEPTH);
     return -1;
   }
-
-  strcpy(js->stream_buffer, "");
-
-  status = new_element(js); /* Print a comma if this follows a previous element. */
-  if(status) return status;
-  status = do_indent(js); 
-  if(status) return status;
-
-  sanitize_string(js, name);
-  switch(value_type) {
-  case JSON_STRING:
-    sanitize_string(js, value);
-    status = write_str(js, "\"");
-    status = status?status:write_str(js, name);
-    status = status?status:write_str(js, "\": \"");
-    status = status?status:write_str(js, value);
-    status = status?status:write_str(js, "\"");
-    return status;
-    //ggg fprintf(js->out, "\"%s\": \"%s\"", name, value);
-    break;
-  case JSON_NUMBER:
-    sanitize_string(js, value);
-    status = write_str(js, "\"");
-    status = status?status:write_str(js, name);
-    status = status?status:write_str(js, "\": ");
-    status = status?status:write_str(js, value);
-    return status;
-    //ggg fprintf(js->out, "\"%s\": %s", name, value);
-    break;
-  case JSON_TRUE:
-    status = write_str(js, "\"");
-    status = status?status:write_str(js, name);
-    status = status?status:write_str(js, "\": true");
-    return status;
-    // ggg fprintf(js->out, "\"%s\": true", name);
-    break;
-  case JSON_FALSE:
-    status = write_str(js, "\"");
-    status = status?status:write_str(js, name);
-    status = status?status:write_str(js, "\": false");
-    return status;
-    //ggg fprintf(js->out, "\"%s\": false", name);
-    break;
-  case JSON_NULL:
-    status = write_str(js, "\"");
-    status = status?status:write_str(js, name);
-    status = status?status:write_str(js, "\": null");
-    return status;
-    //ggg fprintf(js->out, "\"%s\": null", name);
-    break;
-  default:
-    strcpy(js->error_string, "Attempted to print a name: value pair value of an invalid value type.");
+  if(fragment->stack_depth != fragment->fragment_depth) {
+    js_set_error(js, JSON_ERROR_SPLICE_OPEN);
+    return -1;
+  }
+  if(fragment->encoding != js->encoding) {
+    js_set_error(js, JSON_ERROR_ENCODING);
     return -1;
   }
+  if(fragment->prior_element != JSON_ELEMENT) return 0; /* Nothing was written. */
 
+  status = js_reset_buffer(js);
+  status = status?status:new_element(js);
+  status = status?status:write_bytes(js, fragment->stream_buffer, fragment->stream_buffer_len);
+  if(!status && js->encoding == JSON_ENCODING_MSGPACK) {
+    /* new_element counted one of the fragment's elements. */
+    js->pack_frames[js->stack_depth - 1].count += fragment->pack_frames[js->stack_depth - 1].count - 1;
+    fragment->pack_frames[js->stack_depth - 1].count = 0;
+  }
+  status = js_end_call(js, status);
+  if(status) return status;
+
+  /* The fragment's text has been copied or handed to the sink; start afresh. */
+  fragment->stream_buffer_len = 0;
+  fragment->stream_buffer[0] = '\0';
+  fragment->prior_element = JSON_NULL;
   return 0;
-};
+}
 
 
 
@@ -445,18 +4836,20 @@ int json_write_pair(json_stream_struct *js, char *name, JSON_TYPE value_type, ch
 int json_end_file(json_stream_struct *js) {
   int status;
 
-  if(js->stack_depth <= 0) {
-    return 0; /* File is empty or already closed. Ignore. */
+  JS_STAT_CALL(js, JSON_CALL_END_FILE);
+  if(js->stack_depth <= js->fragment_depth) {
+    return json_flush_internal(js); /* File is empty or already closed. Only flush. */
   }
 
-  strcpy(js->stream_buffer, "");
+  status = js_reset_buffer(js);
+  if(status) return status;
 
-  while(js->stack_depth > 0) {
+  while(js->stack_depth > js->fragment_depth) {
     status = json_end_context_internal(js);
     if(status) return status;
   }
 
-  return 0;
+  return json_flush_internal(js);
 };
 
 
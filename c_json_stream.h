@@ -10,30 +10,147 @@ Interface. This is intended to serve the same purpose; a tool exists solely
 to easily write JSON-formatted data. 
 
 This library enforces the structural constraints of JSON (objects, arrays, members, 
-pairs, elements), but does not enforce JSON string or number formatting rules. 
+pairs, elements), and escapes names and string values. Numbers written with the
+native number writers are always well formed; numbers passed as JSON_NUMBER strings
+are written as given. 
+
+The same calls can also produce CBOR or MessagePack instead of JSON text; see 
+json_set_encoding.
 
 */
 
 #ifndef SIMPLE_JSON_STREAM_H
 #define SIMPLE_JSON_STREAM_H
 
-/* Maximum supported depth of nested objects and arrays.
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Maximum supported depth of nested objects and arrays. Each level costs one bit
+   of stream state; streams may set a lower limit with json_set_max_depth.
    Pre-define as higher prior to including this header, if needed. */
 #ifndef MAX_JSON_NESTED_DEPTH
 #define MAX_JSON_NESTED_DEPTH 200
 #endif
 
-/* Maximum length of string buffer if not writing to a file. This needs to be
-   long enough to contain all characters generated by a single JSON streaming
-   function call. A static buffer is used. Pre-define as higher or lower prior 
-   to including this header, if needed. */
+/* Initial length of the string buffer if not writing to a file. The buffer is
+   grown on demand, so this only sets the size of the first allocation. 
+   Pre-define as higher or lower prior to including this header, if needed. */
 #ifndef JSON_STRING_BUFFER_LEN
 #define JSON_STRING_BUFFER_LEN 1000
 #endif
 
-/* Most recent error description is retained. */
+/* When writing to a file, output is gathered in the stream buffer and handed
+   to the file in blocks of at least this many characters. Can also be changed 
+   per stream with json_set_flush_threshold. */
+#ifndef JSON_FLUSH_THRESHOLD
+#define JSON_FLUSH_THRESHOLD 65536
+#endif
+
+/* Caller fragments at least this long are not copied into the stream buffer 
+   when writing to a sink; they are passed to the sink by reference as part of
+   a gathered (writev-style) batch. */
+#ifndef JSON_GATHER_MIN_LEN
+#define JSON_GATHER_MIN_LEN 256
+#endif
+
+/* Maximum number of fragments in one gathered batch handed to a sink. */
+#ifndef JSON_MAX_IOV
+#define JSON_MAX_IOV 16
+#endif
+
+/* The raw file descriptor sink needs write(2) and writev(2). */
+#if !defined(JSON_HAVE_POSIX) && !defined(JSON_NO_POSIX) && \
+    (defined(__unix__) || defined(__APPLE__))
+#define JSON_HAVE_POSIX
+#endif
+
+/* The asynchronous sink runs a POSIX thread. Define JSON_NO_THREADS to leave it
+   out, for example when not linking with -pthread. */
+#if !defined(JSON_HAVE_THREADS) && !defined(JSON_NO_THREADS) && defined(JSON_HAVE_POSIX)
+#define JSON_HAVE_THREADS
+#endif
+
+#ifdef JSON_HAVE_THREADS
+#include <pthread.h>
+#endif
+
+/* Compressing sinks are built when the build links the library: define 
+   JSON_HAVE_ZLIB (with -lz) for gzip and zlib output, and JSON_HAVE_ZSTD 
+   (with -lzstd) for zstd output. */
+#if defined(JSON_HAVE_ZLIB) || defined(JSON_HAVE_ZSTD)
+#define JSON_HAVE_COMPRESSION
+#endif
+
+/* String escaping scans 16 or 32 bytes at a time with SSE2/AVX2 on x86-64 GCC
+   and Clang builds. Define JSON_NO_SIMD to force the portable scalar scan. */
+#if !defined(JSON_HAVE_X86_SIMD) && !defined(JSON_NO_SIMD) && \
+    defined(__GNUC__) && defined(__x86_64__)
+#define JSON_HAVE_X86_SIMD
+#endif
+
+/* Instrumentation counters are built in unless JSON_NO_STATS is defined. A 
+   stream only counts once it has been given a json_stats with json_set_stats. */
+#if !defined(JSON_HAVE_STATS) && !defined(JSON_NO_STATS)
+#define JSON_HAVE_STATS
+#endif
+
+/* Define JSON_COMPACT_ONLY to build a generator specialized for compact output:
+   human_readable is ignored and all newline and indentation handling is 
+   compiled out, leaving separators and copies on the write path. */
+
+/* Longest error description. error_string points at a constant message, so 
+   this is only a bound for callers copying it. */
 #define MAX_ERROR_STRING_LENGTH 200
 
+/* Error codes, kept in error_code alongside the matching error_string. */
+typedef enum {
+  JSON_OK,
+  JSON_ERROR_OBJECT_AFTER_END,          /* Opening an object after the document is complete. */
+  JSON_ERROR_OBJECT_CONTEXT,            /* Opening an object outside an array.               */
+  JSON_ERROR_ARRAY_AFTER_END,           /* Opening an array after the document is complete.  */
+  JSON_ERROR_ARRAY_CONTEXT,             /* Opening an array outside an array.                */
+  JSON_ERROR_NAMED_OBJECT_NO_CONTEXT,   /* Named object before any context is open.          */
+  JSON_ERROR_NAMED_OBJECT_CONTEXT,      /* Named object outside an object.                   */
+  JSON_ERROR_NAMED_ARRAY_NO_CONTEXT,    /* Named array before any context is open.           */
+  JSON_ERROR_NAMED_ARRAY_CONTEXT,       /* Named array outside an object.                    */
+  JSON_ERROR_CLOSE_NO_CONTEXT,          /* Closing a context when none is open.              */
+  JSON_ERROR_CLOSE_FRAGMENT_PARENT,     /* Closing a context a fragment's parent opened.     */
+  JSON_ERROR_VALUE_NO_CONTEXT,          /* Single value before any context is open.          */
+  JSON_ERROR_VALUE_CONTEXT,             /* Single value outside an array.                    */
+  JSON_ERROR_PAIR_NO_CONTEXT,           /* Pair before any context is open.                  */
+  JSON_ERROR_PAIR_CONTEXT,              /* Pair outside an object.                           */
+  JSON_ERROR_TOO_DEEP,                  /* Nesting beyond the stream's depth limit.          */
+  JSON_ERROR_FRAGMENT_CONTEXT,          /* Starting a fragment outside an array.             */
+  JSON_ERROR_SPLICE_CONTEXT,            /* Splicing a fragment outside an array.             */
+  JSON_ERROR_SPLICE_DEPTH,              /* Splicing a fragment at another depth.             */
+  JSON_ERROR_SPLICE_OPEN,               /* Splicing a fragment with contexts left open.      */
+  JSON_ERROR_VALUE_TYPE,                /* Single value of an invalid JSON_TYPE.             */
+  JSON_ERROR_PAIR_TYPE,                 /* Pair value of an invalid JSON_TYPE.               */
+  JSON_ERROR_NOT_FINITE,                /* NaN or infinity.                                  */
+  JSON_ERROR_NUMBER_TEXT,               /* JSON_NUMBER text that a binary encoding cannot parse. */
+  JSON_ERROR_RAW_INVALID,               /* Raw JSON that is not a single valid value.        */
+  JSON_ERROR_INVALID_UTF8,              /* Ill-formed UTF-8 under JSON_UTF8_REJECT.          */
+  JSON_ERROR_HOLE_TYPE,                 /* Template hole of an invalid type.                 */
+  JSON_ERROR_TEMPLATE_INCOMPLETE,       /* Template that is not one complete object or array. */
+  JSON_ERROR_ENCODING,                  /* Call or encoding not available for the stream.    */
+  JSON_ERROR_ENCODING_STARTED,          /* Changing the encoding after writing has started.  */
+  JSON_ERROR_FIELD,                     /* Struct field of an invalid type or size.          */
+  JSON_ERROR_DEPTH_LIMIT,               /* Depth limit outside 1 to MAX_JSON_NESTED_DEPTH.   */
+  JSON_ERROR_UNSUPPORTED,               /* Feature not built into the library.               */
+  JSON_ERROR_NO_MEMORY,                 /* The stream buffer could not be grown.             */
+  JSON_ERROR_NO_MEMORY_INDENT,          /* The indentation run could not be allocated.       */
+  JSON_ERROR_NO_MEMORY_KEY,             /* A key could not be allocated.                     */
+  JSON_ERROR_NO_MEMORY_DESC,            /* A struct descriptor could not be allocated.       */
+  JSON_ERROR_NO_MEMORY_TEMPLATE,        /* Template holes could not be allocated.            */
+  JSON_ERROR_SINK,                      /* The sink reported a failure.                      */
+  JSON_ERROR_CODES
+} json_error;
+
 /* Enough to cover the JSON syntax minus literal formatting, even though this 
 library does not parse. */
 typedef enum {
@@ -50,11 +167,251 @@ typedef enum {
   JSON_NULL
 } JSON_TYPE;
 
+/* Allocator used to grow the string buffer. Same contract as realloc(): a NULL
+   ptr allocates, a size of 0 releases ptr. */
+typedef void *(*json_realloc_fn)(void *ptr, size_t size);
+
+/* One fragment of a gathered write. */
+typedef struct {
+  const char *data;
+  size_t len;
+} json_iovec;
+
+/* json_sink: Destination for generated JSON. Callbacks return 0 on success and
+   nonzero on failure. writev and flush may be NULL; without writev, a gathered 
+   batch is passed to write one fragment at a time. */
+typedef struct {
+  int (*write)(void *user, const char *data, size_t len);
+  int (*writev)(void *user, const json_iovec *iov, int iovcnt);
+  int (*flush)(void *user);
+  void *user;
+} json_sink;
+
+#ifdef JSON_HAVE_POSIX
+/* Memory-mapped file output policies for json_mmap_open, combined with |. */
+#define JSON_MMAP_SEQUENTIAL 1 /* madvise(MADV_SEQUENTIAL) on the mapping.                   */
+#define JSON_MMAP_DONTNEED   2 /* madvise(MADV_DONTNEED) written chunks, bounding residency.   */
+#define JSON_MMAP_ASYNC      4 /* msync(MS_ASYNC) written chunks, starting writeback early.    */
+#define JSON_MMAP_SYNC       8 /* msync(MS_SYNC) on flush, so json_end_file waits for the disk. */
+
+/* The file is grown, and the mapping extended, this many bytes at a time. 
+   Rounded up to a whole number of pages. */
+#ifndef JSON_MMAP_CHUNK
+#define JSON_MMAP_CHUNK (64 * 1024 * 1024)
+#endif
+
+/* json_mmap_file: Output file written through a shared mapping instead of 
+   write(2). Pass json_mmap_sink(mf) to json_init_stream_sink. */
+typedef struct {
+  int fd;
+  int policy;
+  char *map;
+  size_t map_len;  /* Bytes mapped, a multiple of chunk. */
+  size_t file_len; /* Size of the file: map_len while writing, len once flushed. */
+  size_t len;      /* Characters written. */
+  size_t chunk;
+  size_t retired;  /* Written pages before this offset have had the chunk policies applied. */
+} json_mmap_file;
+#endif
+
+#ifdef JSON_HAVE_THREADS
+/* Size and number of the buffers an asynchronous sink cycles through. */
+#ifndef JSON_ASYNC_BUFFER_LEN
+#define JSON_ASYNC_BUFFER_LEN (1024 * 1024)
+#endif
+
+#ifndef JSON_ASYNC_BUFFER_COUNT
+#define JSON_ASYNC_BUFFER_COUNT 4
+#endif
+
+/* json_async_file: Output file written by a background thread. The generator
+   fills one buffer of a ring while the thread writes the others out, and only
+   waits when every buffer is full. Pass json_async_sink(af) to 
+   json_init_stream_sink. */
+typedef struct {
+  int fd;
+  int durable;        /* If nonzero, flushing waits for fdatasync. */
+  char **buffers;
+  size_t *buffer_lens;
+  size_t buffer_size;
+  int buffer_count;
+  int next_write;     /* Oldest buffer queued for the thread. */
+  int queued;         /* Buffers queued; the generator fills the one after them. */
+  int stop;
+  int error;          /* errno of the first failed write. Later output is dropped. */
+  pthread_mutex_t lock;
+  pthread_cond_t work_ready;
+  pthread_cond_t work_done;
+  pthread_t thread;
+} json_async_file;
+#endif
+
+#ifdef JSON_HAVE_COMPRESSION
+/* Size of a compressing sink's output buffer; compressed output reaches the 
+   next sink in blocks of up to this many bytes. */
+#ifndef JSON_COMPRESS_BUFFER_LEN
+#define JSON_COMPRESS_BUFFER_LEN 65536
+#endif
+
+typedef enum {
+  JSON_COMPRESS_GZIP, /* zlib: gzip wrapper, as written by the gzip tool. */
+  JSON_COMPRESS_ZLIB, /* zlib: zlib wrapper, as used by HTTP "deflate".    */
+  JSON_COMPRESS_ZSTD  /* zstd frame.                                      */
+} json_compress_format;
+
+/* json_compressor: Compresses output on its way to another sink. Pass 
+   json_compress_sink(jc) to json_init_stream_sink. */
+typedef struct {
+  json_compress_format format;
+  json_sink next;
+  void *state;          /* z_stream or ZSTD_CCtx. */
+  char *out;
+  size_t flush_every;   /* Flush point every this many input characters; 0 for none. */
+  size_t since_flush;
+  uint64_t bytes_in;    /* Totals, for reporting the ratio. */
+  uint64_t bytes_out;
+} json_compressor;
+#endif
+
+/* Output encodings, selected with json_set_encoding. */
+typedef enum {
+  JSON_ENCODING_JSON,   /* RFC 8259 text (the default).                                */
+  JSON_ENCODING_CBOR,   /* RFC 8949, with objects and arrays of indefinite length.     */
+  JSON_ENCODING_MSGPACK /* MessagePack. Sizes of objects and arrays are set on close. */
+} json_encoding;
+
+/* json_key: A member name pre-encoded for repeated use: quoted, escaped, and 
+   followed by the name separator, so that writing it is a single copy. Create
+   with json_key_make, or with JSON_KEY for string literals that need no escaping:
+     static const json_key timestamp_key = JSON_KEY("timestamp"); 
+   A key may be used with a stream of another encoding, at the cost of 
+   re-encoding the name on every use; the name of a JSON key is taken to be
+   the text between its quotes, so it should need no escaping. */
+typedef struct {
+  const char *bytes;
+  size_t len;
+  json_encoding encoding;
+} json_key;
+
+#define JSON_KEY(literal) { "\"" literal "\": ", sizeof("\"" literal "\": ") - 1, JSON_ENCODING_JSON }
+
+/* Field types for struct descriptors. Integer, boolean and floating point fields
+   are read at the size recorded in the descriptor: 1, 2, 4 or 8 bytes for 
+   integers and booleans, float or double for JSON_FIELD_DOUBLE. */
+typedef enum {
+  JSON_FIELD_INT,    /* Signed integer, written as a number.                  */
+  JSON_FIELD_UINT,   /* Unsigned integer, written as a number.                */
+  JSON_FIELD_DOUBLE, /* float or double, written as a number.                 */
+  JSON_FIELD_BOOL,   /* Integer or _Bool, written as true if nonzero.         */
+  JSON_FIELD_STRING, /* const char * to a NUL-terminated string; NULL is null. */
+  JSON_FIELD_CHARS   /* char array of size bytes, NUL-terminated if shorter.  */
+} json_field_type;
+
+/* json_field: Describes one member of a C struct. JSON_FIELD fills in the offset
+   and size from the struct definition and uses the member name as the name:
+     static const json_field point_fields[] = {
+       JSON_FIELD(struct point, x, JSON_FIELD_DOUBLE),
+       JSON_FIELD(struct point, label, JSON_FIELD_STRING)
+     }; */
+typedef struct {
+  const char *name;
+  size_t offset;
+  json_field_type type;
+  size_t size;
+} json_field;
+
+#define JSON_FIELD(struct_type, member, field_type) \
+  { #member, offsetof(struct_type, member), field_type, sizeof(((struct_type *)0)->member) }
+
+/* One compiled field: a json_field with its name pre-encoded. */
+typedef struct {
+  json_field_type type;
+  size_t offset;
+  size_t size;
+  const char *key;  /* A comma followed by the pre-encoded key, as in json_key.
+                       There is no comma in the binary encodings. */
+  size_t key_len;   /* Including the comma. */
+} json_struct_field;
+
+/* json_struct_desc: A struct descriptor compiled for json_write_struct_array.
+   Create with json_struct_desc_make and release with json_struct_desc_free. */
+typedef struct {
+  json_struct_field *fields;
+  size_t field_count;
+  int has_doubles; /* Records need a finiteness check before writing. */
+  json_encoding encoding; /* Of the keys. */
+} json_struct_desc;
+
+/* API calls counted by json_stats. The _named, _n and _k forms of a call are 
+   counted with it. */
+typedef enum {
+  JSON_CALL_START_OBJECT,
+  JSON_CALL_START_ARRAY,
+  JSON_CALL_END_CONTEXT,
+  JSON_CALL_WRITE_VALUE,
+  JSON_CALL_WRITE_PAIR,
+  JSON_CALL_WRITE_NUMBER,       /* json_write_int64, _uint64 and _double.   */
+  JSON_CALL_WRITE_PAIR_NUMBER,  /* json_write_pair_int64, _uint64 and _double. */
+  JSON_CALL_WRITE_ARRAY,        /* The bulk array writers.                  */
+  JSON_CALL_WRITE_STRUCT_ARRAY,
+  JSON_CALL_WRITE_RAW,          /* json_write_raw_value and json_write_raw_pair. */
+  JSON_CALL_WRITE_TEMPLATE,
+  JSON_CALL_SPLICE_FRAGMENT,
+  JSON_CALL_FLUSH,
+  JSON_CALL_END_FILE,
+  JSON_CALL_KINDS
+} json_call_kind;
+
+/* Kinds of error counted by json_stats. */
+typedef enum {
+  JSON_ERROR_KIND_STRUCTURE, /* The call is not allowed in the current context.          */
+  JSON_ERROR_KIND_VALUE,     /* Invalid value type, non-finite number or field description. */
+  JSON_ERROR_KIND_MEMORY,    /* The allocator failed.                                     */
+  JSON_ERROR_KIND_OUTPUT,    /* The sink reported a failure.                              */
+  JSON_ERROR_KINDS
+} json_error_kind;
+
+/* json_stats: Counters kept for a stream given one with json_set_stats. */
+typedef struct {
+  uint64_t bytes;                    /* Characters handed to the sink, or added to the stream buffer. */
+  uint64_t calls[JSON_CALL_KINDS];   /* API calls, including those that failed. */
+  uint64_t errors[JSON_ERROR_KINDS]; /* Errors, counted where they arise.       */
+  uint64_t sink_writes;              /* Calls to the sink's write or writev.    */
+  uint64_t sink_flushes;             /* Calls to the sink's flush.              */
+  uint64_t sink_ns;                  /* Time inside the sink, with JSON_STATS_TIME_SINK. */
+  int max_depth;                     /* Deepest nesting of objects and arrays reached. */
+} json_stats;
+
+/* How names and string values are checked for well-formed UTF-8 (RFC 3629). */
+typedef enum {
+  JSON_UTF8_UNCHECKED, /* Bytes are passed through (the default).                    */
+  JSON_UTF8_REJECT,    /* Calls with ill-formed strings fail before writing anything. */
+  JSON_UTF8_REPLACE,   /* Each ill-formed sequence becomes U+FFFD.                    */
+  JSON_UTF8_ESCAPE     /* Each byte of an ill-formed sequence becomes \u0080-\u00ff. */
+} json_utf8_policy;
+
+/* json_set_stats flag: time every sink call (POSIX builds only). Costs two 
+   clock reads per call into the sink. */
+#define JSON_STATS_TIME_SINK 1
+
+/* One open object or array of a binary encoding. */
+typedef struct {
+  size_t header;  /* MessagePack: offset of the header in the stream buffer. */
+  size_t count;   /* MessagePack: members or elements written so far.       */
+  int definite;   /* The size was written with the header.                  */
+} json_pack_frame;
+
 /* json_stream_struct: Tracks the state of an in-progress JSON format stream. */
 typedef struct {
-  /* Boolean value to flag whether to print human friendly indentation and newlines. */
+  /* Boolean value to flag whether to print human friendly indentation and newlines.
+     Ignored when built with JSON_COMPACT_ONLY. */
   int human_readable; 
-  char indent_token[10]; /* Two spaces by default. */
+
+  /* A newline followed by repeated indent tokens (two spaces by default), 
+     built on first use and grown as nesting deepens. Set with json_set_indent. */
+  char *indent_run;
+  size_t indent_run_levels; /* Levels of indentation the run covers. */
+  size_t indent_token_len;
 
   /* Valid JSON may have only one top-level element. */
   int file_started;
@@ -63,34 +420,314 @@ typedef struct {
      If an open brace or bracket, do not print a comma, otherwise print one. */
   JSON_TYPE prior_element;
   
-  /* Tracks nested objects and arrays for appropriate close brace/brackets. */
-  JSON_TYPE object_array_stack[MAX_JSON_NESTED_DEPTH];
+  /* Tracks nested objects and arrays for appropriate close brace/brackets: bit
+     n of frame_bits is set when level n + 1 is an array, clear for an object. */
+  uint32_t frame_bits[(MAX_JSON_NESTED_DEPTH + 31) / 32];
   int stack_depth;
+  int max_depth; /* Deepest nesting allowed, MAX_JSON_NESTED_DEPTH by default. */
+
+  /* Depth of the array a fragment was started in, below which it may not close
+     contexts. 0 for a whole document. */
+  int fragment_depth;
+
+  /* Record (JSON Lines) mode: each closed top-level object or array is followed
+     by a newline, and the next record may start at once. When records_per_flush
+     is nonzero, the stream is flushed after that many records. */
+  int record_mode;
+  size_t records_per_flush;
+  size_t records_pending; /* Records completed since the last flush. */
  
-  /* If out is NULL (== 0), data will be written to the stream_buffer variable
-     instead of to a file. */
+  /* If sink.write is NULL, data will be written to the stream_buffer variable
+     instead of to a sink. */
 
-  /* Target handle to which data should be written for file output functions. */
+  /* Target handle to which data should be written for file output functions. 
+     Only set when the stream was initialized with a file. */
   FILE *out;
 
-  /* String buffer to contain the generated JSON if not writing to a file. 
-     Discarded and overwritten at the start of each call. */
-  char stream_buffer[JSON_STRING_BUFFER_LEN];
+  /* Destination for the generated JSON. A FILE is wrapped in the built-in file sink. */
+  json_sink sink;
+
+  /* When writing to a sink, the stream buffer is written out by the first call
+     that leaves it holding flush_threshold characters, by json_flush, and by 
+     json_end_file. */
+  size_t flush_threshold;
+
+  /* Batch of fragments waiting to be handed to the sink. Entries with a NULL data
+     pointer refer to the next run of characters in the stream buffer. Holds 
+     JSON_MAX_IOV entries, allocated when a sink stream first gathers one. */
+  json_iovec *pending_iov;
+  int pending_iovcnt;
+  size_t pending_gathered; /* Buffered characters already covered by pending_iov. */
+
+  /* String buffer to contain the generated JSON if not writing to a sink. 
+     Always NUL-terminated, and grown on demand with realloc_fn. Discarded and 
+     overwritten at the start of each call unless retain_buffer is set. 
+     When writing to a sink, holds output not yet passed to the sink. */
+  char *stream_buffer;
+  size_t stream_buffer_len; /* Write cursor. Characters held, excluding the NUL. */
+  size_t stream_buffer_cap; /* Allocated size, including the NUL. */
+  size_t pull_offset;       /* Characters already taken by json_pull or json_pull_consume. */
 
-  /* Most recent error description. */
-  char error_string[MAX_ERROR_STRING_LENGTH];
+  /* If nonzero, the stream buffer accumulates the whole document across calls. */
+  int retain_buffer;
+  json_realloc_fn realloc_fn;
 
-  /* Permit registration of a global function to sanitize text strings. */
+  /* Most recent error, as a code and a constant description ("" for none). */
+  json_error error_code;
+  const char *error_string;
+
+  /* Output encoding, JSON_ENCODING_JSON unless set with json_set_encoding. The
+     binary encodings keep a frame per open level, allocated on first use. */
+  json_pack_frame *pack_frames;
+  int pack_frames_cap;
+  json_encoding encoding;
+
+  /* If nonzero (the default), quotation marks, backslashes and control characters
+     in names and string values are escaped. Clear it if strings arrive pre-escaped. */
+  int escape_strings;
+
+  /* UTF-8 checking of names and string values, JSON_UTF8_UNCHECKED by default. */
+  json_utf8_policy utf8_policy;
+
+  /* Permit registration of a global function to sanitize text strings. 
+     Runs before escaping. */
   void (*string_sanitize_fn)(char *str);
+
+#ifdef JSON_HAVE_STATS
+  /* Counters to update, or NULL (the default) to count nothing. */
+  json_stats *stats;
+  int stats_flags;
+  size_t stats_mark; /* Buffer-mode characters already added to stats->bytes. */
+#endif
 } json_stream_struct;
 
+/* json_stream_pool: Hands out streams from slabs allocated together, and keeps
+   the stream buffers of released streams for reuse, so that servers holding 
+   many short-lived generators neither allocate per stream nor regrow buffers 
+   for every response. Not thread-safe; use one pool per thread. */
+typedef struct {
+  json_realloc_fn realloc_fn;
+  size_t slab_streams;           /* Streams per slab allocation.                   */
+  size_t keep_buffer_cap;        /* Largest stream buffer kept on release.         */
+  void *slabs;                   /* Allocated slabs, linked through their headers. */
+  json_stream_struct **free_list;
+  size_t free_count;
+  size_t free_cap;
+} json_stream_pool;
+
+/* json_hole_value: The value filling one template hole. Set the member for the
+   hole's type: i, u, d or b, or str and len for JSON_FIELD_STRING (a NULL str
+   writes null). */
+typedef struct {
+  union {
+    int64_t i;
+    uint64_t u;
+    double d;
+    int b;
+    const char *str;
+  } as;
+  size_t len;
+} json_hole_value;
+
+/* One hole of a template: where it falls in the recorded output, and its type. */
+typedef struct {
+  size_t offset;
+  json_field_type type;
+} json_hole;
+
+/* json_template: A document shape recorded once and written many times with 
+   different leaf values. Between json_template_begin and json_template_end, 
+   write one object or array to rec with the usual calls, using the hole calls
+   for the values that change. Its output, with the holes cut out, stays in 
+   rec's buffer. */
+typedef struct {
+  json_stream_struct rec;
+  json_hole *holes;
+  size_t hole_count;
+  size_t hole_cap;
+  JSON_TYPE root;   /* JSON_OBJECT or JSON_ARRAY.                           */
+  int depth;        /* Levels of nesting the template adds where written.   */
+  int has_doubles;  /* Values need a finiteness check before writing.       */
+  int complete;     /* Set by a successful json_template_end.               */
+} json_template;
+
 /* Function to initialize a stream tracking object. */
 void json_init_stream(json_stream_struct *js, int human_readable, FILE *out_file);
 
+/* Initialize a stream that accumulates the whole document in stream_buffer.
+   realloc_fn may be NULL, in which case the C library realloc() is used. */
+void json_init_stream_buffer(json_stream_struct *js, int human_readable, json_realloc_fn realloc_fn);
+
+/* Initialize a stream that writes to a caller-supplied sink. The sink is copied. */
+void json_init_stream_sink(json_stream_struct *js, int human_readable, const json_sink *sink);
+
+/* Built-in sinks. json_init_stream(js, human_readable, file) uses json_file_sink. */
+json_sink json_file_sink(FILE *out_file);
+#ifdef JSON_HAVE_POSIX
+json_sink json_fd_sink(int fd);
+
+/* Prepare to write fd, which must be open for reading and writing, through a
+   mapping. Output overwrites the file from the start. chunk may be 0 for 
+   JSON_MMAP_CHUNK. The sink trims the file to the characters written on every
+   flush, including the one in json_end_file. mf must outlive the stream. */
+int json_mmap_open(json_mmap_file *mf, int fd, size_t chunk, int policy);
+json_sink json_mmap_sink(json_mmap_file *mf);
+
+/* Trim the file and release the mapping. fd is left open. */
+int json_mmap_close(json_mmap_file *mf);
+#endif
+
+#ifdef JSON_HAVE_THREADS
+/* Start a thread writing to fd. buffer_size and buffer_count may be 0 for the
+   defaults; at least two buffers are used. If durable is nonzero, each flush, 
+   including the one in json_end_file, returns once the data reaches the disk. */
+int json_async_open(json_async_file *af, int fd, size_t buffer_size, int buffer_count, int durable);
+json_sink json_async_sink(json_async_file *af);
+
+/* Write out what remains, stop the thread and free the buffers. fd is left open. */
+int json_async_close(json_async_file *af);
+#endif
+
+#ifdef JSON_HAVE_COMPRESSION
+/* Compress into next (which is copied) at the given level, or the format's 
+   default level if level is 0. If flush_every is nonzero, a flush point is 
+   added after that many characters, so that a reader can decode everything 
+   before it; json_flush adds one too. Fails if the format was not built in. */
+int json_compress_open(json_compressor *jc, const json_sink *next, json_compress_format format, 
+                       int level, size_t flush_every);
+json_sink json_compress_sink(json_compressor *jc);
+
+/* Finish the compressed stream, flush next, and free the compressor. Call after
+   json_end_file; the output is incomplete until then. */
+int json_compress_close(json_compressor *jc);
+#endif
+
+/* Limit nesting to depth levels, between 1 and MAX_JSON_NESTED_DEPTH. Opening a
+   context past the limit fails with JSON_ERROR_TOO_DEEP before writing anything. */
+int json_set_max_depth(json_stream_struct *js, int depth);
+
+/* The description of an error code, as stored in error_string. */
+const char *json_error_message(json_error code);
+
+/* Prepare a pool. slab_streams and keep_buffer_cap may be 0 for defaults of 64
+   streams and 64 KB; realloc_fn may be NULL for realloc(), and is also used 
+   for the buffers of the pool's streams. */
+void json_pool_init(json_stream_pool *pool, size_t slab_streams, size_t keep_buffer_cap, 
+                    json_realloc_fn realloc_fn);
+
+/* Take a stream from the pool, initialized as by json_init_stream_sink, or by 
+   json_init_stream_buffer when sink is NULL. Returns NULL if out of memory. */
+json_stream_struct *json_pool_acquire(json_stream_pool *pool, int human_readable, const json_sink *sink);
+
+/* Free the stream's resources as json_free_stream does, except for a stream 
+   buffer of up to keep_buffer_cap, and return the stream to the pool. */
+void json_pool_release(json_stream_pool *pool, json_stream_struct *js);
+
+/* Free every slab and kept buffer. Streams still acquired become invalid. */
+void json_pool_free(json_stream_pool *pool);
+
+/* Set the token written once per nesting level in human_readable mode. The token
+   is copied and may be any length. Returns nonzero if it could not be stored. */
+int json_set_indent(json_stream_struct *js, const char *token);
+
+/* Pre-encode a member name for the _k writers. The key is allocated with the 
+   stream's allocator, encoded in its encoding and escaped according to its 
+   escape_strings setting. It may be used with any stream sharing those settings. */
+int json_key_make(json_stream_struct *js, json_key *key, const char *name);
+
+/* Release a key created by json_key_make. Not for keys made with JSON_KEY. */
+void json_key_free(json_stream_struct *js, json_key *key);
+
+/* Release the stream buffer, if one was allocated. Pending sink output is 
+   flushed first. The stream may be re-initialized afterwards. */
+void json_free_stream(json_stream_struct *js);
+
+/* Set the number of buffered characters at which sink output is written out. 
+   0 hands each call's output to the sink as soon as the call completes, as a
+   single gathered batch. */
+void json_set_flush_threshold(json_stream_struct *js, size_t threshold);
+
+/* Check names and string values for well-formed UTF-8. Repair is fused into
+   escaping: ASCII costs nothing extra, and the rest of a string from its first
+   non-ASCII character is validated with a vectorized scan. JSON_UTF8_REJECT
+   checks every string a call would write before writing any of it, like the
+   finiteness check on doubles. Keys made with json_key_make and struct 
+   descriptors follow the policy of the stream that made them. Raw JSON is 
+   only checked by its own validator. */
+void json_set_utf8_policy(json_stream_struct *js, json_utf8_policy policy);
+
+/* Select the output encoding, before anything is written. The calls, their 
+   structural checks and their errors are the same in every encoding, with 
+   these differences in CBOR (RFC 8949) and MessagePack:
+   - Output is compact: human_readable and the indent token are ignored.
+   - Strings are not escaped. Under JSON_UTF8_ESCAPE, ill-formed UTF-8 is 
+     replaced as under JSON_UTF8_REPLACE.
+   - Integers take their smallest form, and doubles the narrowest float that
+     holds them exactly. JSON_NUMBER text must be a JSON number, and is parsed.
+   - CBOR objects and arrays have indefinite length, so output streams as in
+     JSON. The bulk and struct array writers use definite lengths.
+   - MessagePack has no indefinite lengths, so an object or array is given its
+     size when it closes. The stream buffer holds each top-level object or 
+     array until it closes: nothing is written to the sink or pulled before 
+     that, and json_flush waits for it.
+   - Records follow one another with no separator (RFC 8742 CBOR sequences).
+   - Raw JSON and templates fail with JSON_ERROR_ENCODING.
+   A key made with json_key_make, or a struct descriptor, is encoded for the 
+   stream that made it. Keys of another encoding, such as JSON_KEY literals,
+   are re-encoded as they are written; descriptors fail with 
+   JSON_ERROR_ENCODING. */
+int json_set_encoding(json_stream_struct *js, json_encoding encoding);
+
+/* Write a stream of independent records, one per line (JSON Lines, NDJSON), 
+   instead of a single document. If records_per_flush is nonzero, json_flush is
+   run after every records_per_flush records; otherwise the flush threshold 
+   alone decides when output reaches the sink. json_end_file closes any record
+   in progress and flushes, and the stream remains usable. Records should be 
+   written compactly; human_readable records span several lines. */
+void json_set_record_mode(json_stream_struct *js, int enabled, size_t records_per_flush);
+
+/* Take output from a buffer-mode stream a piece at a time, like zlib's 
+   next_out/avail_out: json_pull copies up to avail pending characters into out
+   and returns the number copied, stopping wherever out is full, even inside a
+   string or escape, and the next pull resumes at that character. For writing 
+   to a non-blocking socket without a copy, json_pull_data points at what is
+   pending and json_pull_consume discards len characters of it once sent. 
+   Pulled characters no longer count towards the buffer's size, so draining
+   after each call keeps memory bounded however long the document is. */
+size_t json_pull(json_stream_struct *js, char *out, size_t avail);
+size_t json_pull_pending(const json_stream_struct *js);
+const char *json_pull_data(const json_stream_struct *js, size_t *len);
+void json_pull_consume(json_stream_struct *js, size_t len);
+
+/* Count this stream's activity into stats, which may be shared by several 
+   streams used from one thread; pass NULL to stop counting. Counts are added 
+   to what stats already holds. flags is 0 or JSON_STATS_TIME_SINK. Returns 
+   nonzero if the library was built with JSON_NO_STATS. */
+int json_set_stats(json_stream_struct *js, json_stats *stats, int flags);
+
+/* Copy the stream's counters into snapshot, first bringing the byte count of a
+   buffer-mode stream up to date. If reset is nonzero, the counters are then 
+   zeroed. snapshot is zeroed if the stream has no counters. */
+void json_stats_snapshot(json_stream_struct *js, json_stats *snapshot, int reset);
+
+/* Names for exporting counters, such as "write_pair" and "structure". */
+const char *json_call_name(json_call_kind call);
+const char *json_error_kind_name(json_error_kind kind);
+
+/* Write any buffered output to the sink and flush the sink. 
+   Has no effect when not writing to a sink. */
+int json_flush(json_stream_struct *js);
+
 
 
 /* Valid JSON must begin with an object or an array.  */
 
+/* Functions taking a name or value have _n forms that take const pointers and 
+   explicit lengths instead. They never call strlen, so names and values may be
+   slices of larger buffers with no NUL terminator. string_sanitize_fn is not 
+   applied, since it needs a mutable, NUL-terminated string. 
+   Functions taking a name also have _k forms that take a pre-encoded json_key. */
+
 /* Start a brace-enclosed object. 
    An object may only begin in an array context or when no context has yet been started. (The beginning of a file) */
 int json_start_object(json_stream_struct *js);
@@ -98,6 +735,8 @@ int json_start_object(json_stream_struct *js);
 /* Start an named object. (A name: value pair where the value is a new object.)
    Must be in an object or array context. */
 int json_start_object_named(json_stream_struct *js, char *name);
+int json_start_object_named_n(json_stream_struct *js, const char *name, size_t name_len);
+int json_start_object_named_k(json_stream_struct *js, const json_key *key);
 
 /* Start a bracket-enclosed array.
    An array may only begin in an array context or when no context has yet been started. (The beginning of a file) */
@@ -106,21 +745,162 @@ int json_start_array(json_stream_struct *js);
 /* Start an named array. (A name: value pair where the value is an array.)
    Must be in an object context. */
 int json_start_array_named(json_stream_struct *js, char *name);
+int json_start_array_named_n(json_stream_struct *js, const char *name, size_t name_len);
+int json_start_array_named_k(json_stream_struct *js, const json_key *key);
   
 /* Close an array or object. */
 int json_end_context(json_stream_struct *js);
   
 /* Write a singleton value. Must be in an array context.
    String values will have enclosing quotes added. 
-   Number values should be serialized as a character array prior to passing. */
+   Number values should be serialized as a character array prior to passing,
+   or written with json_write_int64 and friends instead. */
 int json_write_value(json_stream_struct *js, JSON_TYPE value_type, char *value);
+int json_write_value_n(json_stream_struct *js, JSON_TYPE value_type, const char *value, size_t value_len);
   
 /* Write a name: value pair. Must be in an object context.
    String values will have enclosing quotes added. 
-   Number values should be serialized as a character array prior to passing. */
+   Number values should be serialized as a character array prior to passing,
+   or written with json_write_pair_int64 and friends instead. */
 int json_write_pair(json_stream_struct *js, char *name, JSON_TYPE value_type, char *value);
+int json_write_pair_n(json_stream_struct *js, const char *name, size_t name_len, 
+                      JSON_TYPE value_type, const char *value, size_t value_len);
+int json_write_pair_k(json_stream_struct *js, const json_key *key, 
+                      JSON_TYPE value_type, const char *value, size_t value_len);
+
+/* Write a number as a singleton value. Must be in an array context.
+   Doubles are written in the shortest form that reads back as the same value;
+   NaN and infinities are rejected, since JSON cannot represent them. */
+int json_write_int64(json_stream_struct *js, int64_t value);
+int json_write_uint64(json_stream_struct *js, uint64_t value);
+int json_write_double(json_stream_struct *js, double value);
+
+/* Write a name: number pair. Must be in an object context. */
+int json_write_pair_int64(json_stream_struct *js, char *name, int64_t value);
+int json_write_pair_uint64(json_stream_struct *js, char *name, uint64_t value);
+int json_write_pair_double(json_stream_struct *js, char *name, double value);
+int json_write_pair_int64_n(json_stream_struct *js, const char *name, size_t name_len, int64_t value);
+int json_write_pair_uint64_n(json_stream_struct *js, const char *name, size_t name_len, uint64_t value);
+int json_write_pair_double_n(json_stream_struct *js, const char *name, size_t name_len, double value);
+int json_write_pair_int64_k(json_stream_struct *js, const json_key *key, int64_t value);
+int json_write_pair_uint64_k(json_stream_struct *js, const json_key *key, uint64_t value);
+int json_write_pair_double_k(json_stream_struct *js, const json_key *key, double value);
+
+/* Splice raw_len bytes of pre-encoded JSON, such as a cached subdocument, as a
+   singleton value (array context) or as the value of a name: value pair 
+   (object context). The bytes are copied as they are: they are not escaped,
+   sanitized or reindented. If validate is nonzero they must first pass 
+   json_validate_raw, and may nest no deeper than the stream's depth limit 
+   allows; otherwise they are trusted to be exactly one JSON value. */
+int json_write_raw_value(json_stream_struct *js, const char *raw, size_t raw_len, int validate);
+int json_write_raw_pair(json_stream_struct *js, char *name, 
+                        const char *raw, size_t raw_len, int validate);
+int json_write_raw_pair_n(json_stream_struct *js, const char *name, size_t name_len, 
+                          const char *raw, size_t raw_len, int validate);
+int json_write_raw_pair_k(json_stream_struct *js, const json_key *key, 
+                          const char *raw, size_t raw_len, int validate);
+
+/* Check that raw[0, raw_len) is exactly one JSON value (RFC 8259) with 
+   optional whitespace around it: well-formed numbers and literals, strings 
+   with valid escapes and well-formed UTF-8, and at most MAX_JSON_NESTED_DEPTH
+   levels of nesting. Returns 0 if so, -1 otherwise. Blobs validated once when 
+   they are cached can then be written with validate set to 0. */
+int json_validate_raw(const char *raw, size_t raw_len);
+
+/* Write a whole array of numbers, booleans or strings in one call. Like 
+   json_start_array, an array may only begin in an array context or when no 
+   context has yet been started; the _named forms must be in an object context.
+   String lengths may be NULL, in which case each string is NUL-terminated. 
+   Doubles are all checked before anything is written. */
+int json_write_int64_array(json_stream_struct *js, const int64_t *values, size_t count);
+int json_write_double_array(json_stream_struct *js, const double *values, size_t count);
+int json_write_bool_array(json_stream_struct *js, const int *values, size_t count);
+int json_write_string_array(json_stream_struct *js, const char *const *values, 
+                            const size_t *lengths, size_t count);
+
+int json_write_int64_array_named_n(json_stream_struct *js, const char *name, size_t name_len, 
+                                   const int64_t *values, size_t count);
+int json_write_double_array_named_n(json_stream_struct *js, const char *name, size_t name_len, 
+                                    const double *values, size_t count);
+int json_write_bool_array_named_n(json_stream_struct *js, const char *name, size_t name_len, 
+                                  const int *values, size_t count);
+int json_write_string_array_named_n(json_stream_struct *js, const char *name, size_t name_len, 
+                                    const char *const *values, const size_t *lengths, size_t count);
+int json_write_int64_array_named_k(json_stream_struct *js, const json_key *key, 
+                                   const int64_t *values, size_t count);
+int json_write_double_array_named_k(json_stream_struct *js, const json_key *key, 
+                                    const double *values, size_t count);
+int json_write_bool_array_named_k(json_stream_struct *js, const json_key *key, 
+                                  const int *values, size_t count);
+int json_write_string_array_named_k(json_stream_struct *js, const json_key *key, 
+                                    const char *const *values, const size_t *lengths, size_t count);
+
+/* Compile field_count field descriptions into desc, encoding every name once.
+   Names are escaped according to the stream's escape_strings setting and the
+   descriptor is allocated with its allocator, as with json_key_make. */
+int json_struct_desc_make(json_stream_struct *js, json_struct_desc *desc, 
+                          const json_field *fields, size_t field_count);
+void json_struct_desc_free(json_stream_struct *js, json_struct_desc *desc);
+
+/* Write count structs, stride bytes apart starting at base, as an array of 
+   objects with one member per field. Context rules are those of the bulk 
+   array writers above. Strings are not passed to string_sanitize_fn. */
+int json_write_struct_array(json_stream_struct *js, const json_struct_desc *desc, 
+                            const void *base, size_t count, size_t stride);
+int json_write_struct_array_named_n(json_stream_struct *js, const char *name, size_t name_len, 
+                                    const json_struct_desc *desc, const void *base, 
+                                    size_t count, size_t stride);
+int json_write_struct_array_named_k(json_stream_struct *js, const json_key *key, 
+                                    const json_struct_desc *desc, const void *base, 
+                                    size_t count, size_t stride);
 
-/* Close all open objects and arrays, terminating the file. */
+/* Start recording a template into tpl->rec, a buffer-mode stream initialized 
+   as by json_init_stream_buffer. A human readable template written below the
+   top level of a stream has that stream's indentation added to each line, so
+   record it with the same indent token (json_set_indent on tpl->rec). */
+void json_template_begin(json_template *tpl, int human_readable, json_realloc_fn realloc_fn);
+
+/* Add a hole for a singleton value (array context) or the value of a name: 
+   value pair (object context). type is JSON_FIELD_INT, _UINT, _DOUBLE, _BOOL
+   or _STRING. Holes are numbered from 0 in the order they are added. Errors 
+   are reported on tpl->rec. */
+int json_template_hole(json_template *tpl, json_field_type type);
+int json_template_pair_hole(json_template *tpl, char *name, json_field_type type);
+int json_template_pair_hole_n(json_template *tpl, const char *name, size_t name_len, json_field_type type);
+int json_template_pair_hole_k(json_template *tpl, const json_key *key, json_field_type type);
+
+/* Finish recording. Fails unless exactly one object or array was written and
+   closed, and no call on tpl->rec failed. */
+int json_template_end(json_template *tpl);
+
+/* Release a template, finished or not. */
+void json_template_free(json_template *tpl);
+
+/* Write a finished template as one element, filling hole n with values[n]. 
+   Context rules are those of json_start_object. The static output between the
+   holes is copied, and only the values are formatted. Doubles are all checked
+   before anything is written. */
+int json_write_template(json_stream_struct *js, const json_template *tpl, const json_hole_value *values);
+
+/* Fragments let other threads build runs of elements for a large array. A 
+   fragment is a buffer-mode stream starting inside the array open in parent, 
+   with the parent's formatting settings; the same structural rules apply as in
+   the parent. Initialize fragments while parent is not being written to, for
+   example before starting the worker threads. */
+int json_init_fragment(json_stream_struct *fragment, const json_stream_struct *parent);
+
+/* Append a fragment's elements to the array open in js, adding the separating
+   comma, then empty the fragment so it can be filled again. Every context the 
+   fragment opened must be closed, and js must be at the depth the fragment was
+   started at. Splice fragments in order from the thread writing js. */
+int json_splice_fragment(json_stream_struct *js, json_stream_struct *fragment);
+
+/* Close all open objects and arrays, terminating the file. 
+   Buffered output is flushed. */
 int json_end_file(json_stream_struct *js);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,455 @@
+/*
+
+c_json_stream.hpp
+
+Header-only C++17 front end to c_json_stream. Adds RAII scopes that close their
+object or array, member names encoded at compile time, and value writers chosen
+by overload at compile time instead of by a JSON_TYPE switch. Strings are passed
+as std::string_view to the length-explicit writers, so nothing is copied into an
+intermediate std::string.
+
+  c_json::Stream out(stdout, true);
+  {
+    auto root = out.object();
+    root.pair(c_json::make_key("id"), 42)
+        .pair("name", std::string_view(name))
+        .pair("ratio", 0.5);
+    auto tags = root.array(c_json::make_key("tags"));
+    tags.value("a").value(true).value(nullptr);
+  }
+  out.end_file();
+
+Calls do nothing once one has failed; status() and error() report the first
+failure. This lets scope destructors run without error checks of their own.
+
+*/
+
+#ifndef SIMPLE_JSON_STREAM_HPP
+#define SIMPLE_JSON_STREAM_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string_view>
+#include <type_traits>
+
+#include "c_json_stream.h"
+
+namespace c_json {
+
+/* StaticKey: A member name quoted, escaped and followed by the name separator
+   at compile time. Escapes as a stream with escape_strings set would. Create
+   with make_key so the length is deduced:
+     static constexpr auto timestamp_key = c_json::make_key("timestamp"); */
+template <std::size_t N>
+class StaticKey {
+ public:
+  constexpr explicit StaticKey(const char (&name)[N]) : bytes_{}, len_(0) {
+    constexpr char hex_digits[] = "0123456789abcdef";
+
+    bytes_[len_++] = '"';
+    for (std::size_t i = 0; i + 1 < N; i++) {
+      unsigned char c = static_cast<unsigned char>(name[i]);
+      if (c >= 0x20 && c != '"' && c != '\\') {
+        bytes_[len_++] = name[i];
+        continue;
+      }
+      bytes_[len_++] = '\\';
+      switch (c) {
+        case '"':  bytes_[len_++] = '"';  break;
+        case '\\': bytes_[len_++] = '\\'; break;
+        case '\b': bytes_[len_++] = 'b';  break;
+        case '\f': bytes_[len_++] = 'f';  break;
+        case '\n': bytes_[len_++] = 'n';  break;
+        case '\r': bytes_[len_++] = 'r';  break;
+        case '\t': bytes_[len_++] = 't';  break;
+        default:
+          bytes_[len_++] = 'u';
+          bytes_[len_++] = '0';
+          bytes_[len_++] = '0';
+          bytes_[len_++] = hex_digits[c >> 4];
+          bytes_[len_++] = hex_digits[c & 0xF];
+          break;
+      }
+    }
+    bytes_[len_++] = '"';
+    bytes_[len_++] = ':';
+    bytes_[len_++] = ' ';
+    bytes_[len_] = '\0';
+  }
+
+  constexpr std::string_view encoded() const { return std::string_view(bytes_, len_); }
+  constexpr json_key key() const { return json_key{bytes_, len_, JSON_ENCODING_JSON}; }
+
+ private:
+  /* Worst case every character becomes a six character \u escape. */
+  char bytes_[6 * (N - 1) + 5];
+  std::size_t len_;
+};
+
+template <std::size_t N>
+constexpr StaticKey<N> make_key(const char (&name)[N]) {
+  return StaticKey<N>(name);
+}
+
+/* Raw: Pre-encoded JSON spliced as a value by json_write_raw_value and 
+   json_write_raw_pair, checked with json_validate_raw unless validate is false:
+     root.pair("profile", c_json::raw(cached_profile)); */
+struct Raw {
+  std::string_view json;
+  bool validate;
+};
+
+inline Raw raw(std::string_view json, bool validate = true) { return Raw{json, validate}; }
+
+namespace detail {
+
+template <typename T>
+using bare_t = std::remove_cv_t<std::remove_reference_t<T>>;
+
+template <typename T>
+struct is_static_key : std::false_type {};
+template <std::size_t N>
+struct is_static_key<StaticKey<N>> : std::true_type {};
+
+/* Member names: a StaticKey or json_key is copied as is, anything convertible
+   to std::string_view is escaped as it is written. */
+template <typename K>
+constexpr bool is_name_v = is_static_key<bare_t<K>>::value ||
+                           std::is_same_v<bare_t<K>, json_key> ||
+                           std::is_convertible_v<const K &, std::string_view>;
+
+template <typename T>
+constexpr bool is_string_v = !std::is_same_v<bare_t<T>, std::nullptr_t> &&
+                             std::is_convertible_v<const T &, std::string_view>;
+
+template <typename T>
+constexpr bool is_char_v = std::is_same_v<T, char> || std::is_same_v<T, signed char> ||
+                           std::is_same_v<T, unsigned char> || std::is_same_v<T, wchar_t> ||
+                           std::is_same_v<T, char16_t> || std::is_same_v<T, char32_t>;
+
+template <typename T>
+constexpr bool is_value_v = std::is_same_v<T, bool> || std::is_same_v<T, std::nullptr_t> ||
+                            (std::is_integral_v<T> && !is_char_v<T>) ||
+                            std::is_floating_point_v<T> || is_string_v<T> || std::is_same_v<T, Raw>;
+
+/* Write a singleton value, selecting the writer from the type of v. */
+template <typename T>
+inline int write_value(json_stream_struct *js, const T &v) {
+  using U = bare_t<T>;
+  static_assert(is_value_v<U>, "c_json: value must be bool, an integer, a floating "
+                "point number, nullptr, Raw, or convertible to std::string_view");
+
+  if constexpr (std::is_same_v<U, bool>) {
+    return v ? json_write_value_n(js, JSON_TRUE, nullptr, 0)
+             : json_write_value_n(js, JSON_FALSE, nullptr, 0);
+  } else if constexpr (std::is_same_v<U, std::nullptr_t>) {
+    return json_write_value_n(js, JSON_NULL, nullptr, 0);
+  } else if constexpr (std::is_integral_v<U> && std::is_signed_v<U>) {
+    return json_write_int64(js, static_cast<std::int64_t>(v));
+  } else if constexpr (std::is_integral_v<U>) {
+    return json_write_uint64(js, static_cast<std::uint64_t>(v));
+  } else if constexpr (std::is_floating_point_v<U>) {
+    return json_write_double(js, static_cast<double>(v));
+  } else if constexpr (std::is_same_v<U, Raw>) {
+    return json_write_raw_value(js, v.json.data(), v.json.size(), v.validate);
+  } else {
+    std::string_view s(v);
+    return json_write_value_n(js, JSON_STRING, s.data(), s.size());
+  }
+}
+
+/* Names that are already quoted, escaped and followed by the separator. */
+template <typename K>
+constexpr bool is_encoded_v = is_static_key<bare_t<K>>::value ||
+                              std::is_same_v<bare_t<K>, json_key>;
+
+template <typename K>
+inline json_key encoded_key(const K &name) {
+  if constexpr (is_static_key<bare_t<K>>::value) {
+    return name.key();
+  } else {
+    return name;
+  }
+}
+
+/* Write a name: value pair, selecting both the name and value writers from
+   their types. */
+template <typename K, typename T>
+inline int write_pair(json_stream_struct *js, const K &name, const T &v) {
+  using U = bare_t<T>;
+  static_assert(is_name_v<K>, "c_json: name must be a StaticKey, a json_key, or "
+                "convertible to std::string_view");
+  static_assert(is_value_v<U>, "c_json: value must be bool, an integer, a floating "
+                "point number, nullptr, Raw, or convertible to std::string_view");
+
+  if constexpr (is_encoded_v<K>) {
+    const json_key key = encoded_key(name);
+    if constexpr (std::is_same_v<U, bool>) {
+      return v ? json_write_pair_k(js, &key, JSON_TRUE, nullptr, 0)
+               : json_write_pair_k(js, &key, JSON_FALSE, nullptr, 0);
+    } else if constexpr (std::is_same_v<U, std::nullptr_t>) {
+      return json_write_pair_k(js, &key, JSON_NULL, nullptr, 0);
+    } else if constexpr (std::is_integral_v<U> && std::is_signed_v<U>) {
+      return json_write_pair_int64_k(js, &key, static_cast<std::int64_t>(v));
+    } else if constexpr (std::is_integral_v<U>) {
+      return json_write_pair_uint64_k(js, &key, static_cast<std::uint64_t>(v));
+    } else if constexpr (std::is_floating_point_v<U>) {
+      return json_write_pair_double_k(js, &key, static_cast<double>(v));
+    } else if constexpr (std::is_same_v<U, Raw>) {
+      return json_write_raw_pair_k(js, &key, v.json.data(), v.json.size(), v.validate);
+    } else {
+      std::string_view s(v);
+      return json_write_pair_k(js, &key, JSON_STRING, s.data(), s.size());
+    }
+  } else {
+    std::string_view n(name);
+    if constexpr (std::is_same_v<U, bool>) {
+      return v ? json_write_pair_n(js, n.data(), n.size(), JSON_TRUE, nullptr, 0)
+               : json_write_pair_n(js, n.data(), n.size(), JSON_FALSE, nullptr, 0);
+    } else if constexpr (std::is_same_v<U, std::nullptr_t>) {
+      return json_write_pair_n(js, n.data(), n.size(), JSON_NULL, nullptr, 0);
+    } else if constexpr (std::is_integral_v<U> && std::is_signed_v<U>) {
+      return json_write_pair_int64_n(js, n.data(), n.size(), static_cast<std::int64_t>(v));
+    } else if constexpr (std::is_integral_v<U>) {
+      return json_write_pair_uint64_n(js, n.data(), n.size(), static_cast<std::uint64_t>(v));
+    } else if constexpr (std::is_floating_point_v<U>) {
+      return json_write_pair_double_n(js, n.data(), n.size(), static_cast<double>(v));
+    } else if constexpr (std::is_same_v<U, Raw>) {
+      return json_write_raw_pair_n(js, n.data(), n.size(), v.json.data(), v.json.size(), v.validate);
+    } else {
+      std::string_view s(v);
+      return json_write_pair_n(js, n.data(), n.size(), JSON_STRING, s.data(), s.size());
+    }
+  }
+}
+
+template <typename K>
+inline int start_object_named(json_stream_struct *js, const K &name) {
+  static_assert(is_name_v<K>, "c_json: name must be a StaticKey, a json_key, or "
+                "convertible to std::string_view");
+  if constexpr (is_encoded_v<K>) {
+    const json_key key = encoded_key(name);
+    return json_start_object_named_k(js, &key);
+  } else {
+    std::string_view n(name);
+    return json_start_object_named_n(js, n.data(), n.size());
+  }
+}
+
+template <typename K>
+inline int start_array_named(json_stream_struct *js, const K &name) {
+  static_assert(is_name_v<K>, "c_json: name must be a StaticKey, a json_key, or "
+                "convertible to std::string_view");
+  if constexpr (is_encoded_v<K>) {
+    const json_key key = encoded_key(name);
+    return json_start_array_named_k(js, &key);
+  } else {
+    std::string_view n(name);
+    return json_start_array_named_n(js, n.data(), n.size());
+  }
+}
+
+}  // namespace detail
+
+class ObjectScope;
+class ArrayScope;
+
+/* Writer: Non-owning view of a json_stream_struct that remembers the first
+   failed call. */
+class Writer {
+ public:
+  explicit Writer(json_stream_struct &js) : js_(&js), status_(0) {}
+
+  json_stream_struct &stream() const { return *js_; }
+  int status() const { return status_; }
+  bool ok() const { return status_ == 0; }
+  const char *error() const { return js_->error_string; }
+  json_error error_code() const { return js_->error_code; }
+
+  /* Select CBOR or MessagePack output, before anything is written. StaticKeys
+     stay JSON and are re-encoded on binary streams. */
+  Writer &encoding(json_encoding e) {
+    if (status_ == 0) status_ = json_set_encoding(js_, e);
+    return *this;
+  }
+
+  template <typename T>
+  Writer &value(const T &v) {
+    if (status_ == 0) status_ = detail::write_value(js_, v);
+    return *this;
+  }
+
+  template <typename K, typename T>
+  Writer &pair(const K &name, const T &v) {
+    if (status_ == 0) status_ = detail::write_pair(js_, name, v);
+    return *this;
+  }
+
+  /* Open an object or array, closed when the returned scope is destroyed. */
+  ObjectScope object();
+  template <typename K>
+  ObjectScope object(const K &name);
+  ArrayScope array();
+  template <typename K>
+  ArrayScope array(const K &name);
+
+  Writer &end_context() {
+    if (status_ == 0) status_ = json_end_context(js_);
+    return *this;
+  }
+
+  Writer &flush() {
+    if (status_ == 0) status_ = json_flush(js_);
+    return *this;
+  }
+
+  Writer &end_file() {
+    if (status_ == 0) status_ = json_end_file(js_);
+    return *this;
+  }
+
+ protected:
+  /* Record the result of a start call; true if the context was opened. */
+  bool opened(int status) {
+    status_ = status;
+    return status == 0;
+  }
+
+ private:
+  json_stream_struct *js_;
+  int status_;
+};
+
+/* Scope: Closes the object or array it was opened with, unless opening it
+   failed or close() was already called. Movable, not copyable. */
+class Scope {
+ public:
+  Scope(const Scope &) = delete;
+  Scope &operator=(const Scope &) = delete;
+  Scope(Scope &&other) noexcept : writer_(other.writer_), open_(other.open_) {
+    other.open_ = false;
+  }
+  Scope &operator=(Scope &&other) noexcept {
+    if (this != &other) {
+      close();
+      writer_ = other.writer_;
+      open_ = other.open_;
+      other.open_ = false;
+    }
+    return *this;
+  }
+  ~Scope() { close(); }
+
+  void close() {
+    if (open_) writer_->end_context();
+    open_ = false;
+  }
+
+  Writer &writer() const { return *writer_; }
+
+ protected:
+  Scope(Writer &writer, bool open) : writer_(&writer), open_(open) {}
+
+  Writer *writer_;
+  bool open_;
+};
+
+class ObjectScope : public Scope {
+ public:
+  template <typename K, typename T>
+  ObjectScope &pair(const K &name, const T &v) {
+    writer_->pair(name, v);
+    return *this;
+  }
+
+  template <typename K>
+  ObjectScope object(const K &name) { return writer_->object(name); }
+  template <typename K>
+  ArrayScope array(const K &name);
+
+ private:
+  friend class Writer;
+  ObjectScope(Writer &writer, bool open) : Scope(writer, open) {}
+};
+
+class ArrayScope : public Scope {
+ public:
+  template <typename T>
+  ArrayScope &value(const T &v) {
+    writer_->value(v);
+    return *this;
+  }
+
+  ObjectScope object() { return writer_->object(); }
+  ArrayScope array() { return writer_->array(); }
+
+ private:
+  friend class Writer;
+  ArrayScope(Writer &writer, bool open) : Scope(writer, open) {}
+};
+
+template <typename K>
+inline ArrayScope ObjectScope::array(const K &name) {
+  return writer_->array(name);
+}
+
+inline ObjectScope Writer::object() {
+  bool open = status_ == 0 && opened(json_start_object(js_));
+  return ObjectScope(*this, open);
+}
+
+template <typename K>
+inline ObjectScope Writer::object(const K &name) {
+  bool open = status_ == 0 && opened(detail::start_object_named(js_, name));
+  return ObjectScope(*this, open);
+}
+
+inline ArrayScope Writer::array() {
+  bool open = status_ == 0 && opened(json_start_array(js_));
+  return ArrayScope(*this, open);
+}
+
+template <typename K>
+inline ArrayScope Writer::array(const K &name) {
+  bool open = status_ == 0 && opened(detail::start_array_named(js_, name));
+  return ArrayScope(*this, open);
+}
+
+/* Stream: Owns a json_stream_struct and releases it on destruction. Not movable,
+   since writers and scopes refer to it. */
+class Stream : public Writer {
+ public:
+  /* Write to a file. */
+  explicit Stream(std::FILE *out, bool human_readable = false) : Writer(js_) {
+    json_init_stream(&js_, human_readable, out);
+  }
+
+  /* Write to a caller-supplied sink. */
+  explicit Stream(const json_sink &sink, bool human_readable = false) : Writer(js_) {
+    json_init_stream_sink(&js_, human_readable, &sink);
+  }
+
+  /* Accumulate the whole document in memory; read it back with buffer(). */
+  explicit Stream(bool human_readable = false, json_realloc_fn realloc_fn = nullptr)
+      : Writer(js_) {
+    json_init_stream_buffer(&js_, human_readable, realloc_fn);
+  }
+
+  Stream(const Stream &) = delete;
+  Stream &operator=(const Stream &) = delete;
+
+  ~Stream() { json_free_stream(&js_); }
+
+  std::string_view buffer() const {
+    if (!js_.stream_buffer) return std::string_view();
+    return std::string_view(js_.stream_buffer, js_.stream_buffer_len);
+  }
+
+ private:
+  json_stream_struct js_;
+};
+
+}  // namespace c_json
+
+#endif
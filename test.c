@@ -1,8 +1,24 @@
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "c_json_stream.h"
 
+#ifdef JSON_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef JSON_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef JSON_HAVE_POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
 #ifndef true
 #define true 1
 #endif
@@ -13,8 +29,33 @@
 
 void basic_test_sample(); /* Write a simple file that uses all of the included routines. */
 void test_buffer_write(); /* Write the same data, first writing to a string buffer. */
+void test_retained_buffer_write(); /* Write the same data, accumulating the whole document in the buffer. */
+void test_sink_write(); /* Write the same data through a caller-supplied sink. */
+void test_sink_string(json_utf8_policy policy, const char *value, const char *expected); /* One string through an unbuffered sink. */
+void test_mmap_write(); /* Write the same data through a memory-mapped file. */
+void test_async_write(); /* Write the same data through a background writer thread. */
+void test_compression(); /* Write the same data through the compressing sinks. */
+void test_string_escaping(); /* Verify names and string values are escaped. */
+void test_utf8(); /* Verify the UTF-8 policies against ill-formed strings. */
+void test_number_writers(); /* Verify native integer and double formatting. */
+void test_length_explicit(); /* Verify the _n writers use only the given lengths. */
+void test_keys(); /* Verify pre-encoded keys. */
+void test_raw(); /* Verify raw JSON splicing and its validator. */
+void test_indentation(); /* Verify custom and deeply nested indentation. */
+void test_bulk_arrays(); /* Verify the bulk array writers. */
+void test_struct_arrays(); /* Verify struct descriptors against the equivalent single writers. */
+void test_templates(); /* Verify templates against the equivalent single writers. */
+void test_fragments(); /* Verify spliced fragments match writing the elements directly. */
+void test_record_mode(); /* Verify one record per line and batched flushes. */
+void test_stats(); /* Verify the instrumentation counters. */
+void test_pool(); /* Verify pooled streams and the reuse of their buffers. */
+void test_pull(); /* Verify output pulled in small chunks matches the whole document. */
+void test_binary_encodings(); /* Verify CBOR and MessagePack output byte for byte. */
 void test_error_cases(); /* Deliberately induce all currently handled error cases to verify correct handling. */
 
+int test_failures = 0; /* Checks that failed; main returns nonzero if any did. */
+void test_fail(const char *format, ...); /* Print a failure and count it. */
+
 int main() {
   printf("Testing writing to a file.\n");
   basic_test_sample();
@@ -24,27 +65,133 @@ int main() {
   test_buffer_write();
   printf("Complete.\n\n");
 
+  printf("Testing writing the whole document to the buffer.\n");
+  test_retained_buffer_write();
+  printf("Complete.\n\n");
+
+  printf("Testing writing through a sink.\n");
+  test_sink_write();
+  printf("Complete.\n\n");
+
+#ifdef JSON_HAVE_POSIX
+  printf("Testing writing through a memory-mapped file.\n");
+  test_mmap_write();
+  printf("Complete.\n\n");
+#endif
+
+#ifdef JSON_HAVE_THREADS
+  printf("Testing writing through a background thread.\n");
+  test_async_write();
+  printf("Complete.\n\n");
+#endif
+
+#ifdef JSON_HAVE_COMPRESSION
+  printf("Testing compressed output.\n");
+  test_compression();
+  printf("Complete.\n\n");
+#endif
+
+  printf("Testing string escaping.\n");
+  test_string_escaping();
+  printf("Complete.\n\n");
+
+  printf("Testing UTF-8 policies.\n");
+  test_utf8();
+  printf("Complete.\n\n");
+
+  printf("Testing number writers.\n");
+  test_number_writers();
+  printf("Complete.\n\n");
+
+  printf("Testing length-explicit writers.\n");
+  test_length_explicit();
+  printf("Complete.\n\n");
+
+  printf("Testing pre-encoded keys.\n");
+  test_keys();
+  printf("Complete.\n\n");
+
+  printf("Testing raw JSON.\n");
+  test_raw();
+  printf("Complete.\n\n");
+
+  printf("Testing indentation.\n");
+  test_indentation();
+  printf("Complete.\n\n");
+
+  printf("Testing bulk array writers.\n");
+  test_bulk_arrays();
+  printf("Complete.\n\n");
+
+  printf("Testing struct array writers.\n");
+  test_struct_arrays();
+  printf("Complete.\n\n");
+
+  printf("Testing templates.\n");
+  test_templates();
+  printf("Complete.\n\n");
+
+  printf("Testing fragments.\n");
+  test_fragments();
+  printf("Complete.\n\n");
+
+  printf("Testing record mode.\n");
+  test_record_mode();
+  printf("Complete.\n\n");
+
+  printf("Testing pulled output.\n");
+  test_pull();
+  printf("Complete.\n\n");
+
+  printf("Testing binary encodings.\n");
+  test_binary_encodings();
+  printf("Complete.\n\n");
+
+  printf("Testing instrumentation counters.\n");
+  test_stats();
+  printf("Complete.\n\n");
+
+  printf("Testing stream pools.\n");
+  test_pool();
+  printf("Complete.\n\n");
+
   printf("Testing handled error cases.\n");
   test_error_cases();
   printf("Complete.\n\n");
 
+  if(test_failures) {
+    printf("%d checks failed.\n", test_failures);
+    return 1;
+  }
   return 0;
 }
 
 
 
+/* Report a failed check. */
+void test_fail(const char *format, ...) {
+  va_list args;
+
+  test_failures++;
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+}
+
+
+
 // Test harness function.
 void test_json(int json_result, json_stream_struct *js, const char *expected_error_str) {
   if(!expected_error_str) {
     if(json_result) {
-      printf("Got error: %s\n", js->error_string);
+      test_fail("Got error: %s\n", js->error_string);
     }
   } else {
     if(!json_result) {
-      printf("No error reported. Expecting: \"%s\"\n", expected_error_str);
+      test_fail("No error reported. Expecting: \"%s\"\n", expected_error_str);
     } else {
       if(strcmp(js->error_string, expected_error_str) != 0) {
-        printf("Got: \"%s\", Expecting: \"%s\"\n", js->error_string, expected_error_str);
+        test_fail("Got: \"%s\", Expecting: \"%s\"\n", js->error_string, expected_error_str);
       } else {
         printf("Correctly reported error: \"%s\"\n", expected_error_str);
       }
@@ -114,6 +261,8 @@ void basic_test_sample() {
   test_json(json_write_pair(js, "Luggage combo", JSON_NUMBER, "12345"), js, NULL);
 
   test_json(json_end_file(js), js, NULL);
+
+  json_free_stream(js);
 }
 
 
@@ -184,58 +333,1785 @@ void test_buffer_write() {
 
   test_json(json_end_file(js), js, NULL);
   fprintf(out, js->stream_buffer);
+
+  json_free_stream(js);
 }
 
 
 
-void test_error_cases() {
+/* The same document as basic_test_sample, for tests that only vary the output. */
+void write_sample_document(json_stream_struct *js) {
+  test_json(json_start_object(js), js, NULL);
+  test_json(json_start_object_named(js, "Gooble"), js, NULL);
+  test_json(json_write_pair(js, "Awesome", JSON_STRING, "Possum"), js, NULL);
+  test_json(json_write_pair(js, "Answer", JSON_NUMBER, "42"), js, NULL);
+  test_json(json_write_pair(js, "Incredible", JSON_TRUE, "ERROR IF YOU SEE THIS"), js, NULL);
+  test_json(json_write_pair(js, "Redundant", JSON_FALSE, "ERROR IF YOU SEE THIS"), js, NULL);
+  test_json(json_write_pair(js, "DBA Word", JSON_NULL, "ERROR IF YOU SEE THIS"), js, NULL);
+  test_json(json_end_context(js), js, NULL);
+  test_json(json_write_pair(js, "Another", JSON_STRING, "Element"), js, NULL);
+  test_json(json_start_array_named(js, "Arrrr-EH?"), js, NULL);
+  test_json(json_start_array(js), js, NULL);
+  test_json(json_write_value(js, JSON_STRING, "Possum"), js, NULL);
+  test_json(json_write_value(js, JSON_NUMBER, "42"), js, NULL);
+  test_json(json_write_value(js, JSON_TRUE, "ERROR IF YOU SEE THIS"), js, NULL);
+  test_json(json_write_value(js, JSON_FALSE, "ERROR IF YOU SEE THIS"), js, NULL);
+  test_json(json_write_value(js, JSON_NULL, "ERROR IF YOU SEE THIS"), js, NULL);
+  test_json(json_end_context(js), js, NULL);
+  test_json(json_start_object(js), js, NULL);
+  test_json(json_start_object_named(js, "Objectify this"), js, NULL);
+  test_json(json_write_pair(js, "Luggage combo", JSON_NUMBER, "12345"), js, NULL);
+  test_json(json_end_file(js), js, NULL);
+}
+
+
+
+void test_retained_buffer_write() {
+  FILE *out;
   json_stream_struct json_stream;
   json_stream_struct *js;
+  char long_value[5000];
 
   js = &json_stream;
-  json_init_stream(js, true, NULL);
 
-  test_json(json_start_object(js), js, NULL);
+  json_init_stream_buffer(js, true, NULL);
+  write_sample_document(js);
 
-  // In an Object 
-  printf("\nIn an Object: \n");
-  test_json(json_start_object(js), js, "Attempted to open an object when not starting a file or in array context.");
-  test_json(json_start_array(js), js, "Attempted to open an array when not starting a file or in array context.");
-  test_json(json_write_value(js, JSON_STRING, "nope"), js, "Attempted to print a single value outside an array context.");
-  test_json(json_write_pair(js, "nope", 
-                            ~(JSON_OBJECT || JSON_MEMBER || JSON_PAIR || JSON_ARRAY || JSON_ELEMENT || JSON_VALUE || 
-                            JSON_STRING || JSON_NUMBER || JSON_TRUE || JSON_FALSE || JSON_NULL),
-                            "nope"), js, "Attempted to print a name: value pair value of an invalid value type.");
+  out = fopen("test_retained.json", "w");
+  fwrite(js->stream_buffer, 1, js->stream_buffer_len, out);
+  fclose(out);
+
+  /* A single value longer than the initial buffer must grow it rather than fail. */
+  json_free_stream(js);
+  json_init_stream_buffer(js, false, NULL);
+  memset(long_value, 'x', sizeof(long_value) - 1);
+  long_value[sizeof(long_value) - 1] = '\0';
+
+  test_json(json_start_array(js), js, NULL);
+  test_json(json_write_value(js, JSON_STRING, long_value), js, NULL);
   test_json(json_end_file(js), js, NULL);
+  if(js->stream_buffer_len != sizeof(long_value) + 3 || strlen(js->stream_buffer) != js->stream_buffer_len) {
+    test_fail("Unexpected buffer length: %lu\n", (unsigned long)js->stream_buffer_len);
+  }
 
-  // After finishing a file
-  printf("\nAfter finishing a file: \n");
-  test_json(json_start_object(js), js, "Attempted to open an object when file is already complete.");
-  test_json(json_start_array(js), js, "Attempted to open an array when file is already complete.");
-  test_json(json_end_context(js), js, "Attempted to close a context when none is open.");
-  test_json(json_write_value(js, JSON_STRING, "nope"), js, "Attempted to print a single value when no context is open.");
-  test_json(json_write_pair(js, "nope", JSON_STRING, "nope"), js, "Attempted to print a pair when no context is open.");
+  json_free_stream(js);
+}
 
 
-  json_init_stream(js, true, NULL);
 
-  // Before starting a file:
-  printf("\nBefore starting a file: \n");
-  test_json(json_start_object_named(js, "nope"), js, "Attempted to start a named object when no context is open.");
-  test_json(json_start_array_named(js, "nope"), js, "Attempted to start a named array when no context is open.");
-  test_json(json_end_context(js), js, "Attempted to close a context when none is open.");
-  test_json(json_write_value(js, JSON_STRING, "nope"), js, "Attempted to print a single value when no context is open.");
+/* Sink that counts the batches it receives and passes them on to a file. */
+typedef struct {
+  FILE *out;
+  int writes;
+  int gathered_writes;
+} counting_sink;
+
+int counting_sink_write(void *user, const char *data, size_t len) {
+  counting_sink *cs = (counting_sink *)user;
+  cs->writes++;
+  return fwrite(data, 1, len, cs->out) == len ? 0 : -1;
+}
+
+int counting_sink_writev(void *user, const json_iovec *iov, int iovcnt) {
+  counting_sink *cs = (counting_sink *)user;
+  int ii;
+  cs->gathered_writes++;
+  for(ii = 0; ii < iovcnt; ++ii) {
+    if(fwrite(iov[ii].data, 1, iov[ii].len, cs->out) != iov[ii].len) return -1;
+  }
+  return 0;
+}
+
+
+
+void test_sink_write() {
+  json_stream_struct json_stream;
+  json_stream_struct *js;
+  json_sink sink;
+  counting_sink cs;
+  char long_value[1000];
+
+  js = &json_stream;
+  cs.out = fopen("test_sink.json", "w");
+  cs.writes = 0;
+  cs.gathered_writes = 0;
+  sink.write = counting_sink_write;
+  sink.writev = counting_sink_writev;
+  sink.flush = NULL;
+  sink.user = &cs;
+
+  /* Buffered: the whole sample document should reach the sink in one write. */
+  json_init_stream_sink(js, true, &sink);
+  write_sample_document(js);
+  if(cs.writes != 1 || cs.gathered_writes != 0) {
+    test_fail("Expected a single buffered write, got %d writes and %d gathered writes.\n", 
+              cs.writes, cs.gathered_writes);
+  }
+  json_free_stream(js);
+  fclose(cs.out);
+
+  /* Unbuffered: each call is handed over as soon as it completes, and a long 
+     value is passed by reference alongside the buffered punctuation. */
+  cs.out = fopen("test_sink_long.json", "w");
+  cs.writes = 0;
+  cs.gathered_writes = 0;
+  memset(long_value, 'x', sizeof(long_value) - 1);
+  long_value[sizeof(long_value) - 1] = '\0';
 
+  json_init_stream_sink(js, false, &sink);
+  json_set_flush_threshold(js, 0);
   test_json(json_start_array(js), js, NULL);
-  // In an Array
-  printf("\nIn an Array: \n");
-  test_json(json_start_object_named(js, "nope"), js, "Attempted to open a named object outside an object context.");
-  test_json(json_start_array_named(js, "nope"), js, "Attempted to open a named array outside an object context.");
-  test_json(json_write_value(js, 
-                             ~(JSON_OBJECT || JSON_MEMBER || JSON_PAIR || JSON_ARRAY || JSON_ELEMENT || JSON_VALUE || 
-                             JSON_STRING || JSON_NUMBER || JSON_TRUE || JSON_FALSE || JSON_NULL),
-                             "nope"), js, "Attempted to print a single value of an invalid type.");
-  test_json(json_write_pair(js, "nope", JSON_STRING, "nope"), js, "Attempted to print a name: value pair outside an object context.");
+  test_json(json_write_value(js, JSON_STRING, long_value), js, NULL);
+  test_json(json_end_file(js), js, NULL);
+  if(cs.gathered_writes != 1) {
+    test_fail("Expected the long value in a single gathered write, got %d.\n", cs.gathered_writes);
+  }
+  json_free_stream(js);
+  fclose(cs.out);
+  /* Escapes are generated, not the caller's, so must be copied even when 
+     every fragment is dispatched as it is written. */
+  test_sink_string(JSON_UTF8_UNCHECKED, "a\nb\tc\x01" "d", "[\"a\\nb\\tc\\u0001d\"]");
+  test_sink_string(JSON_UTF8_REPLACE, "a\xff\nb\xe2\x82" "c", "[\"a\xef\xbf\xbd\\nb\xef\xbf\xbd" "c\"]");
+  test_sink_string(JSON_UTF8_ESCAPE, "a\xff\tb\xe2\x82" "c", "[\"a\\u00ff\\tb\\u00e2\\u0082c\"]");
+}
+
+
+
+
+
+/* Write ["value"] through a sink that gathers every fragment by reference, and
+   compare what reaches the file with expected. */
+void test_sink_string(json_utf8_policy policy, const char *value, const char *expected) {
+  json_stream_struct json_stream;
+  json_stream_struct *js;
+  json_sink sink;
+  counting_sink cs;
+  char written[256];
+  size_t len;
+
+  js = &json_stream;
+  cs.out = fopen("test_sink_string.json", "w+b");
+  cs.writes = 0;
+  cs.gathered_writes = 0;
+  sink.write = counting_sink_write;
+  sink.writev = counting_sink_writev;
+  sink.flush = NULL;
+  sink.user = &cs;
+
+  json_init_stream_sink(js, false, &sink);
+  json_set_flush_threshold(js, 0);
+  json_set_utf8_policy(js, policy);
+  test_json(json_start_array(js), js, NULL);
+  test_json(json_write_value_n(js, JSON_STRING, value, strlen(value)), js, NULL);
+  test_json(json_end_file(js), js, NULL);
+  json_free_stream(js);
+
+  rewind(cs.out);
+  len = fread(written, 1, sizeof(written) - 1, cs.out);
+  written[len] = '\0';
+  if(strcmp(written, expected) != 0) test_fail("Got: %s\nExpecting: %s\n", written, expected);
+  fclose(cs.out);
+}
+
+#ifdef JSON_HAVE_POSIX
+void test_mmap_write() {
+  json_stream_struct json_stream;
+  json_stream_struct *js;
+  json_mmap_file mf;
+  json_sink sink;
+  struct stat st;
+  int fd, ii;
+
+  js = &json_stream;
+
+  /* One page per chunk, so the sample document grows the file several times. */
+  fd = open("test_mmap.json", O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0 || json_mmap_open(&mf, fd, 1, JSON_MMAP_SEQUENTIAL | JSON_MMAP_DONTNEED | JSON_MMAP_ASYNC) != 0) {
+    test_fail("Could not open test_mmap.json.\n");
+    return;
+  }
+  sink = json_mmap_sink(&mf);
+  json_init_stream_sink(js, true, &sink);
+  json_set_flush_threshold(js, 0);
+  write_sample_document(js);
+  json_free_stream(js);
+
+  /* json_end_file trims the file to the document. */
+  if(fstat(fd, &st) != 0 || (size_t)st.st_size != mf.len) {
+    test_fail("Expected the file trimmed to %lu characters.\n", (unsigned long)mf.len);
+  }
+  if(json_mmap_close(&mf) != 0) test_fail("Could not close test_mmap.json.\n");
+  close(fd);
+
+  /* Writing resumes past a flush, growing the trimmed file again. */
+  fd = open("test_mmap_long.json", O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0 || json_mmap_open(&mf, fd, 1, JSON_MMAP_SYNC) != 0) {
+    test_fail("Could not open test_mmap_long.json.\n");
+    return;
+  }
+  sink = json_mmap_sink(&mf);
+  json_init_stream_sink(js, false, &sink);
+  test_json(json_start_array(js), js, NULL);
+  for(ii = 0; ii < 10000; ++ii) {
+    test_json(json_write_int64(js, ii), js, NULL);
+    if(ii == 5000) test_json(json_flush(js), js, NULL);
+  }
+  test_json(json_end_file(js), js, NULL);
+  json_free_stream(js);
+  if(fstat(fd, &st) != 0 || st.st_size != 48891 || mf.len != 48891) {
+    test_fail("Expected 48891 characters, got %ld.\n", (long)st.st_size);
+  }
+  json_mmap_close(&mf);
+  close(fd);
+}
+#endif
+
+
+
+#ifdef JSON_HAVE_THREADS
+void test_async_write() {
+  json_stream_struct json_stream;
+  json_stream_struct *js;
+  json_async_file af;
+  json_sink sink;
+  struct stat st;
+  int fd, ii;
+
+  js = &json_stream;
+
+  /* Tiny buffers, so the generator keeps catching up with the writer thread. */
+  fd = open("test_async.json", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0 || json_async_open(&af, fd, 16, 2, true) != 0) {
+    test_fail("Could not open test_async.json.\n");
+    return;
+  }
+  sink = json_async_sink(&af);
+  json_init_stream_sink(js, true, &sink);
+  json_set_flush_threshold(js, 0);
+  write_sample_document(js);
+  json_free_stream(js);
+  if(json_async_close(&af) != 0) test_fail("Could not close test_async.json.\n");
+  close(fd);
+
+  /* json_end_file returns once everything has been written. */
+  fd = open("test_async_long.json", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0 || json_async_open(&af, fd, 0, 0, false) != 0) {
+    test_fail("Could not open test_async_long.json.\n");
+    return;
+  }
+  sink = json_async_sink(&af);
+  json_init_stream_sink(js, false, &sink);
+  json_set_flush_threshold(js, 1000);
+  test_json(json_start_array(js), js, NULL);
+  for(ii = 0; ii < 10000; ++ii) {
+    test_json(json_write_int64(js, ii), js, NULL);
+  }
+  test_json(json_end_file(js), js, NULL);
+  if(fstat(fd, &st) != 0 || st.st_size != 48891) {
+    test_fail("Expected 48891 characters, got %ld.\n", (long)st.st_size);
+  }
+  json_free_stream(js);
+  json_async_close(&af);
+  close(fd);
+}
+#endif
+
+
+
+#ifdef JSON_HAVE_COMPRESSION
+/* Compress the sample document into file_name, with a flush point every 
+   flush_every characters. */
+void write_compressed_sample(const char *file_name, json_compress_format format, int level, size_t flush_every) {
+  json_stream_struct json_stream;
+  json_stream_struct *js;
+  json_compressor jc;
+  json_sink file_sink, sink;
+  FILE *out;
+
+  js = &json_stream;
+  out = fopen(file_name, "wb");
+  file_sink = json_file_sink(out);
+  if(json_compress_open(&jc, &file_sink, format, level, flush_every) != 0) {
+    test_fail("Could not start compressing %s.\n", file_name);
+    fclose(out);
+    return;
+  }
+  sink = json_compress_sink(&jc);
+  json_init_stream_sink(js, true, &sink);
+  json_set_flush_threshold(js, 0);
+  test_json(json_flush(js), js, NULL); /* A flush point with nothing before it. */
+  write_sample_document(js);
+  json_free_stream(js);
+  if(json_compress_close(&jc) != 0) test_fail("Could not finish compressing %s.\n", file_name);
+  if(jc.bytes_in == 0 || jc.bytes_out == 0) test_fail("Expected totals for %s.\n", file_name);
+  fclose(out);
+}
+
+
+
+/* Read a whole file into a NUL-terminated buffer. */
+char *read_file(const char *file_name, size_t *len) {
+  FILE *in;
+  char *data;
+  long size;
+
+  in = fopen(file_name, "rb");
+  if(!in) return NULL;
+  fseek(in, 0, SEEK_END);
+  size = ftell(in);
+  fseek(in, 0, SEEK_SET);
+  data = (char *)malloc((size_t)size + 1);
+  *len = fread(data, 1, (size_t)size, in);
+  data[*len] = '\0';
+  fclose(in);
+  return data;
+}
+
+
+
+void test_compression() {
+  char *expected, *compressed, decoded[4096];
+  size_t expected_len, compressed_len;
+
+  /* test.json already holds the human-readable sample document. */
+  expected = read_file("test.json", &expected_len);
+  if(!expected) {
+    test_fail("Could not read test.json.\n");
+    return;
+  }
+
+#ifdef JSON_HAVE_ZLIB
+  {
+    z_stream zs;
+    uLongf zlib_len;
+    size_t decoded_len;
+
+    write_compressed_sample("test.json.gz", JSON_COMPRESS_GZIP, 9, 50);
+    write_compressed_sample("test.json.z", JSON_COMPRESS_ZLIB, 1, 0);
+
+    /* Adding 32 to the window bits accepts either wrapper. */
+    compressed = read_file("test.json.gz", &compressed_len);
+    memset(&zs, 0, sizeof(zs));
+    inflateInit2(&zs, MAX_WBITS + 32);
+    zs.next_in = (Bytef *)compressed;
+    zs.avail_in = (uInt)compressed_len;
+    zs.next_out = (Bytef *)decoded;
+    zs.avail_out = sizeof(decoded);
+    if(inflate(&zs, Z_FINISH) != Z_STREAM_END) test_fail("Could not decode test.json.gz.\n");
+    decoded_len = sizeof(decoded) - zs.avail_out;
+    inflateEnd(&zs);
+    if(decoded_len != expected_len || memcmp(decoded, expected, expected_len) != 0) {
+      test_fail("Got: %.*s\nExpecting: %s\n", (int)decoded_len, decoded, expected);
+    }
+    free(compressed);
+
+    compressed = read_file("test.json.z", &compressed_len);
+    zlib_len = sizeof(decoded);
+    if(uncompress((Bytef *)decoded, &zlib_len, (Bytef *)compressed, (uLong)compressed_len) != Z_OK ||
+       zlib_len != expected_len || memcmp(decoded, expected, expected_len) != 0) {
+      test_fail("Could not decode test.json.z.\n");
+    }
+    free(compressed);
+  }
+#endif
+
+#ifdef JSON_HAVE_ZSTD
+  {
+    ZSTD_DCtx *dctx;
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+
+    write_compressed_sample("test.json.zst", JSON_COMPRESS_ZSTD, 3, 50);
 
+    compressed = read_file("test.json.zst", &compressed_len);
+    dctx = ZSTD_createDCtx();
+    in.src = compressed;
+    in.size = compressed_len;
+    in.pos = 0;
+    out.dst = decoded;
+    out.size = sizeof(decoded);
+    out.pos = 0;
+    while(in.pos < in.size) {
+      if(ZSTD_isError(ZSTD_decompressStream(dctx, &out, &in))) {
+        test_fail("Could not decode test.json.zst.\n");
+        break;
+      }
+    }
+    ZSTD_freeDCtx(dctx);
+    if(out.pos != expected_len || memcmp(decoded, expected, expected_len) != 0) {
+      test_fail("Got: %.*s\nExpecting: %s\n", (int)out.pos, decoded, expected);
+    }
+    free(compressed);
+  }
+#endif
+
+  free(expected);
+}
+#endif
+
+
+
+/* Compare the buffered document against the expected text. */
+void test_buffer_contents(json_stream_struct *js, const char *expected) {
+  if(strcmp(js->stream_buffer, expected) != 0) {
+    test_fail("Got: %s\nExpecting: %s\n", js->stream_buffer, expected);
+  }
+}
+
+
+
+void test_string_escaping() {
+  json_stream_struct json_stream;
+  json_stream_struct *js;
+  char long_value[100];
+
+  js = &json_stream;
+  json_init_stream_buffer(js, false, NULL);
+
+  test_json(json_start_object(js), js, NULL);
+  test_json(json_write_pair(js, "say \"hi\"", JSON_STRING, "back\\slash\ttab\nnewline\x01\x1f"), js, NULL);
+  test_json(json_start_array_named(js, "50% \"off\""), js, NULL);
+  test_json(json_write_value(js, JSON_STRING, "caf\xc3\xa9 \x7f"), js, NULL);
+  test_json(json_end_file(js), js, NULL);
+  test_buffer_contents(js, "{\"say \\\"hi\\\"\": \"back\\\\slash\\ttab\\nnewline\\u0001\\u001f\","
+                           "\"50% \\\"off\\\"\": [\"caf\xc3\xa9 \x7f\"]}");
+  json_free_stream(js);
+
+  /* Escapes past the first vector-width block, and escaping switched off. */
+  memset(long_value, 'a', sizeof(long_value) - 1);
+  long_value[sizeof(long_value) - 1] = '\0';
+  long_value[70] = '"';
+  json_init_stream_buffer(js, false, NULL);
+  test_json(json_start_array(js), js, NULL);
+  test_json(json_write_value(js, JSON_STRING, long_value), js, NULL);
+  js->escape_strings = 0;
+  test_json(json_write_value(js, JSON_STRING, "pre-escaped \\\""), js, NULL);
   test_json(json_end_file(js), js, NULL);
+  if(strncmp(js->stream_buffer + 72, "\\\"", 2) != 0 || 
+     strcmp(js->stream_buffer + js->stream_buffer_len - 17, "\"pre-escaped \\\"\"]") != 0) {
+    test_fail("Unexpected escaping: %s\n", js->stream_buffer);
+  }
+  json_free_stream(js);
+}
+
+
+
+void test_utf8() {
+  /* One, two, three and four byte characters, so that every offset into a 
+     vector block is the start of some sequence. */
+  static const char unit[] = "a\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80";
+  const char *strings[] = { "ok", "bad \xff" };
+  json_stream_struct json_stream;
+  json_stream_struct *js;
+  json_key key;
+  char text[201], value[220], expected[240];
+  size_t ii, pos;
+
+  js = &json_stream;
+
+  /* Each maximal subpart of an ill-formed sequence becomes one U+FFFD: a stray
+     continuation, a truncated sequence, overlong forms, a surrogate and a 
+     code point past U+10FFFF. */
+  json_init_stream_buffer(js, false, NULL);
+  json_set_utf8_policy(js, JSON_UTF8_REPLACE);
+  test_json(json_start_object(js), js, NULL);
+  test_json(json_write_pair(js, "k\xc3", JSON_STRING, "\x80|\xe2\x82|\xc0\xaf|\xe0\x80\xaf|\xed\xa0\x80|\xf4\x90\x80\x80|\xf0\x9f\x98\"\xc3\xa9"), js, NULL);
+  test_json(json_key_make(js, &key, "\xff\x01"), js, NULL);
+  test_json(json_write_pair_k(js, &key, JSON_STRING, "\xe2\x82\xac", 3), js, NULL);
+  test_json(json_end_file(js), js, NULL);
+  test_buffer_contents(js, "{\"k\xef\xbf\xbd\": \"\xef\xbf\xbd|\xef\xbf\xbd|\xef\xbf\xbd\xef\xbf\xbd|"
+                           "\xef\xbf\xbd\xef\xbf\xbd\xef\xbf\xbd|\xef\xbf\xbd\xef\xbf\xbd\xef\xbf\xbd|"
+                           "\xef\xbf\xbd\xef\xbf\xbd\xef\xbf\xbd\xef\xbf\xbd|\xef\xbf\xbd\\\"\xc3\xa9\","
+                           "\"\xef\xbf\xbd\\u0001\": \"\xe2\x82\xac\"}");
+  json_key_free(js, &key);
+  json_free_stream(js);
+
+  /* Escaped, each byte of the subpart keeps its value as a code point. */
+  json_init_stream_buffer(js, false, NULL);
+  json_set_utf8_policy(js, JSON_UTF8_ESCAPE);
+  test_json(json_start_array(js), js, NULL);
+  test_json(json_write_value(js, JSON_STRING, "caf\xe9 \xf0\x9f\x98\t\xc3\xa9"), js, NULL);
+  js->escape_strings = 0;
+  test_json(json_write_value(js, JSON_STRING, "\\n\xff"), js, NULL);
+  test_json(json_end_file(js), js, NULL);
+  test_buffer_contents(js, "[\"caf\\u00e9 \\u00f0\\u009f\\u0098\\t\xc3\xa9\",\"\\n\\u00ff\"]");
+  json_free_stream(js);
+
+  /* Long strings, with the error at every offset, go through the vector scans. */
+  for(ii = 0; ii < 200; ++ii) text[ii] = unit[ii % 10];
+  text[200] = '\0';
+  for(pos = 0; pos <= 200; pos += 10) {
+    memcpy(value, text, pos);
+    memcpy(value + pos, "\xf0\x9f", 2);
+    memcpy(value + pos + 2, text + pos, 200 - pos);
+    sprintf(expected, "[\"%.*s\xef\xbf\xbd%s\"]", (int)pos, text, text + pos);
+
+    json_init_stream_buffer(js, false, NULL);
+    json_set_utf8_policy(js, JSON_UTF8_REPLACE);
+    test_json(json_start_array(js), js, NULL);
+    test_json(json_write_value_n(js, JSON_STRING, value, 202), js, NULL);
+    test_json(json_end_file(js), js, NULL);
+    test_buffer_contents(js, expected);
+    json_free_stream(js);
+
+    json_init_stream_buffer(js, false, NULL);
+    json_set_utf8_policy(js, JSON_UTF8_REJECT);
+    test_json(json_start_array(js), js, NULL);
+    test_json(json_write_value_n(js, JSON_STRING, value, 202), js, "Attempted to write a string that is not valid UTF-8.");
+    test_json(json_write_value_n(js, JSON_STRING, text, 200 - pos), js, NULL);
+    json_free_stream(js);
+  }
+
+  /* Rejected calls write nothing at all. */
+  json_init_stream_buffer(js, false, NULL);
+  json_set_utf8_policy(js, JSON_UTF8_REJECT);
+  test_json(json_key_make(js, &key, "\xc3"), js, "Attempted to write a string that is not valid UTF-8.");
+  test_json(json_start_object(js), js, NULL);
+  test_json(json_write_pair(js, "ok", JSON_STRING, "\xe0\x80\x80"), js, "Attempted to write a string that is not valid UTF-8.");
+  test_json(json_write_pair(js, "\xed\xbf\xbf", JSON_NULL, NULL), js, "Attempted to write a string that is not valid UTF-8.");
+  test_json(json_start_array_named(js, "\xf5"), js, "Attempted to write a string that is not valid UTF-8.");
+  test_json(json_write_string_array_named_n(js, "s", 1, strings, NULL, 2), js, "Attempted to write a string that is not valid UTF-8.");
+  test_json(json_write_string_array_named_n(js, "s", 1, strings, NULL, 1), js, NULL);
+  test_json(json_write_pair(js, "\xc3\xa9", JSON_STRING, "\xf4\x8f\xbf\xbf"), js, NULL);
+  test_json(json_end_file(js), js, NULL);
+  test_buffer_contents(js, "{\"s\": [\"ok\"],\"\xc3\xa9\": \"\xf4\x8f\xbf\xbf\"}");
+  json_free_stream(js);
+}
+
+
+
+void test_number_writers() {
+  json_stream_struct json_stream;
+  json_stream_struct *js;
+  double zero = 0.0;
+
+  js = &json_stream;
+  json_init_stream_buffer(js, false, NULL);
+
+  test_json(json_start_object(js), js, NULL);
+  test_json(json_write_pair_int64(js, "min", INT64_MIN), js, NULL);
+  test_json(json_write_pair_uint64(js, "max", UINT64_MAX), js, NULL);
+  test_json(json_write_pair_double(js, "pi", 3.141592653589793), js, NULL);
+  test_json(json_write_pair_double(js, "nan", zero / zero), js, "Attempted to print a number that is not finite.");
+  test_json(json_start_array_named(js, "values"), js, NULL);
+  test_json(json_write_int64(js, 0), js, NULL);
+  test_json(json_write_int64(js, -42), js, NULL);
+  test_json(json_write_uint64(js, 1234567890), js, NULL);
+  test_json(json_write_double(js, 0.1), js, NULL);
+  test_json(json_write_double(js, -0.0), js, NULL);
+  test_json(json_write_double(js, 100), js, NULL);
+  test_json(json_write_double(js, 1e21), js, NULL);
+  test_json(json_write_double(js, 0.000001), js, NULL);
+  test_json(json_write_double(js, 1e-7), js, NULL);
+  test_json(json_write_double(js, 5e-324), js, NULL);
+  test_json(json_write_double(js, 1.7976931348623157e308), js, NULL);
+  test_json(json_write_double(js, 1.0 / zero), js, "Attempted to print a number that is not finite.");
+  test_json(json_end_file(js), js, NULL);
+  test_buffer_contents(js, "{\"min\": -9223372036854775808,\"max\": 18446744073709551615,"
+                           "\"pi\": 3.141592653589793,\"values\": [0,-42,1234567890,0.1,-0,100,"
+                           "1e+21,0.000001,1e-7,5e-324,1.7976931348623157e+308]}");
+  json_free_stream(js);
+}
+
+
+
+void test_length_explicit() {
+  json_stream_struct json_stream;
+  json_stream_struct *js;
+  /* Slices of a single buffer, none of them NUL-terminated. */
+  const char frame[] = "user=alice;items;count=12;ok";
+
+  js = &json_stream;
+  json_init_stream_buffer(js, false, NULL);
+
+  test_json(json_start_object(js), js, NULL);
+  test_json(json_write_pair_n(js, frame, 4, JSON_STRING, frame + 5, 5), js, NULL);
+  test_json(json_write_pair_n(js, frame + 17, 5, JSON_NUMBER, frame + 23, 2), js, NULL);
+  test_json(json_write_pair_int64_n(js, frame + 17, 3, 7), js, NULL);
+  test_json(json_start_array_named_n(js, frame + 11, 5), js, NULL);
+  test_json(json_write_value_n(js, JSON_STRING, frame + 26, 2), js, NULL);
+  test_json(json_write_value_n(js, JSON_TRUE, NULL, 0), js, NULL);
+  test_json(json_end_context(js), js, NULL);
+  test_json(json_start_object_named_n(js, frame + 5, 3), js, NULL);
+  test_json(json_end_file(js), js, NULL);
+  test_buffer_contents(js, "{\"user\": \"alice\",\"count\": 12,\"cou\": 7,"
+                           "\"items\": [\"ok\",true],\"ali\": {}}");
+  json_free_stream(js);
+}
+
+
+
+void test_keys() {
+  static const json_key id_key = JSON_KEY("id");
+  json_stream_struct json_stream;
+  json_stream_struct *js;
+  json_key quoted_key, list_key;
+
+  js = &json_stream;
+  json_init_stream_buffer(js, false, NULL);
+  test_json(json_key_make(js, &quoted_key, "say \"hi\""), js, NULL);
+  test_json(json_key_make(js, &list_key, "list"), js, NULL);
+
+  test_json(json_start_object(js), js, NULL);
+  test_json(json_write_pair_int64_k(js, &id_key, 7), js, NULL);
+  test_json(json_write_pair_k(js, &quoted_key, JSON_STRING, "hello", 5), js, NULL);
+  test_json(json_start_object_named_k(js, &id_key), js, NULL);
+  test_json(json_write_pair_double_k(js, &quoted_key, 0.5), js, NULL);
+  test_json(json_write_pair_uint64_k(js, &list_key, 1), js, NULL);
+  test_json(json_end_context(js), js, NULL);
+  test_json(json_start_array_named_k(js, &list_key), js, NULL);
+  test_json(json_write_pair_k(js, &id_key, JSON_NULL, NULL, 0), js, "Attempted to print a name: value pair outside an object context.");
+  test_json(json_end_file(js), js, NULL);
+  test_buffer_contents(js, "{\"id\": 7,\"say \\\"hi\\\"\": \"hello\",\"id\": {\"say \\\"hi\\\"\": 0.5,"
+                           "\"list\": 1},\"list\": []}");
+
+  json_key_free(js, &quoted_key);
+  json_key_free(js, &list_key);
+  json_free_stream(js);
+}
+
+
+
+void test_raw() {
+  static const json_key cached_key = JSON_KEY("cached");
+  /* Each must pass json_validate_raw, or fail it. */
+  static const char *const valid[] = {
+    "0", "-0.5e+10", "1E3", " true ", "null", "\"\"", "\"\\u00e9\\n\\/\"", "\"caf\xc3\xa9 \xf0\x9f\x98\x80\"",
+    "[]", "{}", "[1,[2,{\"a\":[]}],\"x\"]", "{ \"a\" : { \"b\" : null } ,\"c\":[ ] }\n"
+  };
+  static const char *const invalid[] = {
+    "", " ", "01", "1.", "-", "1e", ".5", "+1", "tru", "nul", "truex", "\"open", "\"bad \\x\"", 
+    "\"\\u12g4\"", "\"tab\t\"", "\"\xc3\"", "\"\xc0\xaf\"", "\"\xed\xa0\x80\"", "\"\xf4\x90\x80\x80\"",
+    "[1,]", "[1 2]", "{\"a\"}", "{\"a\":1,}", "{1:2}", "[}", "{]", "[1]]", "1 2", "[", "{\"a\":"
+  };
+  json_stream_struct json_stream;
+  json_stream_struct *js;
+  char long_raw[200];
+  char deep_raw[2 * MAX_JSON_NESTED_DEPTH + 2];
+  size_t ii;
+
+  for(ii = 0; ii < sizeof(valid) / sizeof(valid[0]); ++ii) {
+    if(json_validate_raw(valid[ii], strlen(valid[ii])) != 0) test_fail("Rejected valid raw JSON: %s\n", valid[ii]);
+  }
+  for(ii = 0; ii < sizeof(invalid) / sizeof(invalid[0]); ++ii) {
+    if(json_validate_raw(invalid[ii], strlen(invalid[ii])) == 0) test_fail("Accepted invalid raw JSON: %s\n", invalid[ii]);
+  }
+
+  /* A string long enough for the vectorized scan, with an escape and a 
+     multibyte character past the first block, and one with a raw newline there. */
+  memset(long_raw, 'a', sizeof(long_raw));
+  long_raw[0] = '"';
+  memcpy(long_raw + 100, "\\\"\xe2\x82\xac", 5);
+  long_raw[sizeof(long_raw) - 1] = '"';
+  if(json_validate_raw(long_raw, sizeof(long_raw)) != 0) test_fail("Rejected a long valid string.\n");
+  long_raw[150] = '\n';
+  if(json_validate_raw(long_raw, sizeof(long_raw)) == 0) test_fail("Accepted a long string with a control character.\n");
+
+  js = &json_stream;
+  json_init_stream_buffer(js, false, NULL);
+  test_json(json_start_object(js), js, NULL);
+  test_json(json_write_raw_pair(js, "profile", "{\"name\": \"Possum\", \"tags\": [1, 2]}", 34, true), js, NULL);
+  test_json(json_write_raw_pair_n(js, "trusted!", 7, "[true]", 6, false), js, NULL);
+  test_json(json_write_raw_pair_k(js, &cached_key, "\"x\"", 3, true), js, NULL);
+  test_json(json_write_raw_pair_n(js, "bad", 3, "{\"a\":}", 6, true), js, "Attempted to splice raw JSON that is not a single valid value.");
+  test_json(json_write_raw_pair_n(js, "empty", 5, "", 0, false), js, "Attempted to splice raw JSON that is not a single valid value.");
+  test_json(json_write_raw_value(js, "1", 1, true), js, "Attempted to print a single value outside an array context.");
+  test_json(json_start_array_named(js, "list"), js, NULL);
+  test_json(json_write_raw_value(js, "null", 4, true), js, NULL);
+  test_json(json_write_int64(js, 2), js, NULL);
+  test_json(json_write_raw_value(js, " {} ", 4, true), js, NULL);
+  test_json(json_write_raw_pair_n(js, "a", 1, "1", 1, true), js, "Attempted to print a name: value pair outside an object context.");
+  test_json(json_end_file(js), js, NULL);
+  test_buffer_contents(js, "{\"profile\": {\"name\": \"Possum\", \"tags\": [1, 2]},\"trusted\": [true],"
+                           "\"cached\": \"x\",\"list\": [null,2, {} ]}");
+  json_free_stream(js);
+
+  /* Validated raw JSON counts against the depth limit from where it is spliced. */
+  for(ii = 0; ii < MAX_JSON_NESTED_DEPTH; ++ii) {
+    deep_raw[ii] = '[';
+    deep_raw[2 * MAX_JSON_NESTED_DEPTH - 1 - ii] = ']';
+  }
+  if(json_validate_raw(deep_raw, 2 * MAX_JSON_NESTED_DEPTH) != 0) test_fail("Rejected raw JSON at the depth limit.\n");
+  deep_raw[2 * MAX_JSON_NESTED_DEPTH] = '\0';
+  json_init_stream_buffer(js, false, NULL);
+  test_json(json_start_array(js), js, NULL);
+  test_json(json_write_raw_value(js, deep_raw, 2 * MAX_JSON_NESTED_DEPTH, true), js, 
+            "Attempted to nest objects and arrays deeper than the depth limit.");
+  test_json(json_write_raw_value(js, deep_raw + 1, 2 * MAX_JSON_NESTED_DEPTH - 2, true), js, NULL);
+  test_json(json_end_file(js), js, NULL);
+  if(js->stream_buffer_len != 2 * MAX_JSON_NESTED_DEPTH) test_fail("Unexpected length %zu after a deep splice.\n", js->stream_buffer_len);
+  json_free_stream(js);
+}
+
+
+
+void test_indentation() {
+  json_stream_struct json_stream;
+  json_stream_struct *js;
+  char expected[4000];
+  int ii, jj, depth;
+
+  js = &json_stream;
+
+  /* A token longer than the old fixed limit. */
+  json_init_stream_buffer(js, true, NULL);
+  test_json(json_set_indent(js, "<indent-token>"), js, NULL);
+  test_json(json_start_object(js), js, NULL);
+  test_json(json_write_pair(js, "a", JSON_TRUE, NULL), js, NULL);
+  test_json(json_end_file(js), js, NULL);
+  test_buffer_contents(js, "{\n<indent-token>\"a\": true\n}");
+  json_free_stream(js);
+
+  /* Nesting deeper than the initial run. */
+  depth = 40;
+  json_init_stream_buffer(js, true, NULL);
+  test_json(json_set_indent(js, "\t"), js, NULL);
+  strcpy(expected, "");
+  for(ii = 0; ii < depth; ++ii) {
+    test_json(json_start_array(js), js, NULL);
+    if(ii > 0) strcat(expected, "\n");
+    for(jj = 0; jj < ii; ++jj) strcat(expected, "\t");
+    strcat(expected, "[");
+  }
+  test_json(json_end_file(js), js, NULL);
+  for(ii = depth - 1; ii >= 0; --ii) {
+    strcat(expected, "\n");
+    for(jj = 0; jj < ii; ++jj) strcat(expected, "\t");
+    strcat(expected, "]");
+  }
+  test_buffer_contents(js, expected);
+  json_free_stream(js);
+}
+
+
+
+void test_bulk_arrays() {
+  static const json_key flags_key = JSON_KEY("flags");
+  const int64_t ints[] = { 1, -2, 300 };
+  const double doubles[] = { 0.5, 2, -1e-9 };
+  const int bools[] = { 1, 0 };
+  const char *strings[] = { "a", "say \"b\"", "cdef" };
+  const size_t lengths[] = { 1, 7, 2 };
+  double zero = 0.0;
+  double bad_doubles[2];
+  json_stream_struct json_stream;
+  json_stream_struct *js;
+
+  js = &json_stream;
+  json_init_stream_buffer(js, false, NULL);
+
+  test_json(json_start_array(js), js, NULL);
+  test_json(json_write_int64_array(js, ints, 3), js, NULL);
+  test_json(json_write_double_array(js, doubles, 3), js, NULL);
+  test_json(json_write_bool_array(js, bools, 0), js, NULL);
+  test_json(json_write_string_array(js, strings, NULL, 3), js, NULL);
+  test_json(json_write_int64_array_named_n(js, "n", 1, ints, 3), js, "Attempted to open a named array outside an object context.");
+  test_json(json_start_object(js), js, NULL);
+  test_json(json_write_int64_array(js, ints, 3), js, "Attempted to open an array when not starting a file or in array context.");
+  test_json(json_write_string_array_named_n(js, "s", 1, strings, lengths, 3), js, NULL);
+  test_json(json_write_bool_array_named_k(js, &flags_key, bools, 2), js, NULL);
+  bad_doubles[0] = 1.0;
+  bad_doubles[1] = zero / zero;
+  test_json(json_write_double_array_named_k(js, &flags_key, bad_doubles, 2), js, "Attempted to print a number that is not finite.");
+  test_json(json_end_file(js), js, NULL);
+  test_buffer_contents(js, "[[1,-2,300],[0.5,2,-1e-9],[],[\"a\",\"say \\\"b\\\"\",\"cdef\"],"
+                           "{\"s\": [\"a\",\"say \\\"b\\\"\",\"cd\"],\"flags\": [true,false]}]");
+  json_free_stream(js);
+
+  /* Pretty printing indents each element. */
+  json_init_stream_buffer(js, true, NULL);
+  test_json(json_write_int64_array(js, ints, 2), js, NULL);
+  test_json(json_end_file(js), js, NULL);
+  test_buffer_contents(js, "[\n  1,\n  -2\n]");
+  json_free_stream(js);
+}
+
+
+
+struct test_record {
+  int32_t id;
+  uint8_t level;
+  double score;
+  float ratio;
+  char alive;
+  const char *name;
+  char code[4];
+};
+
+/* Write the records one pair at a time, as json_write_struct_array should. */
+void write_records_by_hand(json_stream_struct *js, const struct test_record *records, size_t count) {
+  char code[5];
+  size_t ii;
+
+  test_json(json_start_array_named_n(js, "records", 7), js, NULL);
+  for(ii = 0; ii < count; ++ii) {
+    test_json(json_start_object(js), js, NULL);
+    test_json(json_write_pair_int64_n(js, "id", 2, records[ii].id), js, NULL);
+    test_json(json_write_pair_uint64_n(js, "level", 5, records[ii].level), js, NULL);
+    test_json(json_write_pair_double_n(js, "score", 5, records[ii].score), js, NULL);
+    test_json(json_write_pair_double_n(js, "ratio", 5, records[ii].ratio), js, NULL);
+    test_json(json_write_pair_n(js, "alive", 5, records[ii].alive ? JSON_TRUE : JSON_FALSE, NULL, 0), js, NULL);
+    if(records[ii].name) {
+      test_json(json_write_pair_n(js, "name", 4, JSON_STRING, records[ii].name, strlen(records[ii].name)), js, NULL);
+    } else {
+      test_json(json_write_pair_n(js, "name", 4, JSON_NULL, NULL, 0), js, NULL);
+    }
+    memcpy(code, records[ii].code, 4);
+    code[4] = '\0';
+    test_json(json_write_pair_n(js, "code", 4, JSON_STRING, code, strlen(code)), js, NULL);
+    test_json(json_end_context(js), js, NULL);
+  }
+  test_json(json_end_context(js), js, NULL);
+}
+
+
+
+void test_struct_arrays() {
+  static const json_field fields[] = {
+    JSON_FIELD(struct test_record, id, JSON_FIELD_INT),
+    JSON_FIELD(struct test_record, level, JSON_FIELD_UINT),
+    JSON_FIELD(struct test_record, score, JSON_FIELD_DOUBLE),
+    JSON_FIELD(struct test_record, ratio, JSON_FIELD_DOUBLE),
+    JSON_FIELD(struct test_record, alive, JSON_FIELD_BOOL),
+    JSON_FIELD(struct test_record, name, JSON_FIELD_STRING),
+    JSON_FIELD(struct test_record, code, JSON_FIELD_CHARS)
+  };
+  static const json_field bad_field = { "bad", 0, JSON_FIELD_INT, 3 };
+  static const json_key records_key = JSON_KEY("records");
+  struct test_record records[3] = {
+    { -7, 200, 0.1, 0.5f, 1, "first \"one\"", "AB" },
+    { 2147483647, 0, -1e300, 0.25f, 0, NULL, "WXYZ" },
+    { 0, 1, 3, -2.0f, 2, "", "" }
+  };
+  json_stream_struct json_stream, expected_stream;
+  json_stream_struct *js, *expected;
+  json_struct_desc desc, bad_desc;
+  json_sink sink;
+  counting_sink cs;
+  char written[4096];
+  size_t len;
+  double zero = 0.0;
+  int human_readable, ii;
+
+  js = &json_stream;
+  expected = &expected_stream;
+  for(human_readable = 0; human_readable <= 1; ++human_readable) {
+    json_init_stream_buffer(js, human_readable, NULL);
+    json_init_stream_buffer(expected, human_readable, NULL);
+    test_json(json_struct_desc_make(js, &desc, fields, sizeof(fields) / sizeof(fields[0])), js, NULL);
+
+    test_json(json_start_object(js), js, NULL);
+    test_json(json_write_struct_array_named_k(js, &records_key, &desc, records, 3, sizeof(records[0])), js, NULL);
+    test_json(json_write_struct_array(js, &desc, records, 3, sizeof(records[0])), js, "Attempted to open an array when not starting a file or in array context.");
+    test_json(json_end_file(js), js, NULL);
+
+    test_json(json_start_object(expected), expected, NULL);
+    write_records_by_hand(expected, records, 3);
+    test_json(json_end_file(expected), expected, NULL);
+    test_buffer_contents(js, expected->stream_buffer);
+
+    json_struct_desc_free(js, &desc);
+    json_free_stream(js);
+    json_free_stream(expected);
+  }
+
+  /* Nested 15 deep and unbuffered, the records' objects are indented by the 
+     whole default run, and their members need a longer one in the same call. */
+  cs.out = fopen("test_struct_sink.json", "w+b");
+  cs.writes = 0;
+  cs.gathered_writes = 0;
+  sink.write = counting_sink_write;
+  sink.writev = counting_sink_writev;
+  sink.flush = NULL;
+  sink.user = &cs;
+  json_init_stream_sink(js, true, &sink);
+  json_set_flush_threshold(js, 0);
+  json_init_stream_buffer(expected, true, NULL);
+  test_json(json_struct_desc_make(js, &desc, fields, sizeof(fields) / sizeof(fields[0])), js, NULL);
+  for(ii = 0; ii < 14; ++ii) {
+    test_json(json_start_array(js), js, NULL);
+    test_json(json_start_array(expected), expected, NULL);
+  }
+  test_json(json_start_object(js), js, NULL);
+  test_json(json_write_struct_array_named_k(js, &records_key, &desc, records, 3, sizeof(records[0])), js, NULL);
+  test_json(json_end_file(js), js, NULL);
+  test_json(json_start_object(expected), expected, NULL);
+  write_records_by_hand(expected, records, 3);
+  test_json(json_end_file(expected), expected, NULL);
+  rewind(cs.out);
+  len = fread(written, 1, sizeof(written) - 1, cs.out);
+  written[len] = '\0';
+  if(strcmp(written, expected->stream_buffer) != 0) {
+    test_fail("Got: %s\nExpecting: %s\n", written, expected->stream_buffer);
+  }
+  fclose(cs.out);
+  json_struct_desc_free(js, &desc);
+  json_free_stream(js);
+  json_free_stream(expected);
+
+  /* Every other record, with a stride, and descriptors with no fields. */
+  json_init_stream_buffer(js, false, NULL);
+  test_json(json_struct_desc_make(js, &desc, fields, 1), js, NULL);
+  test_json(json_struct_desc_make(js, &bad_desc, fields, 0), js, NULL);
+  test_json(json_start_array(js), js, NULL);
+  test_json(json_write_struct_array(js, &desc, records, 2, 2 * sizeof(records[0])), js, NULL);
+  test_json(json_write_struct_array(js, &bad_desc, records, 2, sizeof(records[0])), js, NULL);
+  test_json(json_write_struct_array(js, &desc, records, 0, sizeof(records[0])), js, NULL);
+  test_json(json_end_file(js), js, NULL);
+  test_buffer_contents(js, "[[{\"id\": -7},{\"id\": 0}],[{},{}],[]]");
+  json_struct_desc_free(js, &desc);
+  json_struct_desc_free(js, &bad_desc);
+  json_free_stream(js);
+
+  json_init_stream_buffer(js, false, NULL);
+  test_json(json_struct_desc_make(js, &bad_desc, &bad_field, 1), js, "Attempted to describe a struct field of an invalid type or size.");
+  test_json(json_struct_desc_make(js, &desc, fields, sizeof(fields) / sizeof(fields[0])), js, NULL);
+  records[1].score = zero / zero;
+  test_json(json_write_struct_array(js, &desc, records, 3, sizeof(records[0])), js, "Attempted to print a number that is not finite.");
+  test_json(json_start_array(js), js, NULL); /* Nothing was written. */
+  json_struct_desc_free(js, &desc);
+  json_free_stream(js);
+}
+
+
+
+/* Write elements first through last of a test array: a mix of values and 
+   nested contexts. */
+void write_fragment_elements(json_stream_struct *js, int first, int last) {
+  int ii;
+
+  for(ii = first; ii <= last; ++ii) {
+    if(ii % 3 == 0) {
+      test_json(json_start_object(js), js, NULL);
+      test_json(json_write_pair_int64_n(js, "n", 1, ii), js, NULL);
+      test_json(json_start_array_named_n(js, "list", 4), js, NULL);
+      test_json(json_write_int64(js, ii), js, NULL);
+      test_json(json_end_context(js), js, NULL);
+      test_json(json_end_context(js), js, NULL);
+    } else {
+      test_json(json_write_int64(js, ii), js, NULL);
+    }
+  }
+}
+
+
+
+/* Write the record the template in test_templates describes, with direct calls. */
+void write_template_record(json_stream_struct *js, int64_t id, const char *name, double score, int active) {
+  test_json(json_start_object(js), js, NULL);
+  test_json(json_write_pair_int64(js, "id", id), js, NULL);
+  test_json(json_write_pair(js, "kind", JSON_STRING, "user"), js, NULL);
+  test_json(json_start_object_named(js, "detail"), js, NULL);
+  if(name) {
+    test_json(json_write_pair_n(js, "name", 4, JSON_STRING, name, strlen(name)), js, NULL);
+  } else {
+    test_json(json_write_pair_n(js, "name", 4, JSON_NULL, NULL, 0), js, NULL);
+  }
+  test_json(json_start_array_named(js, "stats"), js, NULL);
+  test_json(json_write_double(js, score), js, NULL);
+  test_json(json_write_value(js, active ? JSON_TRUE : JSON_FALSE, NULL), js, NULL);
+  test_json(json_start_array(js), js, NULL);
+  test_json(json_end_context(js), js, NULL);
+  test_json(json_end_context(js), js, NULL);
+  test_json(json_end_context(js), js, NULL);
+  test_json(json_end_context(js), js, NULL);
+}
+
+
+
+void test_templates() {
+  static const json_key name_key = JSON_KEY("name");
+  json_stream_struct json_stream, direct_stream;
+  json_stream_struct *js, *direct;
+  json_template tpl;
+  json_hole_value values[4];
+  int human_readable, ii;
+
+  for(human_readable = 0; human_readable <= 1; ++human_readable) {
+    json_template_begin(&tpl, human_readable, NULL);
+    js = &tpl.rec;
+    test_json(json_start_object(js), js, NULL);
+    test_json(json_template_pair_hole(&tpl, "id", JSON_FIELD_INT), js, NULL);
+    test_json(json_write_pair(js, "kind", JSON_STRING, "user"), js, NULL);
+    test_json(json_start_object_named(js, "detail"), js, NULL);
+    test_json(json_template_pair_hole_k(&tpl, &name_key, JSON_FIELD_STRING), js, NULL);
+    test_json(json_template_hole(&tpl, JSON_FIELD_INT), js, "Attempted to print a single value outside an array context.");
+    test_json(json_start_array_named(js, "stats"), js, NULL);
+    test_json(json_template_hole(&tpl, JSON_FIELD_DOUBLE), js, NULL);
+    test_json(json_template_hole(&tpl, JSON_FIELD_BOOL), js, NULL);
+    test_json(json_template_hole(&tpl, JSON_FIELD_CHARS), js, "Attempted to add a template hole of an invalid type.");
+    test_json(json_start_array(js), js, NULL);
+    test_json(json_end_context(js), js, NULL);
+    test_json(json_end_file(js), js, NULL);
+    /* The failed calls above were deliberate, and wrote nothing. */
+    js->error_code = JSON_OK;
+    test_json(json_template_end(&tpl), js, NULL);
+    if(tpl.hole_count != 4 || tpl.depth != 4 || tpl.root != JSON_OBJECT) {
+      test_fail("Unexpected template: %d holes, depth %d\n", (int)tpl.hole_count, tpl.depth);
+    }
+
+    /* Written at the top level and as elements of an array, which in human 
+       readable mode shifts the template's indentation. */
+    js = &json_stream;
+    direct = &direct_stream;
+    json_init_stream_buffer(js, human_readable, NULL);
+    json_init_stream_buffer(direct, human_readable, NULL);
+    js->retain_buffer = 1;
+    direct->retain_buffer = 1;
+    test_json(json_start_array(js), js, NULL);
+    test_json(json_start_array(direct), direct, NULL);
+    for(ii = 0; ii < 3; ++ii) {
+      values[0].as.i = -ii;
+      values[1].as.str = ii == 1 ? NULL : "Sam \"the\" possum";
+      values[1].len = ii == 2 ? 3 : strlen("Sam \"the\" possum");
+      values[2].as.d = 0.5 * ii;
+      values[3].as.b = ii & 1;
+      test_json(json_write_template(js, &tpl, values), js, NULL);
+      write_template_record(direct, -ii, ii == 1 ? NULL : ii == 2 ? "Sam" : "Sam \"the\" possum", 0.5 * ii, ii & 1);
+    }
+    test_json(json_end_file(js), js, NULL);
+    test_json(json_end_file(direct), direct, NULL);
+    test_buffer_contents(js, direct->stream_buffer);
+    json_free_stream(js);
+    json_free_stream(direct);
+
+    /* A document of its own, then nothing may follow it. */
+    json_init_stream_buffer(js, human_readable, NULL);
+    json_init_stream_buffer(direct, human_readable, NULL);
+    test_json(json_write_template(js, &tpl, values), js, NULL);
+    write_template_record(direct, -2, "Sam", 1.0, 0);
+    test_buffer_contents(js, direct->stream_buffer);
+    test_json(json_write_template(js, &tpl, values), js, "Attempted to open an object when file is already complete.");
+    json_free_stream(js);
+    json_free_stream(direct);
+    json_template_free(&tpl);
+  }
+
+  /* Records, and the checks made before anything is written. */
+  json_template_begin(&tpl, false, NULL);
+  test_json(json_start_array(&tpl.rec), &tpl.rec, NULL);
+  test_json(json_template_hole(&tpl, JSON_FIELD_UINT), &tpl.rec, NULL);
+  test_json(json_template_hole(&tpl, JSON_FIELD_DOUBLE), &tpl.rec, NULL);
+  test_json(json_template_end(&tpl), &tpl.rec, "Attempted to finish or write a template that is not one complete object or array.");
+  js = &json_stream;
+  json_init_stream_buffer(js, false, NULL);
+  js->retain_buffer = 1;
+  json_set_record_mode(js, true, 0);
+  test_json(json_write_template(js, &tpl, values), js, "Attempted to finish or write a template that is not one complete object or array.");
+  test_json(json_end_context(&tpl.rec), &tpl.rec, NULL);
+  tpl.rec.error_code = JSON_OK;
+  test_json(json_template_end(&tpl), &tpl.rec, NULL);
+  values[0].as.u = UINT64_MAX;
+  values[1].as.d = 1.0 / (values[2].as.d - values[2].as.d);
+  test_json(json_write_template(js, &tpl, values), js, "Attempted to print a number that is not finite.");
+  values[1].as.d = 2.5;
+  test_json(json_write_template(js, &tpl, values), js, NULL);
+  values[0].as.u = 0;
+  test_json(json_write_template(js, &tpl, values), js, NULL);
+  test_buffer_contents(js, "[18446744073709551615,2.5]\n[0,2.5]\n");
+  json_free_stream(js);
+  json_template_free(&tpl);
+}
+
+
+
+void test_fragments() {
+  json_stream_struct json_stream, expected_stream, fragments[3];
+  json_stream_struct *js, *expected;
+  int human_readable, ii;
+
+  js = &json_stream;
+  expected = &expected_stream;
+  for(human_readable = 0; human_readable <= 1; ++human_readable) {
+    json_init_stream_buffer(js, human_readable, NULL);
+    json_init_stream_buffer(expected, human_readable, NULL);
+    test_json(json_set_indent(js, "\t"), js, NULL);
+    test_json(json_set_indent(expected, "\t"), expected, NULL);
+
+    /* Fragments for an array nested two levels down, following an element the 
+       parent wrote itself. The middle fragment stays empty. */
+    test_json(json_start_object(js), js, NULL);
+    test_json(json_start_array_named_n(js, "records", 7), js, NULL);
+    write_fragment_elements(js, 0, 0);
+    for(ii = 0; ii < 3; ++ii) test_json(json_init_fragment(&fragments[ii], js), &fragments[ii], NULL);
+    write_fragment_elements(&fragments[2], 6, 9);
+    write_fragment_elements(&fragments[0], 1, 5);
+    test_json(json_end_context(&fragments[0]), &fragments[0], "Attempted to close a context the fragment did not open.");
+    for(ii = 0; ii < 3; ++ii) test_json(json_splice_fragment(js, &fragments[ii]), js, NULL);
+
+    /* Spliced fragments are emptied and can be filled again. */
+    write_fragment_elements(&fragments[0], 10, 10);
+    test_json(json_end_file(&fragments[0]), &fragments[0], NULL);
+    test_json(json_splice_fragment(js, &fragments[0]), js, NULL);
+    test_json(json_end_file(js), js, NULL);
+
+    test_json(json_start_object(expected), expected, NULL);
+    test_json(json_start_array_named_n(expected, "records", 7), expected, NULL);
+    write_fragment_elements(expected, 0, 10);
+    test_json(json_end_file(expected), expected, NULL);
+    test_buffer_contents(js, expected->stream_buffer);
+
+    for(ii = 0; ii < 3; ++ii) json_free_stream(&fragments[ii]);
+    json_free_stream(js);
+    json_free_stream(expected);
+  }
+
+  /* Fragments must start in an array and be spliced complete, at their depth. */
+  json_init_stream_buffer(js, false, NULL);
+  test_json(json_start_object(js), js, NULL);
+  test_json(json_init_fragment(&fragments[0], js), &fragments[0], "Attempted to start a fragment outside an array context.");
+  json_free_stream(&fragments[0]);
+  test_json(json_start_array_named_n(js, "a", 1), js, NULL);
+  test_json(json_init_fragment(&fragments[0], js), &fragments[0], NULL);
+  test_json(json_start_array(&fragments[0]), &fragments[0], NULL);
+  test_json(json_write_pair_int64_n(&fragments[0], "n", 1, 1), &fragments[0], "Attempted to print a name: value pair outside an object context.");
+  test_json(json_splice_fragment(js, &fragments[0]), js, "Attempted to splice a fragment with open contexts.");
+  test_json(json_end_context(&fragments[0]), &fragments[0], NULL);
+  test_json(json_start_array(js), js, NULL);
+  test_json(json_splice_fragment(js, &fragments[0]), js, "Attempted to splice a fragment at a different depth than it was started.");
+  test_json(json_end_context(js), js, NULL);
+  test_json(json_splice_fragment(js, &fragments[0]), js, NULL);
+  test_json(json_end_file(js), js, NULL);
+  test_buffer_contents(js, "{\"a\": [[],[]]}");
+  json_free_stream(&fragments[0]);
+  json_free_stream(js);
+
+  /* Fragments keep the parent's depth limit. */
+  json_init_stream_buffer(js, false, NULL);
+  test_json(json_set_max_depth(js, 3), js, NULL);
+  test_json(json_start_array(js), js, NULL);
+  test_json(json_init_fragment(&fragments[0], js), &fragments[0], NULL);
+  test_json(json_start_array(&fragments[0]), &fragments[0], NULL);
+  test_json(json_start_array(&fragments[0]), &fragments[0], NULL);
+  test_json(json_start_array(&fragments[0]), &fragments[0], "Attempted to nest objects and arrays deeper than the depth limit.");
+  json_free_stream(&fragments[0]);
+  json_free_stream(js);
+}
+
+
+
+void test_record_mode() {
+  const int64_t ints[] = { 1, 2 };
+  json_stream_struct json_stream;
+  json_stream_struct *js;
+  json_sink sink;
+  counting_sink cs;
+  int ii;
+
+  js = &json_stream;
+  json_init_stream_buffer(js, false, NULL);
+  json_set_record_mode(js, true, 0);
+  test_json(json_start_object(js), js, NULL);
+  test_json(json_write_pair_int64_n(js, "a", 1, 1), js, NULL);
+  test_json(json_end_context(js), js, NULL);
+  test_json(json_write_int64_array(js, ints, 2), js, NULL);
+  test_json(json_start_object(js), js, NULL);
+  test_json(json_start_array_named_n(js, "b", 1), js, NULL);
+  test_json(json_end_file(js), js, NULL);
+  test_json(json_start_array(js), js, NULL);
+  test_json(json_end_context(js), js, NULL);
+  test_json(json_end_context(js), js, "Attempted to close a context when none is open.");
+  test_json(json_end_file(js), js, NULL);
+  test_buffer_contents(js, "{\"a\": 1}\n[1,2]\n{\"b\": []}\n[]\n");
+  json_free_stream(js);
+
+  /* Five records, flushed in batches of two, reach the sink in three writes. */
+  cs.out = fopen("test_records.json", "w");
+  cs.writes = 0;
+  cs.gathered_writes = 0;
+  sink.write = counting_sink_write;
+  sink.writev = counting_sink_writev;
+  sink.flush = NULL;
+  sink.user = &cs;
+  json_init_stream_sink(js, false, &sink);
+  json_set_record_mode(js, true, 2);
+  for(ii = 0; ii < 5; ++ii) {
+    test_json(json_start_object(js), js, NULL);
+    test_json(json_write_pair_int64_n(js, "n", 1, ii), js, NULL);
+    test_json(json_end_context(js), js, NULL);
+  }
+  if(cs.writes != 2) test_fail("Expected 2 writes before the end, got %d.\n", cs.writes);
+  test_json(json_end_file(js), js, NULL);
+  if(cs.writes != 3) test_fail("Expected 3 writes, got %d.\n", cs.writes);
+  json_free_stream(js);
+  fclose(cs.out);
+}
+
+
+
+/* Write a document with long escaped strings for test_pull. Returns the number
+   of calls made; when pulled is not NULL, output is pulled after every call, 
+   chunk characters at a time with json_pull, or through json_pull_data and 
+   json_pull_consume when chunk is 0. */
+int write_pull_document(json_stream_struct *js, char *pulled, size_t chunk) {
+  char text[300];
+  const char *data;
+  size_t len, pulled_len;
+  int calls, ii;
+
+  for(ii = 0; ii < (int)sizeof(text) - 1; ++ii) text[ii] = ii % 7 == 6 ? '"' : (char)('a' + ii % 26);
+  text[sizeof(text) - 1] = '\0';
+
+  pulled_len = 0;
+  for(calls = 0; calls < 42; ++calls) {
+    if(calls == 0) {
+      test_json(json_start_array(js), js, NULL);
+    } else if(calls == 41) {
+      test_json(json_end_file(js), js, NULL);
+    } else if(calls % 2) {
+      test_json(json_write_value_n(js, JSON_STRING, text, (size_t)calls * 7), js, NULL);
+    } else {
+      test_json(json_write_int64(js, calls), js, NULL);
+    }
+    if(!pulled) continue;
+
+    /* Take everything this call wrote, in pieces. Consume odd amounts of it to
+       split strings and escapes at every possible point. */
+    while(json_pull_pending(js) > 0) {
+      if(chunk) {
+        len = json_pull(js, pulled + pulled_len, chunk);
+      } else {
+        data = json_pull_data(js, &len);
+        if(len > 3 + (size_t)calls % 5) len = 3 + (size_t)calls % 5;
+        memcpy(pulled + pulled_len, data, len);
+        json_pull_consume(js, len);
+      }
+      pulled_len += len;
+    }
+    pulled[pulled_len] = '\0';
+
+    /* Pulled output no longer occupies the buffer. */
+    if(js->stream_buffer_len > 1000) test_fail("Buffer holds %d characters after pulling.\n", (int)js->stream_buffer_len);
+  }
+  return calls;
+}
+
+
+
+void test_pull() {
+  json_stream_struct json_stream, expected_stream;
+  json_stream_struct *js, *expected;
+  char *pulled;
+  size_t chunks[] = { 1, 7, 64, 0 };
+  int human_readable, ii;
+
+  js = &json_stream;
+  expected = &expected_stream;
+  pulled = (char *)malloc(100000);
+  for(human_readable = 0; human_readable <= 1; ++human_readable) {
+    json_init_stream_buffer(expected, human_readable, NULL);
+    write_pull_document(expected, NULL, 0);
+    for(ii = 0; ii < (int)(sizeof(chunks) / sizeof(chunks[0])); ++ii) {
+      json_init_stream_buffer(js, human_readable, NULL);
+      write_pull_document(js, pulled, chunks[ii]);
+      if(strcmp(pulled, expected->stream_buffer) != 0) {
+        test_fail("Pulling in chunks of %d, got: \"%s\", Expecting: \"%s\"\n", (int)chunks[ii], pulled, expected->stream_buffer);
+      }
+      if(json_pull(js, pulled, 10) != 0) test_fail("Output left after the document was pulled.\n");
+      json_free_stream(js);
+    }
+    json_free_stream(expected);
+  }
+
+  /* Output can also be left to accumulate and be pulled all at once. */
+  json_init_stream_buffer(js, false, NULL);
+  test_json(json_start_array(js), js, NULL);
+  test_json(json_write_value(js, JSON_STRING, "a\tb"), js, NULL);
+  if(json_pull(js, pulled, 4) != 4 || strncmp(pulled, "[\"a\\", 4) != 0) test_fail("Unexpected first chunk.\n");
+  test_json(json_end_file(js), js, NULL);
+  if(json_pull(js, pulled, 100) != 4 || strncmp(pulled, "tb\"]", 4) != 0) test_fail("Unexpected second chunk.\n");
+  json_free_stream(js);
+  free(pulled);
+}
+
+
+
+
+/* Compare the buffered output against expected bytes, which may contain NULs. */
+void test_buffer_bytes(json_stream_struct *js, const char *expected, size_t len) {
+  size_t ii;
+
+  if(js->stream_buffer_len == len && memcmp(js->stream_buffer, expected, len) == 0) return;
+  test_fail("Got %d bytes:", (int)js->stream_buffer_len);
+  for(ii = 0; ii < js->stream_buffer_len && ii < 80; ++ii) printf(" %02x", (unsigned char)js->stream_buffer[ii]);
+  printf("\nExpecting %d bytes:", (int)len);
+  for(ii = 0; ii < len && ii < 80; ++ii) printf(" %02x", (unsigned char)expected[ii]);
+  printf("\n");
+}
+
+
+
+/* Write a document with a value of every kind for test_binary_encodings. */
+void write_binary_sample(json_stream_struct *js) {
+  test_json(json_start_object(js), js, NULL);
+  test_json(json_write_pair_n(js, "a", 1, JSON_NUMBER, "1", 1), js, NULL);
+  test_json(json_start_array_named_n(js, "b", 1), js, NULL);
+  test_json(json_write_int64(js, -1), js, NULL);
+  test_json(json_write_int64(js, 24), js, NULL);
+  test_json(json_write_int64(js, -500), js, NULL);
+  test_json(json_write_uint64(js, 4294967296u), js, NULL);
+  test_json(json_write_double(js, 1.5), js, NULL);
+  test_json(json_write_double(js, 100000.0), js, NULL);
+  test_json(json_write_double(js, 0.1), js, NULL);
+  test_json(json_write_double(js, 5.9604644775390625e-08), js, NULL);
+  test_json(json_write_value_n(js, JSON_TRUE, NULL, 0), js, NULL);
+  test_json(json_write_value_n(js, JSON_FALSE, NULL, 0), js, NULL);
+  test_json(json_write_value_n(js, JSON_NULL, NULL, 0), js, NULL);
+  test_json(json_write_value_n(js, JSON_NUMBER, "-2.5e1", 6), js, NULL);
+  test_json(json_write_value_n(js, JSON_STRING, "hi", 2), js, NULL);
+  test_json(json_end_context(js), js, NULL);
+  test_json(json_write_pair_n(js, "c", 1, JSON_NULL, NULL, 0), js, NULL);
+  test_json(json_end_file(js), js, NULL);
+}
+
+
+
+void test_binary_encodings() {
+  static const char cbor_sample[] = 
+    "\xbf\x61" "a\x01\x61" "b\x9f\x20\x18\x18\x39\x01\xf3\x1b\x00\x00\x00\x01\x00\x00\x00\x00"
+    "\xf9\x3e\x00\xfa\x47\xc3\x50\x00\xfb\x3f\xb9\x99\x99\x99\x99\x99\x9a\xf9\x00\x01"
+    "\xf5\xf4\xf6\xf9\xce\x40\x62hi\xff\x61" "c\xf6\xff";
+  static const char msgpack_sample[] = 
+    "\x83\xa1" "a\x01\xa1" "b\x9d\xff\x18\xd1\xfe\x0c\xcf\x00\x00\x00\x01\x00\x00\x00\x00"
+    "\xca\x3f\xc0\x00\x00\xca\x47\xc3\x50\x00\xcb\x3f\xb9\x99\x99\x99\x99\x99\x9a\xca\x33\x80\x00\x00"
+    "\xc3\xc2\xc0\xca\xc1\xc8\x00\x00\xa2hi\xa1" "c\xc0";
+  static const char cbor_arrays[] = 
+    "\x9f\x82\xa3\x61i\x01\x61" "f\xf9\x3c\x00\x61n\x62" "ab\xa3\x61i\x02\x61" "f\xf9\x38\x00\x61n\x61" "c"
+    "\x83\x01\x20\x19\x01\x2c\x82\xf5\xf4\xbf\x61k\xf5\x63key\x07\xff\xff";
+  static const char msgpack_arrays[] = 
+    "\x82\xa1k\x92\x83\xa1i\x01\xa1" "f\xca\x3f\x80\x00\x00\xa1n\xa2" "ab"
+    "\x83\xa1i\x02\xa1" "f\xca\x3f\x00\x00\x00\xa1n\xa1" "c\xa3key\xc2";
+  static const char msgpack_records[] = "\x81\xa1" "a\x01\x95\x01\x02\x03\x81\xa1x\xc3\x04";
+  static const json_field fields[] = {
+    { "i", offsetof(struct test_record, id), JSON_FIELD_INT, sizeof(int32_t) },
+    { "f", offsetof(struct test_record, ratio), JSON_FIELD_DOUBLE, sizeof(float) },
+    { "n", offsetof(struct test_record, code), JSON_FIELD_CHARS, sizeof(((struct test_record *)0)->code) }
+  };
+  static const json_key json_k = JSON_KEY("k");
+  static const json_key escaped_k = JSON_KEY("q\\\"\\u00e9\\ud83d\\ude00\\/");
+  static const char escaped_names[] = "q\"\xc3\xa9\xf0\x9f\x98\x80/\x00x\ny\x01";
+  struct test_record records[2] = {
+    { 1, 0, 0, 1.0f, 0, NULL, "ab" },
+    { 2, 0, 0, 0.5f, 0, NULL, "c" }
+  };
+  const int64_t ints[] = { 1, -1, 300 };
+  const int bools[] = { 1, 0 };
+  json_stream_struct json_stream, fragment, packed;
+  json_stream_struct *js;
+  json_struct_desc desc;
+  json_template tpl;
+  json_key key, made_k;
+  json_encoding encoding;
+  json_sink sink;
+  counting_sink cs;
+  char text[301], pulled[64], *read_back;
+  size_t len;
+  int ii;
+
+  js = &json_stream;
+  memset(text, 'x', sizeof(text) - 1);
+  text[sizeof(text) - 1] = '\0';
+
+  /* Every kind of value, in the smallest form that holds it. */
+  json_init_stream_buffer(js, true, NULL);
+  test_json(json_set_encoding(js, JSON_ENCODING_CBOR), js, NULL);
+  write_binary_sample(js);
+  test_buffer_bytes(js, cbor_sample, sizeof(cbor_sample) - 1);
+  json_free_stream(js);
+
+  json_init_stream_buffer(js, false, NULL);
+  test_json(json_set_encoding(js, JSON_ENCODING_MSGPACK), js, NULL);
+  write_binary_sample(js);
+  test_buffer_bytes(js, msgpack_sample, sizeof(msgpack_sample) - 1);
+  json_free_stream(js);
+
+  /* Half precision limits, string headers and repaired strings. */
+  json_init_stream_buffer(js, false, NULL);
+  test_json(json_set_encoding(js, JSON_ENCODING_CBOR), js, NULL);
+  json_set_utf8_policy(js, JSON_UTF8_REPLACE);
+  test_json(json_start_array(js), js, NULL);
+  test_json(json_write_double(js, 65504.0), js, NULL);
+  test_json(json_write_double(js, 65520.0), js, NULL);
+  test_json(json_write_int64(js, INT64_MIN), js, NULL);
+  test_json(json_write_value_n(js, JSON_NUMBER, "-9223372036854775808", 20), js, NULL);
+  test_json(json_write_value_n(js, JSON_NUMBER, "18446744073709551616", 20), js, NULL);
+  test_json(json_write_value_n(js, JSON_STRING, "a\xff", 2), js, NULL);
+  test_json(json_write_value_n(js, JSON_STRING, text, 300), js, NULL);
+  test_json(json_end_file(js), js, NULL);
+  if(js->stream_buffer_len != 37 + 303 + 1 || 
+     memcmp(js->stream_buffer, "\x9f\xf9\x7b\xff\xfa\x47\x7f\xf0\x00\x3b\x7f\xff\xff\xff\xff\xff\xff\xff"
+                               "\x3b\x7f\xff\xff\xff\xff\xff\xff\xff\xfa\x5f\x80\x00\x00\x64" "a\xef\xbf\xbd"
+                               "\x79\x01\x2c", 40) != 0 ||
+     (unsigned char)js->stream_buffer[js->stream_buffer_len - 1] != 0xff) {
+    test_fail("Unexpected CBOR limits.\n");
+  }
+  json_free_stream(js);
+
+  /* MessagePack headers are patched on close, growing to 16 and 32 bits. */
+  json_init_stream_buffer(js, false, NULL);
+  test_json(json_set_encoding(js, JSON_ENCODING_MSGPACK), js, NULL);
+  test_json(json_start_array(js), js, NULL);
+  test_json(json_start_array(js), js, NULL);
+  for(ii = 0; ii < 20; ++ii) test_json(json_write_int64(js, 0), js, NULL);
+  test_json(json_end_context(js), js, NULL);
+  test_json(json_write_value_n(js, JSON_STRING, text, 40), js, NULL);
+  test_json(json_write_value_n(js, JSON_STRING, text, 300), js, NULL);
+  test_json(json_start_object(js), js, NULL);
+  for(ii = 0; ii < 70000; ++ii) test_json(json_write_pair_n(js, "", 0, JSON_NULL, NULL, 0), js, NULL);
+  test_json(json_end_file(js), js, NULL);
+  len = 1 + 3 + 20 + 2 + 40 + 3 + 300 + 5 + 2 * 70000;
+  if(js->stream_buffer_len != len || memcmp(js->stream_buffer, "\x94\xdc\x00\x14\x00", 5) != 0 ||
+     memcmp(js->stream_buffer + 24, "\xd9\x28x", 3) != 0 || memcmp(js->stream_buffer + 66, "\xda\x01\x2cx", 4) != 0 ||
+     memcmp(js->stream_buffer + 369, "\xdf\x00\x01\x11\x70\xa0\xc0", 7) != 0) {
+    test_fail("Unexpected MessagePack headers.\n");
+  }
+  json_free_stream(js);
+
+  /* Bulk and struct arrays know their counts up front, and keys made for one 
+     encoding are re-encoded for another. */
+  json_init_stream_buffer(js, false, NULL);
+  test_json(json_struct_desc_make(js, &desc, fields, 3), js, NULL);
+  test_json(json_set_encoding(js, JSON_ENCODING_CBOR), js, NULL);
+  test_json(json_start_array(js), js, NULL);
+  test_json(json_write_struct_array(js, &desc, records, 2, sizeof(records[0])), js, "Attempted a call or an encoding the stream's output encoding does not support.");
+  json_struct_desc_free(js, &desc);
+  test_json(json_struct_desc_make(js, &desc, fields, 3), js, NULL);
+  test_json(json_key_make(js, &key, "key"), js, NULL);
+  test_json(json_write_struct_array(js, &desc, records, 2, sizeof(records[0])), js, NULL);
+  test_json(json_write_int64_array(js, ints, 3), js, NULL);
+  test_json(json_write_bool_array(js, bools, 2), js, NULL);
+  test_json(json_start_object(js), js, NULL);
+  test_json(json_write_pair_k(js, &json_k, JSON_TRUE, NULL, 0), js, NULL);
+  test_json(json_write_pair_int64_k(js, &key, 7), js, NULL);
+  test_json(json_end_file(js), js, NULL);
+  test_buffer_bytes(js, cbor_arrays, sizeof(cbor_arrays) - 1);
+  json_struct_desc_free(js, &desc);
+  json_free_stream(js);
+
+  json_init_stream_buffer(js, false, NULL);
+  test_json(json_set_encoding(js, JSON_ENCODING_MSGPACK), js, NULL);
+  test_json(json_struct_desc_make(js, &desc, fields, 3), js, NULL);
+  test_json(json_start_object(js), js, NULL);
+  test_json(json_write_struct_array_named_k(js, &json_k, &desc, records, 2, sizeof(records[0])), js, NULL);
+  test_json(json_write_pair_k(js, &key, JSON_FALSE, NULL, 0), js, NULL);
+  test_json(json_end_file(js), js, NULL);
+  test_buffer_bytes(js, msgpack_arrays, sizeof(msgpack_arrays) - 1);
+  json_struct_desc_free(js, &desc);
+  json_free_stream(js);
+
+  /* The CBOR key on a JSON stream. */
+  json_init_stream_buffer(js, false, NULL);
+  test_json(json_start_object(js), js, NULL);
+  test_json(json_write_pair_int64_k(js, &key, 7), js, NULL);
+  test_json(json_end_file(js), js, NULL);
+  test_buffer_contents(js, "{\"key\": 7}");
+  json_key_free(js, &key);
+
+  /* JSON keys lose their escapes when re-encoded. */
+  test_json(json_key_make(js, &made_k, "x\ny\x01"), js, NULL);
+  for(encoding = JSON_ENCODING_CBOR; encoding <= JSON_ENCODING_MSGPACK; ++encoding) {
+    json_init_stream_buffer(&packed, false, NULL);
+    test_json(json_set_encoding(&packed, encoding), &packed, NULL);
+    test_json(json_start_object(&packed), &packed, NULL);
+    test_json(json_write_pair_k(&packed, &escaped_k, JSON_NULL, NULL, 0), &packed, NULL);
+    test_json(json_write_pair_k(&packed, &made_k, JSON_NULL, NULL, 0), &packed, NULL);
+    test_json(json_end_file(&packed), &packed, NULL);
+    if(packed.stream_buffer_len != (encoding == JSON_ENCODING_CBOR ? 19u : 18u) || 
+       memcmp(packed.stream_buffer + 2, escaped_names, 9) != 0 || 
+       memcmp(packed.stream_buffer + 13, escaped_names + 10, 4) != 0) {
+      test_fail("Unexpected re-encoded keys.\n");
+    }
+    json_free_stream(&packed);
+  }
+  json_key_free(js, &made_k);
+  json_free_stream(js);
+
+  /* Records follow one another directly, and spliced fragments add to the 
+     MessagePack count. */
+  json_init_stream_buffer(js, false, NULL);
+  test_json(json_set_encoding(js, JSON_ENCODING_MSGPACK), js, NULL);
+  json_set_record_mode(js, true, 0);
+  test_json(json_start_object(js), js, NULL);
+  test_json(json_write_pair_int64_n(js, "a", 1, 1), js, NULL);
+  test_json(json_end_context(js), js, NULL);
+  test_json(json_start_array(js), js, NULL);
+  test_json(json_write_int64(js, 1), js, NULL);
+  test_json(json_init_fragment(&fragment, js), &fragment, NULL);
+  test_json(json_write_int64(&fragment, 2), &fragment, NULL);
+  test_json(json_write_int64(&fragment, 3), &fragment, NULL);
+  test_json(json_start_object(&fragment), &fragment, NULL);
+  test_json(json_write_pair_n(&fragment, "x", 1, JSON_TRUE, NULL, 0), &fragment, NULL);
+  test_json(json_end_context(&fragment), &fragment, NULL);
+  test_json(json_splice_fragment(js, &fragment), js, NULL);
+  test_json(json_write_int64(js, 4), js, NULL);
+  test_json(json_end_file(js), js, NULL);
+  test_buffer_bytes(js, msgpack_records, sizeof(msgpack_records) - 1);
+  json_free_stream(&fragment);
+  json_free_stream(js);
+
+  /* MessagePack holds a sink's output until the top-level container closes, 
+     and pulled output is limited to the closed containers. */
+  cs.out = fopen("test_msgpack.bin", "wb");
+  cs.writes = 0;
+  cs.gathered_writes = 0;
+  sink.write = counting_sink_write;
+  sink.writev = counting_sink_writev;
+  sink.flush = NULL;
+  sink.user = &cs;
+  json_init_stream_sink(js, false, &sink);
+  test_json(json_set_encoding(js, JSON_ENCODING_MSGPACK), js, NULL);
+  json_set_flush_threshold(js, 0);
+  test_json(json_start_array(js), js, NULL);
+  for(ii = 0; ii < 20; ++ii) test_json(json_write_value_n(js, JSON_STRING, text, 300), js, NULL);
+  test_json(json_flush(js), js, NULL);
+  if(cs.writes + cs.gathered_writes != 0) test_fail("MessagePack output reached the sink before its count.\n");
+  test_json(json_end_file(js), js, NULL);
+  json_free_stream(js);
+  fclose(cs.out);
+  len = 3 + 20 * 303;
+  read_back = (char *)malloc(len + 1);
+  cs.out = fopen("test_msgpack.bin", "rb");
+  if(fread(read_back, 1, len + 1, cs.out) != len || memcmp(read_back, "\xdc\x00\x14\xda\x01\x2cx", 7) != 0) {
+    test_fail("Unexpected MessagePack sink output.\n");
+  }
+  fclose(cs.out);
+  free(read_back);
+
+  json_init_stream_buffer(js, false, NULL);
+  test_json(json_set_encoding(js, JSON_ENCODING_MSGPACK), js, NULL);
+  test_json(json_start_array(js), js, NULL);
+  test_json(json_write_int64(js, 1), js, NULL);
+  if(json_pull_pending(js) != 0) test_fail("MessagePack output was pullable before its count.\n");
+  test_json(json_end_context(js), js, NULL);
+  if(json_pull(js, pulled, sizeof(pulled)) != 2 || memcmp(pulled, "\x91\x01", 2) != 0) test_fail("Unexpected pulled MessagePack.\n");
+  json_free_stream(js);
+
+  /* What the binary encodings cannot hold. */
+  json_init_stream_buffer(js, false, NULL);
+  test_json(json_set_encoding(js, (json_encoding)7), js, "Attempted a call or an encoding the stream's output encoding does not support.");
+  test_json(json_set_encoding(js, JSON_ENCODING_CBOR), js, NULL);
+  test_json(json_start_array(js), js, NULL);
+  test_json(json_set_encoding(js, JSON_ENCODING_JSON), js, "Attempted to change the output encoding after writing started.");
+  test_json(json_write_raw_value(js, "[1]", 3, true), js, "Attempted a call or an encoding the stream's output encoding does not support.");
+  test_json(json_write_value_n(js, JSON_NUMBER, "1.2.3", 5), js, "Attempted to encode number text that is not a JSON number.");
+  test_json(json_write_value_n(js, JSON_NUMBER, "", 0), js, "Attempted to encode number text that is not a JSON number.");
+  json_template_begin(&tpl, false, NULL);
+  test_json(json_set_encoding(&tpl.rec, JSON_ENCODING_CBOR), &tpl.rec, NULL);
+  test_json(json_start_array(&tpl.rec), &tpl.rec, NULL);
+  test_json(json_end_file(&tpl.rec), &tpl.rec, NULL);
+  test_json(json_template_end(&tpl), &tpl.rec, "Attempted a call or an encoding the stream's output encoding does not support.");
+  json_template_free(&tpl);
+  test_json(json_end_file(js), js, NULL);
+  test_buffer_bytes(js, "\x9f\xff", 2);
+  json_free_stream(js);
+}
+
+
+void test_pool() {
+  json_stream_pool pool;
+  json_stream_struct *streams[20];
+  json_stream_struct *js;
+  char expected[32];
+  char *buffer;
+  int ii;
+
+  /* More streams than one slab holds, all in use at once. */
+  json_pool_init(&pool, 8, 0, NULL);
+  for(ii = 0; ii < 20; ++ii) {
+    streams[ii] = json_pool_acquire(&pool, false, NULL);
+    test_json(json_start_array(streams[ii]), streams[ii], NULL);
+  }
+  for(ii = 0; ii < 20; ++ii) {
+    test_json(json_write_int64(streams[ii], ii), streams[ii], NULL);
+    test_json(json_end_file(streams[ii]), streams[ii], NULL);
+    sprintf(expected, "[%d]", ii);
+    test_buffer_contents(streams[ii], expected);
+  }
+  for(ii = 0; ii < 20; ++ii) json_pool_release(&pool, streams[ii]);
+
+  /* The last stream released is handed out next, with its buffer kept and its
+     state, including any error, reset. */
+  buffer = streams[19]->stream_buffer;
+  test_json(json_end_context(streams[19]), streams[19], "Attempted to close a context when none is open.");
+  js = json_pool_acquire(&pool, true, NULL);
+  if(js != streams[19] || js->stream_buffer != buffer) test_fail("The released stream and buffer were not reused.\n");
+  if(js->error_code != JSON_OK || strcmp(js->error_string, "") != 0) test_fail("The reused stream kept its error.\n");
+  test_json(json_start_object(js), js, NULL);
+  test_json(json_write_pair_int64_n(js, "n", 1, 1), js, NULL);
+  test_json(json_end_file(js), js, NULL);
+  test_buffer_contents(js, "{\n  \"n\": 1\n}");
+  json_pool_release(&pool, js);
+  json_pool_free(&pool);
+}
+
+
+
+void test_stats() {
+#ifdef JSON_HAVE_STATS
+  const int64_t ints[] = { 1, 2, 3 };
+  json_stream_struct json_stream;
+  json_stream_struct *js;
+  json_stats stats, snapshot;
+  json_sink sink;
+  counting_sink cs;
+
+  /* A buffer-mode stream counts every character written, once. */
+  js = &json_stream;
+  memset(&stats, 0, sizeof(stats));
+  json_init_stream_buffer(js, false, NULL);
+  test_json(json_set_stats(js, &stats, 0), js, NULL);
+  test_json(json_start_object(js), js, NULL);
+  test_json(json_write_pair(js, "a", JSON_STRING, "x"), js, NULL);
+  test_json(json_write_pair_int64_n(js, "b", 1, 2), js, NULL);
+  test_json(json_start_array_named_n(js, "c", 1), js, NULL);
+  test_json(json_write_int64_array(js, ints, 3), js, NULL);
+  test_json(json_write_double(js, 1.0 / 0.0), js, "Attempted to print a number that is not finite.");
+  test_json(json_write_pair_n(js, "d", 1, JSON_NULL, NULL, 0), js, "Attempted to print a name: value pair outside an object context.");
+  test_json(json_end_file(js), js, NULL);
+  test_buffer_contents(js, "{\"a\": \"x\",\"b\": 2,\"c\": [[1,2,3]]}");
+
+  json_stats_snapshot(js, &snapshot, true);
+  if(snapshot.bytes != js->stream_buffer_len) {
+    test_fail("Got %d bytes, Expecting %d.\n", (int)snapshot.bytes, (int)js->stream_buffer_len);
+  }
+  if(snapshot.calls[JSON_CALL_START_OBJECT] != 1 || snapshot.calls[JSON_CALL_START_ARRAY] != 1 || 
+     snapshot.calls[JSON_CALL_WRITE_PAIR] != 2 || snapshot.calls[JSON_CALL_WRITE_PAIR_NUMBER] != 1 || 
+     snapshot.calls[JSON_CALL_WRITE_ARRAY] != 1 || snapshot.calls[JSON_CALL_WRITE_NUMBER] != 1 ||
+     snapshot.calls[JSON_CALL_END_FILE] != 1 || snapshot.calls[JSON_CALL_END_CONTEXT] != 0) {
+    test_fail("Unexpected call counts.\n");
+  }
+  if(snapshot.errors[JSON_ERROR_KIND_VALUE] != 1 || snapshot.errors[JSON_ERROR_KIND_STRUCTURE] != 1) {
+    test_fail("Got %d value and %d structure errors, Expecting 1 of each.\n", 
+              (int)snapshot.errors[JSON_ERROR_KIND_VALUE], (int)snapshot.errors[JSON_ERROR_KIND_STRUCTURE]);
+  }
+  if(snapshot.max_depth != 3) test_fail("Got maximum depth %d, Expecting 3.\n", snapshot.max_depth);
+  if(strcmp(json_call_name(JSON_CALL_WRITE_PAIR), "write_pair") != 0 || 
+     strcmp(json_error_kind_name(JSON_ERROR_KIND_VALUE), "value") != 0) {
+    test_fail("Unexpected counter names.\n");
+  }
+
+  /* The reset zeroed the counters; only output after it is counted. */
+  json_stats_snapshot(js, &snapshot, false);
+  if(snapshot.bytes != 0 || snapshot.calls[JSON_CALL_END_FILE] != 0) test_fail("Counters were not reset.\n");
+  json_free_stream(js);
+
+  /* A sink-mode stream counts what reaches the sink. */
+  cs.out = fopen("test_stats.json", "w");
+  cs.writes = 0;
+  cs.gathered_writes = 0;
+  sink.write = counting_sink_write;
+  sink.writev = counting_sink_writev;
+  sink.flush = NULL;
+  sink.user = &cs;
+  memset(&stats, 0, sizeof(stats));
+  json_init_stream_sink(js, false, &sink);
+  json_set_record_mode(js, true, 1);
+  test_json(json_set_stats(js, &stats, JSON_STATS_TIME_SINK), js, NULL);
+  test_json(json_write_int64_array(js, ints, 3), js, NULL);
+  test_json(json_write_int64_array(js, ints, 2), js, NULL);
+  test_json(json_flush(js), js, NULL);
+  json_stats_snapshot(js, &snapshot, false);
+  if(snapshot.bytes != 14 || snapshot.sink_writes != (uint64_t)cs.writes || snapshot.sink_writes != 2 || 
+     snapshot.calls[JSON_CALL_FLUSH] != 1) {
+    test_fail("Got %d bytes in %d writes, Expecting 14 in 2.\n", (int)snapshot.bytes, (int)snapshot.sink_writes);
+  }
+  json_free_stream(js);
+  fclose(cs.out);
+#else
+  json_stream_struct json_stream;
+
+  json_init_stream_buffer(&json_stream, false, NULL);
+  test_json(json_set_stats(&json_stream, NULL, 0), &json_stream, "Instrumentation was not built into this library.");
+  json_free_stream(&json_stream);
+#endif
+}
+
+
+
+void test_error_cases() {
+  json_stream_struct json_stream;
+  json_stream_struct *js;
+  int ii;
+
+  js = &json_stream;
+  json_init_stream(js, true, NULL);
+
+  test_json(json_start_object(js), js, NULL);
+
+  // In an Object 
+  printf("\nIn an Object: \n");
+  test_json(json_start_object(js), js, "Attempted to open an object when not starting a file or in array context.");
+  test_json(json_start_array(js), js, "Attempted to open an array when not starting a file or in array context.");
+  test_json(json_write_value(js, JSON_STRING, "nope"), js, "Attempted to print a single value outside an array context.");
+  test_json(json_write_pair(js, "nope", 
+                            ~(JSON_OBJECT || JSON_MEMBER || JSON_PAIR || JSON_ARRAY || JSON_ELEMENT || JSON_VALUE || 
+                            JSON_STRING || JSON_NUMBER || JSON_TRUE || JSON_FALSE || JSON_NULL),
+                            "nope"), js, "Attempted to print a name: value pair value of an invalid value type.");
+  test_json(json_end_file(js), js, NULL);
+
+  // After finishing a file
+  printf("\nAfter finishing a file: \n");
+  test_json(json_start_object(js), js, "Attempted to open an object when file is already complete.");
+  test_json(json_start_array(js), js, "Attempted to open an array when file is already complete.");
+  test_json(json_end_context(js), js, "Attempted to close a context when none is open.");
+  test_json(json_write_value(js, JSON_STRING, "nope"), js, "Attempted to print a single value when no context is open.");
+  test_json(json_write_pair(js, "nope", JSON_STRING, "nope"), js, "Attempted to print a pair when no context is open.");
+
+  json_free_stream(js);
+  json_init_stream(js, true, NULL);
+
+  // Before starting a file:
+  printf("\nBefore starting a file: \n");
+  test_json(json_start_object_named(js, "nope"), js, "Attempted to start a named object when no context is open.");
+  test_json(json_start_array_named(js, "nope"), js, "Attempted to start a named array when no context is open.");
+  test_json(json_end_context(js), js, "Attempted to close a context when none is open.");
+  test_json(json_write_value(js, JSON_STRING, "nope"), js, "Attempted to print a single value when no context is open.");
+
+  test_json(json_start_array(js), js, NULL);
+  // In an Array
+  printf("\nIn an Array: \n");
+  test_json(json_start_object_named(js, "nope"), js, "Attempted to open a named object outside an object context.");
+  test_json(json_start_array_named(js, "nope"), js, "Attempted to open a named array outside an object context.");
+  test_json(json_write_value(js, 
+                             ~(JSON_OBJECT || JSON_MEMBER || JSON_PAIR || JSON_ARRAY || JSON_ELEMENT || JSON_VALUE || 
+                             JSON_STRING || JSON_NUMBER || JSON_TRUE || JSON_FALSE || JSON_NULL),
+                             "nope"), js, "Attempted to print a single value of an invalid type.");
+  test_json(json_write_pair(js, "nope", JSON_STRING, "nope"), js, "Attempted to print a name: value pair outside an object context.");
+
+  test_json(json_end_file(js), js, NULL);
+
+  json_free_stream(js);
+
+  // Past the depth limit
+  printf("\nPast the depth limit: \n");
+  json_init_stream_buffer(js, false, NULL);
+  test_json(json_set_max_depth(js, 0), js, "Attempted to set a depth limit outside 1 to MAX_JSON_NESTED_DEPTH.");
+  test_json(json_set_max_depth(js, MAX_JSON_NESTED_DEPTH + 1), js, "Attempted to set a depth limit outside 1 to MAX_JSON_NESTED_DEPTH.");
+  test_json(json_set_max_depth(js, 3), js, NULL);
+  test_json(json_start_array(js), js, NULL);
+  test_json(json_start_object(js), js, NULL);
+  test_json(json_start_array_named(js, "a"), js, NULL);
+  test_json(json_start_object(js), js, "Attempted to nest objects and arrays deeper than the depth limit.");
+  if(js->error_code != JSON_ERROR_TOO_DEEP) test_fail("Got error code %d, Expecting %d.\n", (int)js->error_code, (int)JSON_ERROR_TOO_DEEP);
+  test_json(json_write_bool_array(js, NULL, 0), js, "Attempted to nest objects and arrays deeper than the depth limit.");
+  test_json(json_end_file(js), js, NULL);
+  test_buffer_contents(js, "[{\"a\": []}]");
+  json_free_stream(js);
+
+  /* Every level the build allows can be used, with objects and arrays mixed 
+     across the frame bitset's word boundaries. */
+  json_init_stream_buffer(js, false, NULL);
+  for(ii = 0; ii < MAX_JSON_NESTED_DEPTH; ++ii) {
+    test_json(ii % 3 ? json_start_array(js) : json_start_object(js), js, NULL);
+    if(ii % 3 == 0 && ii + 1 < MAX_JSON_NESTED_DEPTH) {
+      test_json(json_start_array_named_n(js, "a", 1), js, NULL);
+      ++ii;
+    }
+  }
+  test_json(json_start_array(js), js, "Attempted to nest objects and arrays deeper than the depth limit.");
+  test_json(json_end_file(js), js, NULL);
+  if(strcmp(json_error_message(JSON_ERROR_TOO_DEEP), "Attempted to nest objects and arrays deeper than the depth limit.") != 0) {
+    test_fail("Unexpected message for JSON_ERROR_TOO_DEEP.\n");
+  }
+  json_free_stream(js);
 }
\ No newline at end of file
@@ -0,0 +1,169 @@
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include "c_json_stream.hpp"
+
+void test_cpp_scopes(); /* Write nested objects and arrays through RAII scopes. */
+void test_cpp_keys(); /* Verify compile-time key encoding. */
+void test_cpp_errors(); /* Verify the first error is kept and scopes stay quiet after it. */
+
+int test_failures = 0; /* Checks that failed; main returns nonzero if any did. */
+void test_fail(const char *format, ...); /* Print a failure and count it. */
+
+int main() {
+  printf("Testing C++ scopes and value writers.\n");
+  test_cpp_scopes();
+  printf("Complete.\n\n");
+
+  printf("Testing C++ compile-time keys.\n");
+  test_cpp_keys();
+  printf("Complete.\n\n");
+
+  printf("Testing C++ error handling.\n");
+  test_cpp_errors();
+  printf("Complete.\n\n");
+
+  if(test_failures) {
+    printf("%d checks failed.\n", test_failures);
+    return 1;
+  }
+  return 0;
+}
+
+
+
+void test_fail(const char *format, ...) {
+  va_list args;
+
+  test_failures++;
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+}
+
+
+
+void test_cpp_contents(const c_json::Stream &out, std::string_view expected) {
+  if(!out.ok()) {
+    test_fail("Got error: %s\n", out.error());
+  }
+  if(out.buffer() != expected) {
+    test_fail("Got: \"%.*s\", Expecting: \"%.*s\"\n", (int)out.buffer().size(), out.buffer().data(), 
+              (int)expected.size(), expected.data());
+  }
+}
+
+
+
+void test_cpp_scopes() {
+  static constexpr auto id_key = c_json::make_key("id");
+  std::string name("Possum");
+  const char *tag = "marsupial";
+  c_json::Stream out;
+
+  {
+    auto root = out.object();
+    root.pair(id_key, 42)
+        .pair("name", name)
+        .pair(std::string_view("ratio!", 5), 0.25f)
+        .pair("big", 18446744073709551615ull)
+        .pair("small", (short)-3)
+        .pair("alive", true)
+        .pair("owner", nullptr);
+    {
+      auto tags = root.array("tags");
+      tags.value(tag).value(std::string_view("xyz", 2)).value(false).value(-1.5);
+      tags.object().pair("k", 1u);
+      tags.array();
+    }
+    root.object(id_key).pair(id_key, 7);
+    root.pair("raw", c_json::raw("[1, {}]")).pair(id_key, c_json::raw("{\"cached\": true}", false));
+    root.array("raws").value(c_json::raw(" null "));
+  }
+  out.end_file();
+  test_cpp_contents(out, "{\"id\": 42,\"name\": \"Possum\",\"ratio\": 0.25,"
+                         "\"big\": 18446744073709551615,\"small\": -3,\"alive\": true,"
+                         "\"owner\": null,\"tags\": [\"marsupial\",\"xy\",false,-1.5,"
+                         "{\"k\": 1},[]],\"id\": {\"id\": 7},\"raw\": [1, {}],"
+                         "\"id\": {\"cached\": true},\"raws\": [ null ]}");
+}
+
+
+
+void test_cpp_keys() {
+  static constexpr auto plain_key = c_json::make_key("plain");
+  static constexpr auto escaped_key = c_json::make_key("say \"hi\"\t\x01\\");
+  static_assert(plain_key.encoded() == "\"plain\": ", "plain key");
+  static_assert(escaped_key.encoded() == "\"say \\\"hi\\\"\\t\\u0001\\\\\": ", "escaped key");
+  static const json_key c_key = JSON_KEY("c");
+  json_key made_key;
+  c_json::Stream out;
+
+  /* Keys made at compile time must match those made by the C library. */
+  if(json_key_make(&out.stream(), &made_key, "say \"hi\"\t\x01\\")) {
+    test_fail("Got error: %s\n", out.error());
+  } else {
+    if(std::string_view(made_key.bytes, made_key.len) != escaped_key.encoded()) {
+      test_fail("Got: \"%.*s\", Expecting: \"%.*s\"\n", (int)made_key.len, made_key.bytes,
+                (int)escaped_key.encoded().size(), escaped_key.encoded().data());
+    }
+  }
+
+  out.object().pair(escaped_key, "v").pair(made_key, 1).pair(c_key, 2.0);
+  out.end_file();
+  test_cpp_contents(out, "{\"say \\\"hi\\\"\\t\\u0001\\\\\": \"v\",\"say \\\"hi\\\"\\t\\u0001\\\\\": 1,"
+                         "\"c\": 2}");
+  json_key_free(&out.stream(), &made_key);
+
+  /* Compile-time keys are JSON, and re-encoded on a binary stream. */
+  c_json::Stream packed;
+  static constexpr auto quoted_key = c_json::make_key("a\"b");
+  packed.encoding(JSON_ENCODING_MSGPACK).object().pair(plain_key, 1).pair(c_key, -1).pair(quoted_key, 2);
+  packed.end_file();
+  test_cpp_contents(packed, std::string_view("\x83\xa5plain\x01\xa1" "c\xff\xa3" "a\"b\x02", 16));
+}
+
+
+
+void test_cpp_errors() {
+  c_json::Stream out;
+
+  {
+    auto list = out.array();
+    list.value(1);
+    /* A pair in an array fails, and the calls after it, including closing the
+       scope, do nothing. */
+    out.pair("misplaced", 2);
+    list.value(3);
+  }
+  if(out.ok()) {
+    test_fail("No error reported. Expecting: \"%s\"\n", "Attempted to print a name: value pair outside an object context.");
+  } else if(strcmp(out.error(), "Attempted to print a name: value pair outside an object context.") != 0) {
+    test_fail("Got: \"%s\", Expecting: \"%s\"\n", out.error(), "Attempted to print a name: value pair outside an object context.");
+  } else {
+    printf("Correctly reported error: \"%s\"\n", out.error());
+  }
+  if(out.error_code() != JSON_ERROR_PAIR_CONTEXT) {
+    test_fail("Got error code %d, Expecting: %d\n", (int)out.error_code(), (int)JSON_ERROR_PAIR_CONTEXT);
+  }
+  if(out.buffer() != "[1") {
+    test_fail("Got: \"%.*s\", Expecting: \"[1\"\n", (int)out.buffer().size(), out.buffer().data());
+  }
+
+  /* So is raw JSON that fails validation. */
+  c_json::Stream raw_out;
+  raw_out.array().value(c_json::raw("[1,"));
+  if(raw_out.error_code() != JSON_ERROR_RAW_INVALID) {
+    test_fail("Got: \"%s\", Expecting: \"%s\"\n", raw_out.error(), json_error_message(JSON_ERROR_RAW_INVALID));
+  }
+
+  /* A double that JSON cannot represent is reported the same way. */
+  c_json::Stream nan_out;
+  nan_out.array().value(1.0 / 0.0);
+  if(strcmp(nan_out.error(), "Attempted to print a number that is not finite.") != 0) {
+    test_fail("Got: \"%s\", Expecting: \"%s\"\n", nan_out.error(), "Attempted to print a number that is not finite.");
+  }
+}